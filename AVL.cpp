@@ -78,20 +78,25 @@ AVLNode *avl_fix_right(AVLNode *root) {
 
 AVLNode *avl_fix(AVLNode *node) {
     while (true){
+        // a rotation replaces the subtree root, relink it into the parent
+        AVLNode *parent = node->parent;
+        AVLNode **from = &node;
+        if (parent) {
+            from = parent->left == node ? &parent->left : &parent->right;
+        }
         avl_update(node);
         uint32_t l = avl_depth(node->left);
         uint32_t r = avl_depth(node->right);
-        AVLNode *parent = node->parent;
         if (l==r+2){
-            node = avl_fix_left(node);
+            *from = avl_fix_left(node);
         }
         else if (l+2==r) {
-            node = avl_fix_right(node);
+            *from = avl_fix_right(node);
         } 
         if (!parent) {
-            return node;
+            return *from;
         }
-        node = node->parent;
+        node = parent;
     }
 }
 
@@ -131,4 +136,74 @@ AVLNode *avl_del(AVLNode *node) {
             return victim;
         }
     }
-}
\ No newline at end of file
+}
+
+uint64_t avl_rank(AVLNode *node) {
+    uint64_t rank = avl_count(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_count(node->parent->left) + 1;
+        }
+    }
+    return rank;
+}
+
+AVLNode *avl_nth(AVLNode *root, uint64_t rank) {
+    AVLNode *node = root;
+    while (node) {
+        uint64_t left = avl_count(node->left);
+        if (rank == left) {
+            return node;
+        }
+        if (rank < left) {
+            node = node->left;
+        } else {
+            rank -= left + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+AVLNode *avl_next(AVLNode *node) {
+    if (node->right) {
+        for (node = node->right; node->left; node = node->left) {}
+        return node;
+    }
+    while (node->parent && node->parent->right == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+AVLNode *avl_prev(AVLNode *node) {
+    if (node->left) {
+        for (node = node->left; node->right; node = node->right) {}
+        return node;
+    }
+    while (node->parent && node->parent->left == node) {
+        node = node->parent;
+    }
+    return node->parent;
+}
+
+// The middle node is the root; subtree sizes differ by at most one at
+// every level, so the depths do too
+AVLNode *avl_build(AVLNode **nodes, size_t n) {
+    if (n == 0) {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *root = nodes[mid];
+    root->parent = NULL;
+    root->left = avl_build(nodes, mid);
+    root->right = avl_build(nodes + mid + 1, n - mid - 1);
+    if (root->left) {
+        root->left->parent = root;
+    }
+    if (root->right) {
+        root->right->parent = root;
+    }
+    avl_update(root);
+    return root;
+}
@@ -25,4 +25,15 @@ struct AVLNode {
 uint32_t avl_count(AVLNode *node);
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
-void avl_init(AVLNode *node);
\ No newline at end of file
+void avl_init(AVLNode *node);
+// 0-based position of `node` in its tree, from the subtree counts
+uint64_t avl_rank(AVLNode *node);
+// The node at 0-based position `rank` under `root`, or NULL
+AVLNode *avl_nth(AVLNode *root, uint64_t rank);
+// In-order successor and predecessor, or NULL at either end. Walking a
+// range with these visits each edge at most twice: amortized O(1).
+AVLNode *avl_next(AVLNode *node);
+AVLNode *avl_prev(AVLNode *node);
+// A balanced tree over nodes[0..n), taken as in-order, built in O(n);
+// returns the root
+AVLNode *avl_build(AVLNode **nodes, size_t n);
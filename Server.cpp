@@ -14,80 +14,154 @@
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
+#if defined(__linux__)
+#include <sys/epoll.h>   // for epoll_create1, epoll_ctl, epoll_wait
+#endif
 #include "utils.h"
 #include "DList.h"
 #include "timer.h"
+#include "shard.h"
+#include "uring.h"
+#include "log.h"
+#include "hashtable.h"
+
+#if defined(__linux__)
+// Interest set for a connection. Edge-triggered, so the handlers must drain
+// the socket until EAGAIN (connection_io does). Reads stay enabled while
+// replies are queued; a parked connection only waits to send those.
+static uint32_t conn_events(Conn *conn) {
+    uint32_t events = EPOLLET;
+    if (conn->closing) {
+        return events; // waits for its forwarded reply, then goes
+    }
+    if (conn->state != STATE_WAIT) {
+        events |= EPOLLIN;
+    }
+    if (conn_pending_output(conn)) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static void epoll_update(int epfd, int op, int fd, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+        die("epoll_ctl()");
+    }
+}
+#endif
 
 static int32_t accept_new_connection(int fd, std::vector<Conn *> &fd2conn) {
     struct sockaddr_in addr = {};
     socklen_t addr_len = sizeof(addr);
     int new_fd = accept(fd, (struct sockaddr *)&addr, &addr_len);
     if (new_fd < 0) {
-        perror("accept()");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(LOG_WARN, "accept(): errno %lld", errno);
+        }
         return -1;
     }
-    Conn *conn = (Conn *)malloc(sizeof(Conn));
+    fd_set_nb(new_fd);
+    Conn *conn = conn_new(new_fd, fd2conn);
     if (!conn) {
-        perror("malloc()");
-        close(new_fd);
         return -1;
     }
-    // Initialize the connection structure
-    memset(conn, 0, sizeof(Conn));
-    conn->fd = new_fd;
-    conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn->idle_start = get_monotonic_usec();
-    
-    // Initialize the idle_list before inserting it
-    dList_init(&conn->idle_list);
-    list_insert_before(&g_data.idle_list, &conn->idle_list);
-    conn_put(fd2conn, conn);
+#if defined(__linux__)
+    epoll_update(g_data.epfd, EPOLL_CTL_ADD, new_fd, conn_events(conn));
+#endif
     return 0;
 }
 
-int main() {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
+#if defined(__linux__)
+static void event_loop(int fd) {
+    g_data.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_data.epfd < 0) {
+        die("epoll_create1()");
     }
-    dList_init(&g_data.idle_list);
-    thread_pool_init(&g_data.tp, 4);
-
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);              // CORRECTED: htons, not ntohs
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); // CORRECTED: htonl(0) -> htonl(INADDR_ANY)
-
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("bind()");
+    epoll_update(g_data.epfd, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLET);
+    int wake_fd = -1;
+    if (!g_shards.empty()) {
+        wake_fd = g_shards[g_shard_id]->wake_rfd;
+        epoll_update(g_data.epfd, EPOLL_CTL_ADD, wake_fd, EPOLLIN | EPOLLET);
     }
 
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        die("listen()");
+    const int k_max_events = 256;
+    struct epoll_event events[k_max_events];
+    std::vector<Conn *> resumed;
+    while (true) {
+        int timeout_ms = (int)next_timer_ms();
+        int n = epoll_wait(g_data.epfd, events, k_max_events, timeout_ms);
+        if (n < 0 && errno != EINTR) {
+            die("epoll_wait()");
+        }
+        // Only the ready fds are visited
+        for (int i = 0; i < n; i++) {
+            int ready_fd = events[i].data.fd;
+            if (ready_fd == fd) {
+                // Edge-triggered: accept until the backlog is empty
+                while (accept_new_connection(fd, g_data.fd2conn) == 0) {}
+                continue;
+            }
+            if (ready_fd == wake_fd) {
+                // Forwarded commands to run, or replies for parked clients
+                resumed.clear();
+                shard_drain(resumed);
+                for (Conn *conn : resumed) {
+                    if (conn->state == STATE_END) {
+                        conn_destroy(conn);
+                    } else {
+                        epoll_update(g_data.epfd, EPOLL_CTL_MOD, conn->fd, conn_events(conn));
+                    }
+                }
+                continue;
+            }
+            if (ready_fd < 0 || ready_fd >= (int)g_data.fd2conn.size()) {
+                continue;
+            }
+            Conn *conn = g_data.fd2conn[ready_fd];
+            if (!conn) {
+                continue;
+            }
+            uint32_t old_events = conn_events(conn);
+            connection_io(conn);
+            if (conn->state == STATE_END) {
+                conn_destroy(conn);
+            } else if (conn_events(conn) != old_events) {
+                // Re-arming also re-checks readiness, so no edge is lost
+                epoll_update(g_data.epfd, EPOLL_CTL_MOD, conn->fd, conn_events(conn));
+            }
+        }
+
+        // Process idle timeouts
+        process_timers();
     }
-    fd_set_nb(fd); // Set the socket to non-blocking mode
+}
+#else
+static void event_loop(int fd) {
     std::vector<struct pollfd> poll_args;
+    std::vector<Conn *> resumed;
+    int wake_fd = g_shards[g_shard_id]->wake_rfd;
     while (true) {
         poll_args.clear();
         
         // Add the listening socket
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        // and the mailbox, for thread-pool jobs that are done
+        pfd = {wake_fd, POLLIN, 0};
+        poll_args.push_back(pfd);
         
         // Add all client connections
         for (Conn *conn : g_data.fd2conn) {
-            if (!conn) continue; // Skip null pointers
+            if (!conn || conn->closing) continue; // Skip null and failed parked ones
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            pfd.events = (conn->state != STATE_WAIT) ? POLLIN : 0;
+            if (conn_pending_output(conn)) {
+                pfd.events |= POLLOUT;
+            }
             pfd.events = pfd.events | POLLERR;
             poll_args.push_back(pfd);
         }
@@ -104,6 +178,14 @@ int main() {
                 if (i == 0) {
                     // This is the listening socket
                     (void)accept_new_connection(fd, g_data.fd2conn);
+                } else if (i == 1) {
+                    resumed.clear();
+                    shard_drain(resumed);
+                    for (Conn *conn : resumed) {
+                        if (conn->state == STATE_END) {
+                            conn_destroy(conn);
+                        }
+                    }
                 } else {
                     // This is a client connection
                     int client_fd = poll_args[i].fd;
@@ -117,10 +199,7 @@ int main() {
                     
                     connection_io(conn);
                     if (conn->state == STATE_END) {
-                        g_data.fd2conn[conn->fd] = NULL;
-                        (void)close(conn->fd);
-                        dlist_detach(&conn->idle_list);
-                        free(conn);
+                        conn_destroy(conn);
                     }
                 }
             }
@@ -129,7 +208,113 @@ int main() {
         // Process idle timeouts
         process_timers();
     }
-    return 0;
+}
+#endif
+
+static int listen_socket(bool reuseport) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport) {
+        // every loop listens on the same port; the kernel spreads accepts
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+            die("setsockopt(SO_REUSEPORT)");
+        }
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(1234);              // CORRECTED: htons, not ntohs
+    addr.sin_addr.s_addr = htonl(INADDR_ANY); // CORRECTED: htonl(0) -> htonl(INADDR_ANY)
+
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv) {
+        die("bind()");
+    }
+
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen()");
+    }
+    fd_set_nb(fd); // Set the socket to non-blocking mode
+    return fd;
 }
 
+// Body of one event loop; the loop owns the thread-local g_data shard
+static void *loop_main(void *arg) {
+    g_shard_id = (size_t)arg;
+    dList_init(&g_data.idle_list);
+    thread_pool_init(&g_data.tp, 4);
+    if (g_shards.size() > 1) {
+        shard_publish_db(&g_data.db);
+    }
+    int fd = listen_socket(g_shards.size() > 1);
+    if (g_use_uring && uring_event_loop(fd)) {
+        return NULL;
+    }
+    event_loop(fd);
+    return NULL;
+}
 
+int main(int argc, char **argv) {
+    size_t nloops = 1;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--loops") == 0) {
+            nloops = (size_t)atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "--max-msg") == 0) {
+            g_max_msg = (size_t)atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            g_use_uring = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "--hmap") == 0) {
+            const char *engine = argv[++i];
+            if (strcmp(engine, "swiss") == 0) {
+                g_hm_engine = HM_SWISS;
+            } else if (strcmp(engine, "chain") != 0) {
+                fprintf(stderr, "--hmap takes chain or swiss\n");
+                return 1;
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "--zset") == 0) {
+            const char *index = argv[++i];
+            if (strcmp(index, "btree") == 0) {
+                g_zset_index = ZS_BTREE;
+            } else if (strcmp(index, "avl") != 0) {
+                fprintf(stderr, "--zset takes avl or btree\n");
+                return 1;
+            }
+        } else if (i + 1 < argc && strcmp(argv[i], "--zset-small") == 0) {
+            g_zset_small_max = (uint32_t)atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "--zset-small-len") == 0) {
+            g_zset_small_len = (uint32_t)atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "--log-level") == 0) {
+            g_log_level = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--loops N] [--max-msg BYTES] [--io-uring] [--hmap chain|swiss] [--zset avl|btree] [--zset-small N] [--zset-small-len BYTES] [--log-level 0-4]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nloops < 1 || g_max_msg < 16 || g_max_msg > k_max_msg) {
+        fprintf(stderr, "--loops must be >= 1, --max-msg in [16, %zu]\n", k_max_msg);
+        return 1;
+    }
+#if !defined(__linux__)
+    if (nloops > 1) {
+        fprintf(stderr, "--loops requires epoll, running a single loop\n");
+        nloops = 1;
+    }
+#endif
+    log_start();
+    // a single loop gets a mailbox too, for its thread-pool jobs
+    shards_init(nloops);
+    for (size_t i = 1; i < nloops; i++) {
+        int rv = pthread_create(&g_shards[i]->thread, NULL, &loop_main, (void *)i);
+        if (rv) {
+            die("pthread_create()");
+        }
+    }
+    loop_main((void *)0);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <cstdlib>       // for malloc, free
+#include <algorithm>     // for std::min, std::max
+#include "arena.h"
+#include "utils.h"
+
+static size_t arena_round(size_t size) {
+    return (size + k_arena_align - 1) & ~(k_arena_align - 1);
+}
+
+static ArenaChunk *chunk_new(Arena *arena, size_t bytes) {
+    ArenaChunk *chunk = (ArenaChunk *)malloc(sizeof(ArenaChunk) + bytes);
+    if (!chunk) {
+        die("out of memory");
+    }
+    chunk->prev = NULL;
+    chunk->next = arena->chunks;
+    if (arena->chunks) {
+        arena->chunks->prev = chunk;
+    }
+    arena->chunks = chunk;
+    return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = arena_round(size ? size : 1);
+    if (size > k_arena_classes * k_arena_align) {
+        return chunk_new(arena, size) + 1;
+    }
+    void **head = &arena->free_lists[size / k_arena_align - 1];
+    if (*head) {
+        void *ptr = *head;
+        *head = *(void **)ptr;
+        return ptr;
+    }
+    if ((size_t)(arena->bump_end - arena->bump) < size) {
+        // Grow by a quarter of what is held, so the unused part of the
+        // newest chunk stays small next to the rest. The old tail, smaller
+        // than one block, is left unused.
+        size_t bytes = std::min(std::max(arena->held / 4, k_arena_chunk_min), k_arena_chunk_max);
+        arena->bump = (uint8_t *)(chunk_new(arena, bytes) + 1);
+        arena->bump_end = arena->bump + bytes;
+        arena->held += bytes;
+    }
+    void *ptr = arena->bump;
+    arena->bump += size;
+    return ptr;
+}
+
+void arena_free(Arena *arena, void *ptr, size_t size) {
+    size = arena_round(size ? size : 1);
+    if (size > k_arena_classes * k_arena_align) {
+        ArenaChunk *chunk = (ArenaChunk *)ptr - 1;
+        if (chunk->prev) {
+            chunk->prev->next = chunk->next;
+        } else {
+            arena->chunks = chunk->next;
+        }
+        if (chunk->next) {
+            chunk->next->prev = chunk->prev;
+        }
+        free(chunk);
+        return;
+    }
+    void **head = &arena->free_lists[size / k_arena_align - 1];
+    *(void **)ptr = *head;
+    *head = ptr;
+}
+
+void arena_clear(Arena *arena) {
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *arena = Arena{};
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>       // for size_t
+#include <cstdint>       // for uint8_t
+
+// Chunked allocator for many small blocks that share one owner, such as
+// the members of one sorted set. Blocks are carved from large chunks and
+// recycled through free lists kept per 16-byte size class; blocks too
+// big for a class get a chunk of their own. Dropping the owner releases
+// whole chunks without visiting the blocks in them.
+struct ArenaChunk {
+    ArenaChunk *prev;
+    ArenaChunk *next;
+};
+
+const size_t k_arena_align = 16;
+const size_t k_arena_classes = 32;      // block sizes 16 .. 512 bytes
+const size_t k_arena_chunk_min = 512;
+const size_t k_arena_chunk_max = 1 << 20;
+
+struct Arena {
+    ArenaChunk *chunks = NULL;
+    uint8_t *bump = NULL;     // unused tail of the newest chunk
+    uint8_t *bump_end = NULL;
+    size_t held = 0;          // bytes in bump-allocated chunks
+    void *free_lists[k_arena_classes] = {};
+};
+
+// Blocks are 16-byte aligned; `size` must be passed again to arena_free
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena, void *ptr, size_t size);
+// Releases every chunk; blocks still in use are freed with them
+void arena_clear(Arena *arena);
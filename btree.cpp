@@ -0,0 +1,495 @@
+#include <cassert>       // for assert
+#include <cstring>       // for memcpy, memmove, memcmp
+#include <vector>
+#include "btree.h"
+#include "zset.h"
+#include "utils.h"
+
+// Compare the entry (s, node) against the key (score, name): <0, 0 or >0
+static int key_cmp(double s, const ZNode *node, double score, const char *name, size_t len) {
+    if (s != score) {
+        return s < score ? -1 : 1;
+    }
+    size_t min_len = node->len < len ? node->len : len;
+    int cmp = memcmp(node->name, name, min_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return node->len < len ? -1 : (node->len > len ? 1 : 0);
+}
+
+// The member's back pointer to the leaf holding it
+static BTLeaf *&leaf_of(ZNode *node) {
+    return znode_links(node)->leaf;
+}
+
+static BTLeaf *as_leaf(BTNode *node) {
+    return container_of(node, BTLeaf, hdr);
+}
+
+static BTInner *as_inner(BTNode *node) {
+    return container_of(node, BTInner, hdr);
+}
+
+// The child whose range holds the key: the last one with key i <= key
+static uint32_t inner_pick(BTInner *in, double score, const char *name, size_t len) {
+    uint32_t lo = 1, hi = in->hdr.n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_cmp(in->scores[mid], in->keys[mid], score, name, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+// The first entry at or after the key
+static uint32_t leaf_lower(BTLeaf *leaf, double score, const char *name, size_t len) {
+    uint32_t lo = 0, hi = leaf->hdr.n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_cmp(leaf->scores[mid], leaf->items[mid], score, name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Entries (or, in an inner node, children after the first) with a score
+// below `score`, or at most `score` if `inclusive`; only doubles are read
+static uint32_t scores_below(const double *scores, uint32_t lo, uint32_t hi, double score, bool inclusive) {
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (scores[mid] < score || (inclusive && scores[mid] == score)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Position of a member in its leaf: search the scores, then match the
+// pointer within the run of equal scores
+static uint32_t leaf_index(BTLeaf *leaf, ZNode *node) {
+    uint32_t i = scores_below(leaf->scores, 0, leaf->hdr.n, node->score, false);
+    while (leaf->items[i] != node) {
+        i++;
+        assert(i < leaf->hdr.n);
+    }
+    return i;
+}
+
+static uint32_t kid_index(BTInner *in, BTNode *kid) {
+    uint32_t i = 0;
+    while (in->kids[i] != kid) {
+        i++;
+        assert(i < in->hdr.n);
+    }
+    return i;
+}
+
+static uint64_t node_count(BTNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+    uint64_t count = 0;
+    BTInner *in = as_inner(node);
+    for (uint32_t i = 0; i < node->n; i++) {
+        count += in->counts[i];
+    }
+    return count;
+}
+
+// Make room for a child at slot i
+static void inner_open(BTInner *in, uint32_t i) {
+    uint32_t tail = in->hdr.n - i;
+    memmove(in->scores + i + 1, in->scores + i, tail * sizeof(in->scores[0]));
+    memmove(in->keys + i + 1, in->keys + i, tail * sizeof(in->keys[0]));
+    memmove(in->counts + i + 1, in->counts + i, tail * sizeof(in->counts[0]));
+    memmove(in->kids + i + 1, in->kids + i, tail * sizeof(in->kids[0]));
+    in->hdr.n++;
+}
+
+static void inner_close(BTInner *in, uint32_t i) {
+    uint32_t tail = in->hdr.n - i - 1;
+    memmove(in->scores + i, in->scores + i + 1, tail * sizeof(in->scores[0]));
+    memmove(in->keys + i, in->keys + i + 1, tail * sizeof(in->keys[0]));
+    memmove(in->counts + i, in->counts + i + 1, tail * sizeof(in->counts[0]));
+    memmove(in->kids + i, in->kids + i + 1, tail * sizeof(in->kids[0]));
+    in->hdr.n--;
+}
+
+// Split the full child i of a non-full inner node in two halves
+static void split_kid(BTInner *in, uint32_t i) {
+    const uint32_t half = k_bt_order / 2;
+    BTNode *kid = in->kids[i];
+    BTNode *sib = NULL;
+    if (kid->leaf) {
+        BTLeaf *l = as_leaf(kid);
+        BTLeaf *r = new BTLeaf();
+        r->hdr.n = l->hdr.n - half;
+        memcpy(r->scores, l->scores + half, r->hdr.n * sizeof(r->scores[0]));
+        memcpy(r->items, l->items + half, r->hdr.n * sizeof(r->items[0]));
+        for (uint32_t j = 0; j < r->hdr.n; j++) {
+            leaf_of(r->items[j]) = r;
+        }
+        l->hdr.n = half;
+        r->next = l->next;
+        if (r->next) {
+            r->next->prev = r;
+        }
+        r->prev = l;
+        l->next = r;
+        sib = &r->hdr;
+        inner_open(in, i + 1);
+        in->scores[i + 1] = r->scores[0];
+        in->keys[i + 1] = r->items[0];
+    } else {
+        BTInner *l = as_inner(kid);
+        BTInner *r = new BTInner();
+        r->hdr.leaf = false;
+        r->hdr.n = l->hdr.n - half;
+        memcpy(r->scores, l->scores + half, r->hdr.n * sizeof(r->scores[0]));
+        memcpy(r->keys, l->keys + half, r->hdr.n * sizeof(r->keys[0]));
+        memcpy(r->counts, l->counts + half, r->hdr.n * sizeof(r->counts[0]));
+        memcpy(r->kids, l->kids + half, r->hdr.n * sizeof(r->kids[0]));
+        for (uint32_t j = 0; j < r->hdr.n; j++) {
+            r->kids[j]->parent = r;
+        }
+        l->hdr.n = half;
+        sib = &r->hdr;
+        inner_open(in, i + 1);
+        in->scores[i + 1] = r->scores[0]; // r's key 0 moves up
+        in->keys[i + 1] = r->keys[0];
+    }
+    sib->parent = in;
+    in->kids[i + 1] = sib;
+    in->counts[i + 1] = node_count(sib);
+    in->counts[i] -= in->counts[i + 1];
+}
+
+// Full nodes are split on the way down, so a split never cascades upward
+void bt_insert(BTree *tree, ZNode *node) {
+    if (!tree->root) {
+        tree->root = &(new BTLeaf())->hdr;
+    }
+    if (tree->root->n == k_bt_order) {
+        BTInner *root = new BTInner();
+        root->hdr.leaf = false;
+        root->hdr.n = 1;
+        root->kids[0] = tree->root;
+        root->counts[0] = tree->size;
+        tree->root->parent = root;
+        tree->root = &root->hdr;
+        split_kid(root, 0);
+    }
+    BTNode *cur = tree->root;
+    while (!cur->leaf) {
+        BTInner *in = as_inner(cur);
+        uint32_t i = inner_pick(in, node->score, node->name, node->len);
+        if (in->kids[i]->n == k_bt_order) {
+            split_kid(in, i);
+            if (key_cmp(in->scores[i + 1], in->keys[i + 1], node->score, node->name, node->len) <= 0) {
+                i++;
+            }
+        }
+        in->counts[i]++;
+        cur = in->kids[i];
+    }
+    BTLeaf *leaf = as_leaf(cur);
+    uint32_t pos = leaf_lower(leaf, node->score, node->name, node->len);
+    uint32_t tail = leaf->hdr.n - pos;
+    memmove(leaf->scores + pos + 1, leaf->scores + pos, tail * sizeof(leaf->scores[0]));
+    memmove(leaf->items + pos + 1, leaf->items + pos, tail * sizeof(leaf->items[0]));
+    leaf->scores[pos] = node->score;
+    leaf->items[pos] = node;
+    leaf->hdr.n++;
+    leaf_of(node) = leaf;
+    tree->size++;
+}
+
+static void node_free(BTNode *node) {
+    if (node->leaf) {
+        BTLeaf *leaf = as_leaf(node);
+        if (leaf->prev) {
+            leaf->prev->next = leaf->next;
+        }
+        if (leaf->next) {
+            leaf->next->prev = leaf->prev;
+        }
+        delete leaf;
+    } else {
+        delete as_inner(node);
+    }
+}
+
+// Append child i + 1 of `in` to child i and drop it
+static void merge_kids(BTInner *in, uint32_t i) {
+    BTNode *left = in->kids[i];
+    BTNode *right = in->kids[i + 1];
+    if (left->leaf) {
+        BTLeaf *l = as_leaf(left), *r = as_leaf(right);
+        memcpy(l->scores + l->hdr.n, r->scores, r->hdr.n * sizeof(r->scores[0]));
+        memcpy(l->items + l->hdr.n, r->items, r->hdr.n * sizeof(r->items[0]));
+        for (uint32_t j = 0; j < r->hdr.n; j++) {
+            leaf_of(r->items[j]) = l;
+        }
+    } else {
+        BTInner *l = as_inner(left), *r = as_inner(right);
+        // r's unused key 0 may be stale, its separator in `in` is not
+        r->scores[0] = in->scores[i + 1];
+        r->keys[0] = in->keys[i + 1];
+        memcpy(l->scores + l->hdr.n, r->scores, r->hdr.n * sizeof(r->scores[0]));
+        memcpy(l->keys + l->hdr.n, r->keys, r->hdr.n * sizeof(r->keys[0]));
+        memcpy(l->counts + l->hdr.n, r->counts, r->hdr.n * sizeof(r->counts[0]));
+        memcpy(l->kids + l->hdr.n, r->kids, r->hdr.n * sizeof(r->kids[0]));
+        for (uint32_t j = 0; j < r->hdr.n; j++) {
+            r->kids[j]->parent = l;
+        }
+    }
+    left->n += right->n;
+    in->counts[i] += in->counts[i + 1];
+    inner_close(in, i + 1);
+    node_free(right);
+}
+
+// After a removal: drop empty nodes, merge a sparse node into a neighbour
+// that has room, and shrink the root while it has a single child
+static void bt_fix(BTree *tree, BTNode *node) {
+    const uint32_t k_low = k_bt_order / 4, k_merged_max = k_bt_order * 3 / 4;
+    for (BTInner *p = node->parent; p; node = &p->hdr, p = p->hdr.parent) {
+        uint32_t i = kid_index(p, node);
+        if (node->n == 0) {
+            inner_close(p, i);
+            node_free(node);
+        } else if (node->n < k_low && i + 1 < p->hdr.n && node->n + p->kids[i + 1]->n <= k_merged_max) {
+            merge_kids(p, i);
+        } else if (node->n < k_low && i > 0 && node->n + p->kids[i - 1]->n <= k_merged_max) {
+            merge_kids(p, i - 1);
+        } else {
+            return;
+        }
+    }
+    while (tree->root && !tree->root->leaf && tree->root->n <= 1) {
+        BTNode *root = tree->root;
+        tree->root = root->n ? as_inner(root)->kids[0] : NULL;
+        if (tree->root) {
+            tree->root->parent = NULL;
+        }
+        node_free(root);
+    }
+    if (tree->root && tree->root->n == 0) {
+        node_free(tree->root);
+        tree->root = NULL;
+    }
+}
+
+void bt_remove(BTree *tree, ZNode *node) {
+    BTLeaf *leaf = leaf_of(node);
+    uint32_t pos = leaf_index(leaf, node);
+    ZNode *succ = bt_next(node);
+    uint32_t tail = leaf->hdr.n - pos - 1;
+    memmove(leaf->scores + pos, leaf->scores + pos + 1, tail * sizeof(leaf->scores[0]));
+    memmove(leaf->items + pos, leaf->items + pos + 1, tail * sizeof(leaf->items[0]));
+    leaf->hdr.n--;
+    tree->size--;
+    // a separator naming the member is replaced by its successor, which
+    // is the new lowest entry of that subtree
+    BTNode *cur = &leaf->hdr;
+    for (BTInner *p = cur->parent; p; cur = &p->hdr, p = p->hdr.parent) {
+        uint32_t i = kid_index(p, cur);
+        p->counts[i]--;
+        if (p->keys[i] == node) {
+            p->keys[i] = succ;
+            p->scores[i] = succ ? succ->score : 0;
+        }
+    }
+    bt_fix(tree, &leaf->hdr);
+}
+
+ZNode *bt_seek(BTree *tree, double score, const char *name, size_t len) {
+    BTNode *cur = tree->root;
+    if (!cur) {
+        return NULL;
+    }
+    while (!cur->leaf) {
+        BTInner *in = as_inner(cur);
+        cur = in->kids[inner_pick(in, score, name, len)];
+    }
+    BTLeaf *leaf = as_leaf(cur);
+    uint32_t pos = leaf_lower(leaf, score, name, len);
+    if (pos < leaf->hdr.n) {
+        return leaf->items[pos];
+    }
+    return leaf->next ? leaf->next->items[0] : NULL;
+}
+
+// Members are separate allocations; a scan touches each one, so fetch a
+// few ahead from the leaf's pointer array
+const uint32_t k_bt_prefetch = 8;
+
+ZNode *bt_next(ZNode *node) {
+    BTLeaf *leaf = leaf_of(node);
+    uint32_t pos = leaf_index(leaf, node);
+    if (pos + k_bt_prefetch < leaf->hdr.n) {
+        __builtin_prefetch(leaf->items[pos + k_bt_prefetch]);
+    } else if (leaf->next) {
+        __builtin_prefetch(leaf->next->items[pos + k_bt_prefetch - leaf->hdr.n]);
+    }
+    if (pos + 1 < leaf->hdr.n) {
+        return leaf->items[pos + 1];
+    }
+    return leaf->next ? leaf->next->items[0] : NULL;
+}
+
+ZNode *bt_prev(ZNode *node) {
+    BTLeaf *leaf = leaf_of(node);
+    uint32_t pos = leaf_index(leaf, node);
+    if (pos >= k_bt_prefetch) {
+        __builtin_prefetch(leaf->items[pos - k_bt_prefetch]);
+    } else if (leaf->prev && leaf->prev->hdr.n + pos >= k_bt_prefetch) {
+        __builtin_prefetch(leaf->prev->items[leaf->prev->hdr.n + pos - k_bt_prefetch]);
+    }
+    if (pos > 0) {
+        return leaf->items[pos - 1];
+    }
+    return leaf->prev ? leaf->prev->items[leaf->prev->hdr.n - 1] : NULL;
+}
+
+uint64_t bt_rank(ZNode *node) {
+    BTLeaf *leaf = leaf_of(node);
+    uint64_t rank = leaf_index(leaf, node);
+    BTNode *cur = &leaf->hdr;
+    for (BTInner *p = cur->parent; p; cur = &p->hdr, p = p->hdr.parent) {
+        for (uint32_t i = 0; p->kids[i] != cur; i++) {
+            rank += p->counts[i];
+        }
+    }
+    return rank;
+}
+
+ZNode *bt_nth(BTree *tree, uint64_t rank) {
+    if (rank >= tree->size) {
+        return NULL;
+    }
+    BTNode *cur = tree->root;
+    while (!cur->leaf) {
+        BTInner *in = as_inner(cur);
+        uint32_t i = 0;
+        while (rank >= in->counts[i]) {
+            rank -= in->counts[i++];
+        }
+        cur = in->kids[i];
+    }
+    return as_leaf(cur)->items[rank];
+}
+
+uint64_t bt_count_below(BTree *tree, double score, bool inclusive) {
+    uint64_t count = 0;
+    BTNode *cur = tree->root;
+    if (!cur) {
+        return 0;
+    }
+    // children before the chosen one hold only lower scores
+    while (!cur->leaf) {
+        BTInner *in = as_inner(cur);
+        uint32_t i = scores_below(in->scores, 1, in->hdr.n, score, inclusive) - 1;
+        for (uint32_t j = 0; j < i; j++) {
+            count += in->counts[j];
+        }
+        cur = in->kids[i];
+    }
+    BTLeaf *leaf = as_leaf(cur);
+    return count + scores_below(leaf->scores, 0, leaf->hdr.n, score, inclusive);
+}
+
+// Nodes are filled to three quarters, split as evenly as possible, so
+// each holds at least k_bt_order * 3 / 8 entries unless it is the root
+void bt_build(BTree *tree, ZNode **nodes, size_t n) {
+    assert(!tree->root);
+    tree->size = n;
+    if (n == 0) {
+        return;
+    }
+    const size_t fill = k_bt_order * 3 / 4;
+    // the current level: each node, its first member and its entry count
+    std::vector<BTNode *> level;
+    std::vector<ZNode *> firsts;
+    std::vector<uint64_t> counts;
+    size_t nleaves = (n + fill - 1) / fill;
+    BTLeaf *prev = NULL;
+    for (size_t i = 0, pos = 0; i < nleaves; i++) {
+        BTLeaf *leaf = new BTLeaf();
+        for (size_t end = n * (i + 1) / nleaves; pos < end; pos++) {
+            leaf->scores[leaf->hdr.n] = nodes[pos]->score;
+            leaf->items[leaf->hdr.n++] = nodes[pos];
+            leaf_of(nodes[pos]) = leaf;
+        }
+        leaf->prev = prev;
+        if (prev) {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(&leaf->hdr);
+        firsts.push_back(leaf->items[0]);
+        counts.push_back(leaf->hdr.n);
+    }
+    while (level.size() > 1) {
+        size_t m = level.size();
+        size_t ninner = (m + fill - 1) / fill;
+        size_t out = 0;
+        for (size_t i = 0, pos = 0; i < ninner; i++) {
+            BTInner *in = new BTInner();
+            in->hdr.leaf = false;
+            ZNode *first = firsts[pos];
+            uint64_t count = 0;
+            for (size_t end = m * (i + 1) / ninner; pos < end; pos++) {
+                uint32_t j = in->hdr.n++;
+                in->scores[j] = firsts[pos]->score;
+                in->keys[j] = firsts[pos];
+                in->counts[j] = counts[pos];
+                in->kids[j] = level[pos];
+                level[pos]->parent = in;
+                count += counts[pos];
+            }
+            // a parent is only written after all the children it covers
+            // were read, so the level shrinks in place
+            level[out] = &in->hdr;
+            firsts[out] = first;
+            counts[out++] = count;
+        }
+        level.resize(out);
+        firsts.resize(out);
+        counts.resize(out);
+    }
+    tree->root = level[0];
+}
+
+static void clear_node(BTNode *node, void (*f)(ZNode *)) {
+    if (node->leaf) {
+        BTLeaf *leaf = as_leaf(node);
+        for (uint32_t i = 0; f && i < node->n; i++) {
+            f(leaf->items[i]);
+        }
+        delete leaf;
+    } else {
+        BTInner *in = as_inner(node);
+        for (uint32_t i = 0; i < node->n; i++) {
+            clear_node(in->kids[i], f);
+        }
+        delete in;
+    }
+}
+
+void bt_clear(BTree *tree, void (*f)(ZNode *)) {
+    if (tree->root) {
+        clear_node(tree->root, f);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>       // for size_t
+#include <cstdint>       // for uint32_t, uint64_t
+
+// B+-tree order-statistic index over sorted-set members, ordered by
+// (score, name). Nodes are wide and keep their scores in a contiguous
+// array, so a search mostly compares doubles within one or two cache
+// lines and only reads a member's name to break a tie. Inner nodes keep
+// the entry count under each child for rank queries, and leaves are
+// linked for range scans. Each member points back at its leaf.
+struct ZNode;
+struct BTInner;
+
+const uint32_t k_bt_order = 32; // max entries per leaf, children per inner node
+
+struct BTNode {
+    BTInner *parent = NULL; // NULL at the root
+    uint32_t n = 0;         // entries (leaf) or children (inner)
+    bool leaf = true;
+};
+
+struct BTLeaf {
+    BTNode hdr;
+    BTLeaf *prev = NULL;
+    BTLeaf *next = NULL;
+    double scores[k_bt_order];
+    ZNode *items[k_bt_order];
+};
+
+// Child i holds the entries from key i (inclusive) up to key i + 1;
+// key 0 is not used for searching.
+struct BTInner {
+    BTNode hdr;
+    double scores[k_bt_order];
+    ZNode *keys[k_bt_order];
+    uint64_t counts[k_bt_order];
+    BTNode *kids[k_bt_order];
+};
+
+struct BTree {
+    BTNode *root = NULL;
+    uint64_t size = 0;
+};
+
+// `node->score` and `node->name` must be set; a member is inserted once
+void bt_insert(BTree *tree, ZNode *node);
+void bt_remove(BTree *tree, ZNode *node);
+// The first member at or after (score, name), or NULL
+ZNode *bt_seek(BTree *tree, double score, const char *name, size_t len);
+ZNode *bt_next(ZNode *node);
+ZNode *bt_prev(ZNode *node);
+uint64_t bt_rank(ZNode *node);
+ZNode *bt_nth(BTree *tree, uint64_t rank);
+// Members scoring below `score`, or at most `score` if `inclusive`
+uint64_t bt_count_below(BTree *tree, double score, bool inclusive);
+// Fills an empty tree with nodes[0..n), already in (score, name) order,
+// level by level in O(n). Nodes are left with room for later inserts.
+void bt_build(BTree *tree, ZNode **nodes, size_t n);
+// Frees the tree nodes and hands every member to `f`, if not NULL
+void bt_clear(BTree *tree, void (*f)(ZNode *));
@@ -0,0 +1,83 @@
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <sys/types.h>  // for ssize_t
+#include "buffer.h"
+
+// Make room for `n` more bytes at the tail without letting the buffered
+// data exceed `limit`. Compacts first and only grows (doubling) if needed.
+bool buf_reserve(Buffer *buf, size_t n, size_t limit) {
+    size_t len = buf_len(buf);
+    if (len + n > limit) {
+        return false;
+    }
+    if (buf_room(buf) >= n) {
+        return true;
+    }
+    if (buf->cap - len >= n) {
+        memmove(buf->data, buf_begin(buf), len);
+    } else {
+        size_t cap = buf->cap ? buf->cap : k_buf_init;
+        while (cap < len + n) {
+            cap *= 2;
+        }
+        uint8_t *data = (uint8_t *)malloc(cap);
+        if (!data) {
+            return false;
+        }
+        if (len) {
+            memcpy(data, buf_begin(buf), len);
+        }
+        free(buf->data);
+        buf->data = data;
+        buf->cap = cap;
+    }
+    buf->head = 0;
+    buf->tail = len;
+    return true;
+}
+
+bool buf_append(Buffer *buf, const void *data, size_t n, size_t limit) {
+    if (!buf_reserve(buf, n, limit)) {
+        return false;
+    }
+    memcpy(buf_end(buf), data, n);
+    buf->tail += n;
+    return true;
+}
+
+void buf_consume(Buffer *buf, size_t n) {
+    assert(n <= buf_len(buf));
+    buf->head += n;
+    if (buf->head == buf->tail) {
+        buf->head = buf->tail = 0; // empty: rewind for free
+    }
+}
+
+// Give an oversized buffer back once it has drained
+void buf_shrink(Buffer *buf) {
+    if (buf_len(buf) == 0 && buf->cap > k_buf_keep) {
+        buf_free(buf);
+    }
+}
+
+// Cut an empty buffer back to its first allocation size
+void buf_trim(Buffer *buf) {
+    if (buf_len(buf) != 0 || buf->cap <= k_buf_init) {
+        return;
+    }
+    uint8_t *data = (uint8_t *)realloc(buf->data, k_buf_init);
+    if (!data) {
+        return; // keep the bigger block
+    }
+    buf->data = data;
+    buf->cap = k_buf_init;
+    buf->head = buf->tail = 0;
+}
+
+void buf_free(Buffer *buf) {
+    free(buf->data);
+    *buf = Buffer{};
+}
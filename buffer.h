@@ -0,0 +1,46 @@
+#pragma once
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <sys/types.h>  // for ssize_t
+
+// Heap byte queue with a read cursor. Consuming only advances `head`; the
+// unread bytes are moved to the front only when the tail runs out of room.
+// All-zero is a valid empty buffer, so it can live in a memset'd struct.
+struct Buffer {
+    uint8_t *data = NULL;
+    size_t cap = 0;
+    size_t head = 0; // first unread byte
+    size_t tail = 0; // one past the last byte
+};
+
+const size_t k_buf_init = 512;       // first allocation
+const size_t k_buf_keep = 16 * 1024; // larger buffers are given back once drained
+                                     // (idle connections go down to k_buf_init)
+
+inline size_t buf_len(const Buffer *buf) {
+    return buf->tail - buf->head;
+}
+inline uint8_t *buf_begin(Buffer *buf) {
+    return buf->data + buf->head;
+}
+inline uint8_t *buf_end(Buffer *buf) {
+    return buf->data + buf->tail;
+}
+inline size_t buf_room(const Buffer *buf) {
+    return buf->cap - buf->tail;
+}
+// Drop everything past the first `len` unread bytes
+inline void buf_truncate(Buffer *buf, size_t len) {
+    assert(len <= buf_len(buf));
+    buf->tail = buf->head + len;
+}
+
+bool buf_reserve(Buffer *buf, size_t n, size_t limit);
+bool buf_append(Buffer *buf, const void *data, size_t n, size_t limit);
+void buf_consume(Buffer *buf, size_t n);
+void buf_shrink(Buffer *buf);
+void buf_trim(Buffer *buf);
+void buf_free(Buffer *buf);
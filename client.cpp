@@ -95,35 +95,36 @@ static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
     if (len > k_max_msg) {
         return -1;
     }
-    char wbuf[4 + k_max_msg];
-    memcpy(wbuf, &len, 4); // total length
+    std::vector<char> wbuf(4 + len);
+    memcpy(&wbuf[0], &len, 4); // total length
     uint32_t n = cmd.size();
     memcpy(&wbuf[4], &n, 4); // number of arguments
     size_t cur = 8;
     for (const std::string &arg : cmd) {
         uint32_t arglen = (uint32_t)arg.size();
-        if (cur + 4 + arglen > sizeof(wbuf)) {
+        if (cur + 4 + arglen > wbuf.size()) {
             return -1;
         }
         memcpy(&wbuf[cur], &arglen, 4);
         memcpy(&wbuf[cur + 4], arg.data(), arglen);
         cur += 4 + arglen;
     }
-    int32_t err = write_all(fd, wbuf, 4 + len);
+    int32_t err = write_all(fd, wbuf.data(), 4 + len);
     return err;
 }
 
 static int32_t read_resp(int fd) {
-    char rbuf[4 + k_max_msg + 1]; // +1 for null-termination
+    std::vector<char> rbuf(4);
     uint32_t len = 0;
-    int32_t err = read_full(fd, rbuf, 4);
+    int32_t err = read_full(fd, rbuf.data(), 4);
     if (err == -1) {
         return -1; // Indicate an error
     }
-    memcpy(&len, rbuf, 4);
+    memcpy(&len, rbuf.data(), 4);
     if (len > k_max_msg) {
         return -1; // Indicate an error
     }
+    rbuf.resize(4 + len + 1); // +1 for null-termination
     err = read_full(fd, &rbuf[4], len);
     if (err == -1) {
         return -1; // Indicate an error
@@ -151,10 +152,10 @@ static int32_t query(int fd, const char *text){
     if (len > k_max_msg) {
         return -1; // Indicate an error
     }
-    char wbuf[4 + k_max_msg];
-    memcpy(wbuf, &len, 4);
+    std::vector<char> wbuf(4 + len);
+    memcpy(&wbuf[0], &len, 4);
     memcpy(&wbuf[4], text, len);
-    int32_t err = write_all(fd, wbuf, 4 + len);
+    int32_t err = write_all(fd, wbuf.data(), 4 + len);
     if (err == -1) {
         return -1; // Indicate an error
     }
@@ -5,13 +5,20 @@
 #include <cstdlib>
 #include <cerrno>
 #include <cassert>
+#include <charconv>
+#include <cmath>
+#include <new>
+#include <strings.h>
+#include <algorithm>
 #include "hashtable.h"
 #include "utils.h"
 #include "serialisation.h"
 #include "zset.h"
 #include "heap.h"
+#include "shard.h"
 
-GlobalData g_data;
+thread_local GlobalData g_data;
+size_t g_max_msg = k_max_msg;
 
 void die(const char* msg) {
     perror(msg);
@@ -86,107 +93,310 @@ int32_t write_all(int fd, const char* buf, size_t len) {
     }
     return 0;
 }
-int32_t do_request(std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.empty()) {
-        return RES_ERR; // Invalid command
-    }
-    if (cmd[0] == "keys" && cmd.size() == 1) {
-        return do_keys(cmd, out);
-    }
-    else if (cmd[0] == "get" && cmd.size() == 2) {
-        return do_get(cmd, out);
-    } else if (cmd[0] == "set" && cmd.size() == 3) {
-        return do_set(cmd, out);
-    } else if (cmd[0] == "del" && cmd.size() == 2) {
-        return do_del(cmd, out);
-    } else if (cmd[0] == "zadd"){
-        return do_zadd(cmd,out);
+// Indexed by the CMD_* ids. A new command gets an id and a row here.
+const CmdSpec g_cmds[CMD_COUNT] = {
+    {"keys",   do_keys,   1, 1, CMD_F_READ | CMD_F_FANOUT},
+    {"get",    do_get,    2, 2, CMD_F_READ | CMD_F_SHARED},
+    {"set",    do_set,    3, 3, CMD_F_WRITE},
+    {"del",    do_del,    2, 2, CMD_F_WRITE},
+    {"zadd",   do_zadd,   4, k_args_any, CMD_F_WRITE},
+    {"zscore", do_zscore, 3, 3, CMD_F_READ},
+    {"zrem",   do_zrem,   3, 3, CMD_F_WRITE},
+    {"zquery", do_query,  6, 6, CMD_F_READ},
+    {"expire", do_expire, 3, 3, CMD_F_WRITE},
+    {"ttl",    do_ttl,    2, 2, CMD_F_READ},
+    {"scan",   do_scan,   2, 3, CMD_F_READ | CMD_F_CURSOR},
+    {"mget",   do_mget,   2, k_args_any, CMD_F_READ | CMD_F_KEYS},
+    {"zrank",  do_zrank,  3, 3, CMD_F_READ},
+    {"zrevrank", do_zrevrank, 3, 3, CMD_F_READ},
+    {"zcount", do_zcount, 4, 4, CMD_F_READ},
+    {"zrange", do_zrange, 4, 4, CMD_F_READ},
+    {"zrangebyscore", do_zrangebyscore, 4, 8, CMD_F_READ},
+    {"zrevrangebyscore", do_zrevrangebyscore, 4, 8, CMD_F_READ},
+    {"zunionstore", do_zunionstore, 4, k_args_any, CMD_F_WRITE, zunionstore_job},
+    {"zinterstore", do_zinterstore, 4, k_args_any, CMD_F_WRITE, zinterstore_job},
+    {"info",   do_info,   1, 1, CMD_F_READ | CMD_F_FANOUT},
+};
+
+// Open-addressed name -> id index over g_cmds, built once at startup.
+// A lookup is one cheap hash, usually one probe and one memcmp.
+const size_t k_cmd_slots = 64; // power of 2, at least twice CMD_COUNT
+static_assert(k_cmd_slots >= 2 * CMD_COUNT, "grow k_cmd_slots");
+
+static size_t cmd_slot(std::string_view name) {
+    size_t h = name.size();
+    for (char c : name) {
+        h = h * 31 + (uint8_t)c;
     }
-    else if (cmd[0] == "zscore"){
-        return do_zscore(cmd,out);
+    return h & (k_cmd_slots - 1);
+}
+
+struct CmdIndex {
+    uint8_t slots[k_cmd_slots];
+    CmdIndex() {
+        memset(slots, CMD_COUNT, sizeof(slots));
+        for (uint32_t id = 0; id < CMD_COUNT; id++) {
+            size_t pos = cmd_slot(g_cmds[id].name);
+            while (slots[pos] != CMD_COUNT) {
+                pos = (pos + 1) & (k_cmd_slots - 1);
+            }
+            slots[pos] = (uint8_t)id;
+        }
     }
-    else if (cmd[0] == "zrem"){
-        return do_zrem(cmd,out);
+};
+static const CmdIndex g_cmd_index;
+
+uint32_t cmd_lookup(std::string_view name) {
+    for (size_t pos = cmd_slot(name);; pos = (pos + 1) & (k_cmd_slots - 1)) {
+        uint32_t id = g_cmd_index.slots[pos];
+        if (id == CMD_COUNT || name == g_cmds[id].name) {
+            return id;
+        }
     }
-    else if (cmd[0] == "zquery"){
-        return do_query(cmd,out);
+}
+
+int32_t do_request(const Cmd &cmd, Buffer &out, ShardJob **job) {
+    if (cmd.id >= CMD_COUNT) {
+        return RES_ERR; // Unknown command
     }
-    else if (cmd[0] == "expire" && cmd.size() == 3) {
-        return do_expire(cmd, out);
+    const CmdSpec &spec = g_cmds[cmd.id];
+    CmdStats &stats = g_data.cmd_stats[cmd.id];
+    stats.calls++;
+    if (cmd.size() < spec.min_args || cmd.size() > spec.max_args) {
+        stats.errors++;
+        out_err(out, RES_ERR, std::string("wrong number of arguments for '") + spec.name + "'");
+        return RES_ERR;
     }
-    else if (cmd[0] == "ttl" && cmd.size() == 2) {
-        return do_ttl(cmd, out);
+    if (job && spec.job) {
+        *job = spec.job(cmd, out);
+        if (!*job) {
+            stats.errors++;
+            return RES_ERR;
+        }
+        return RES_OK;
     }
-    else {
-        return RES_ERR; // Unknown command
+    int32_t rv = (int32_t)spec.handler(cmd, out);
+    if (rv != RES_OK) {
+        stats.errors++;
     }
+    return rv;
 }
 
 bool entry_eq(HNode *lhs, HNode *rhs) {
     struct Entry *le = container_of(lhs, struct Entry, node);
     struct Entry *re = container_of(rhs, struct Entry, node);
-    return le->key == re->key;
+    return entry_key(le) == entry_key(re);
+}
+
+// Compare a stored Entry against a borrowed HKey
+bool entry_key_eq(HNode *node, HNode *key) {
+    Entry *ent = container_of(node, Entry, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return ent->klen == hkey->len
+        && 0 == memcmp(ent->data, hkey->name, hkey->len);
+}
+
+// Point an HKey at the request bytes, no copy
+static void hkey_init(HKey *hkey, std::string_view key) {
+    hkey->node.hcode = str_hash((const uint8_t *)key.data(), key.size());
+    hkey->name = key.data();
+    hkey->len = key.size();
+}
+
+static HNode *db_lookup(std::string_view key) {
+    HKey hkey;
+    hkey_init(&hkey, key);
+    return cm_lookup(&g_data.db, &hkey.node, entry_key_eq);
+}
+
+void db_lookup_batch(const std::string_view *keys, size_t n, HNode **out) {
+    HKey hkeys[k_lookup_batch];
+    HNode *nodes[k_lookup_batch];
+    for (size_t start = 0; start < n; start += k_lookup_batch) {
+        size_t m = std::min(k_lookup_batch, n - start);
+        for (size_t i = 0; i < m; i++) {
+            hkey_init(&hkeys[i], keys[start + i]);
+            nodes[i] = &hkeys[i].node;
+        }
+        cm_lookup_batch(&g_data.db, nodes, m, entry_key_eq, out + start);
+    }
 }
 
-uint32_t do_get(const std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+static uint32_t get_reply(HNode *node, Buffer &out) {
     if (!node) {
-        printf("[DEBUG] do_get: RES_NX=%d\n", RES_NX);
         out_int(out, RES_NX); // Not found
         return RES_NX;
     }
-    const std::string &value = container_of(node, Entry, node)->val;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->type != T_STR) {
+        out_nil(out);
+        return RES_NX;
+    }
+    std::string_view value = entry_val(ent);
     assert(value.size() <= k_max_msg);
     out_str(out, value);
     return RES_OK;
 }
 
-uint32_t do_set(const std::vector<std::string> &cmd, std::string &out) {
-    Entry* entry = new Entry;
-    entry->key = cmd[1];
-    entry->val = cmd[2];
-    entry->type = 0; // string type
-    entry->zset = nullptr;
-    entry->node.hcode = str_hash((const uint8_t*)entry->key.data(), entry->key.size());
-    hm_insert(&g_data.db, &entry->node);
-    printf("[DEBUG] do_set: RES_OK=%d\n", RES_OK);
+struct GetRead {
+    Buffer *out;
+    uint32_t rv;
+};
+
+static void cb_get_read(HNode *node, void *arg) {
+    GetRead *rd = (GetRead *)arg;
+    rd->rv = get_reply(node, *rd->out);
+}
+
+// Copy the value out of another loop's keyspace under its stripe lock
+static uint32_t get_read(CMap *db, HKey *key, Buffer &out) {
+    GetRead rd = {&out, RES_NX};
+    if (!cm_read(db, &key->node, entry_key_eq, cb_get_read, &rd)) {
+        return get_reply(NULL, out);
+    }
+    return rd.rv;
+}
+
+static int32_t get_count(int32_t rv) {
+    CmdStats &stats = g_data.cmd_stats[CMD_GET];
+    stats.calls++;
+    if (rv != RES_OK) {
+        stats.errors++;
+    }
+    return rv;
+}
+
+uint32_t do_get(const Cmd &cmd, Buffer &out) {
+    HKey key;
+    hkey_init(&key, cmd[1]);
+    size_t owner = g_shards.size() > 1 ? shard_of_hash(key.node.hcode) : g_shard_id;
+    if (owner != g_shard_id) {
+        // Another loop's key (see shard_dispatch): copy the value out under
+        // its stripe lock instead of a round trip through that loop
+        return get_read(shard_db(owner), &key, out);
+    }
+    return get_reply(cm_lookup(&g_data.db, &key.node, entry_key_eq), out);
+}
+
+// GET whose key was already found by db_lookup_batch; counted like one
+// that went through do_request
+int32_t do_get_node(HNode *node, Buffer &out) {
+    return get_count((int32_t)get_reply(node, out));
+}
+
+// GET of a key loop `owner` has published, read in place like do_get
+int32_t do_get_remote(size_t owner, std::string_view key, Buffer &out) {
+    HKey hkey;
+    hkey_init(&hkey, key);
+    return get_count((int32_t)get_read(shard_db(owner), &hkey, out));
+}
+
+// MGET key [key...]: the string values in order, nil where a key is
+// missing or holds a zset. With several loops each one answers for the
+// keys it owns and shard_dispatch merges the replies by position.
+uint32_t do_mget(const Cmd &cmd, Buffer &out) {
+    size_t n = cmd.size() - 1;
+    // keys past the inline arguments live in cmd.more; gather them all
+    static thread_local std::vector<std::string_view> keys;
+    keys.clear();
+    for (size_t i = 1; i < cmd.size(); i++) {
+        keys.push_back(cmd[i]);
+    }
+    out_arr(out, (uint32_t)n);
+    HNode *found[k_lookup_batch];
+    for (size_t start = 0; start < n; start += k_lookup_batch) {
+        size_t m = std::min(k_lookup_batch, n - start);
+        db_lookup_batch(&keys[start], m, found);
+        for (size_t i = 0; i < m; i++) {
+            Entry *ent = found[i] ? container_of(found[i], Entry, node) : NULL;
+            if (ent && ent->type == T_STR) {
+                out_str(out, entry_val(ent));
+            } else {
+                out_nil(out);
+            }
+        }
+    }
+    return RES_OK;
+}
+
+static HNode *entry_make_str(HNode *key, void *arg) {
+    HKey *hkey = container_of(key, HKey, node);
+    std::string_view name(hkey->name, hkey->len);
+    return &entry_new_str(name, key->hcode, *(std::string_view *)arg)->node;
+}
+
+static HNode *entry_make_zset(HNode *key, void *arg) {
+    (void)arg;
+    HKey *hkey = container_of(key, HKey, node);
+    return &entry_new_zset(std::string_view(hkey->name, hkey->len), key->hcode)->node;
+}
+
+uint32_t do_set(const Cmd &cmd, Buffer &out) {
+    HKey key;
+    hkey_init(&key, cmd[1]);
+    std::string_view val = cmd[2];
+    bool inserted = false;
+    uint64_t hcode = key.node.hcode;
+    cm_write_begin(&g_data.db, hcode);
+    HNode *node = hm_find_or_insert(cm_stripe(&g_data.db, hcode), &key.node, entry_key_eq,
+                                    entry_make_str, &val, &inserted);
+    if (!inserted) {
+        // overwriting also clears the TTL
+        Entry *ent = container_of(node, Entry, node);
+        entry_set_ttl(ent, -1);
+        entry_set_str(ent, val);
+    }
+    cm_write_end(&g_data.db, hcode);
     out_int(out, RES_OK);
     return RES_OK;
 }
 
-uint32_t do_del(const std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((const uint8_t*)key.key.data(), key.key.size());
-    HNode* node = hm_delete(&g_data.db, &key.node);
+uint32_t do_del(const Cmd &cmd, Buffer &out) {
+    HKey key;
+    hkey_init(&key, cmd[1]);
+    cm_write_begin(&g_data.db, key.node.hcode);
+    HNode* node = hm_delete(cm_stripe(&g_data.db, key.node.hcode), &key.node, entry_key_eq);
+    cm_write_end(&g_data.db, key.node.hcode);
     if (node) {
         entry_del(container_of(node, Entry, node));
     }
-    printf("[DEBUG] do_del: node? %d\n", node ? 1 : 0);
     out_int(out, node ? 1 : 0);
     return RES_OK;
 }
 
-uint32_t do_keys(const std::vector<std::string> &cmd, std::string &out) {
+uint32_t do_keys(const Cmd &cmd, Buffer &out) {
     (void)cmd;
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+    out_arr(out, (uint32_t)cm_size(&g_data.db));
+    cm_scan(&g_data.db, &cb_scan, &out);
     return RES_OK;
 }
 
-int32_t parse_req(const uint8_t  *data, size_t len, std::vector<std::string> &cmd) {
+// Name/value pairs for this loop; fan-out lists every loop in turn
+uint32_t do_info(const Cmd &cmd, Buffer &out) {
+    (void)cmd;
+    const ConnPool &pool = g_data.conn_pool;
+    out_arr(out, 12);
+    out_str(out, "loop");
+    out_int(out, (int64_t)g_shard_id);
+    out_str(out, "conn_allocs");
+    out_int(out, (int64_t)pool.allocs);
+    out_str(out, "conn_reuses");
+    out_int(out, (int64_t)pool.reuses);
+    out_str(out, "conn_releases");
+    out_int(out, (int64_t)pool.releases);
+    out_str(out, "conn_drops");
+    out_int(out, (int64_t)pool.drops);
+    out_str(out, "conn_pooled");
+    out_int(out, (int64_t)pool.free_conns.size());
+    return RES_OK;
+}
+
+int32_t parse_req(const uint8_t  *data, size_t len, Cmd &cmd) {
     if (len < 4) {
         return -1; // Invalid request
     }
     uint32_t cmd_len = 0;
     memcpy(&cmd_len, data, 4);
-    if (cmd_len > k_max_args) {
-        return -1; // Invalid request
-    }
     size_t pos = 4;
     while(cmd_len--){
         if (pos+4>len){
@@ -197,64 +407,122 @@ int32_t parse_req(const uint8_t  *data, size_t len, std::vector<std::string> &cm
         if (pos + 4 + arg_len > len) {
             return -1; // Invalid request
         }
-        cmd.push_back(std::string((const char *)&data[pos + 4], arg_len));
+        cmd.push(std::string_view((const char *)&data[pos + 4], arg_len));
         pos += 4 + arg_len;
 
     }
     if (pos != len) {
         return -1; // Invalid request
     }
+    if (cmd.argc) {
+        cmd.id = cmd_lookup(cmd.args[0]);
+    }
     return 0; // Successfully parsed the request
 }
 
-uint32_t do_zadd(const std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() != 4) {
-        out_err(out, RES_ERR, "Usage: zadd <key> <score> <name>");
+static bool arg_is(std::string_view arg, const char *word) {
+    return arg.size() == strlen(word) && strncasecmp(arg.data(), word, arg.size()) == 0;
+}
+
+// ZADD key [NX|XX] [GT|LT] [CH] [INCR] score member [score member ...]
+uint32_t do_zadd(const Cmd &cmd, Buffer &out) {
+    uint32_t flags = 0;
+    bool ch = false, incr = false;
+    size_t pos = 2;
+    for (; pos < cmd.size(); pos++) {
+        if (arg_is(cmd[pos], "nx")) {
+            flags |= ZADD_NX;
+        } else if (arg_is(cmd[pos], "xx")) {
+            flags |= ZADD_XX;
+        } else if (arg_is(cmd[pos], "gt")) {
+            flags |= ZADD_GT;
+        } else if (arg_is(cmd[pos], "lt")) {
+            flags |= ZADD_LT;
+        } else if (arg_is(cmd[pos], "ch")) {
+            ch = true;
+        } else if (arg_is(cmd[pos], "incr")) {
+            incr = true;
+        } else {
+            break;
+        }
+    }
+    size_t npairs = (cmd.size() - pos) / 2;
+    if (npairs == 0 || (cmd.size() - pos) % 2 != 0) {
+        out_err(out, RES_ERR, "syntax error");
         return RES_ERR;
     }
-    double score = std::stod(cmd[2]);
-    const std::string &name = cmd[3];
-    // Look up or create the zset entry in the DB
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((const uint8_t*)key.key.data(), key.key.size());
-    HNode* node = hm_lookup(&g_data.db, &key.node, entry_eq);
-    Entry* entry = nullptr;
-    if (!node) {
-        entry = new Entry;
-        entry->key = cmd[1];
-        entry->val = "";
-        entry->type = 1; // ZSet type
-        entry->zset = new ZSet();
-        entry->node.hcode = key.node.hcode;
-        hm_insert(&g_data.db, &entry->node);
+    if (((flags & ZADD_NX) && (flags & (ZADD_XX | ZADD_GT | ZADD_LT)))
+            || ((flags & ZADD_GT) && (flags & ZADD_LT))) {
+        out_err(out, RES_ERR, "NX, XX, GT and LT do not combine");
+        return RES_ERR;
+    }
+    if (incr && npairs != 1) {
+        out_err(out, RES_ERR, "INCR takes a single pair");
+        return RES_ERR;
+    }
+    std::vector<ZAddItem> items(npairs);
+    for (size_t i = 0; i < npairs; i++) {
+        std::string_view name = cmd[pos + 2 * i + 1];
+        if (!str2dbl(cmd[pos + 2 * i], items[i].score)) {
+            out_err(out, RES_ERR, "expect fp number");
+            return RES_ERR;
+        }
+        items[i].name = name.data();
+        items[i].len = name.size();
+    }
+    // Look up or create the zset entry in the DB; XX never creates one
+    HNode *node = NULL;
+    if (flags & ZADD_XX) {
+        node = db_lookup(cmd[1]);
     } else {
-        entry = container_of(node, Entry, node);
+        HKey key;
+        hkey_init(&key, cmd[1]);
+        bool inserted = false;
+        cm_write_begin(&g_data.db, key.node.hcode);
+        node = hm_find_or_insert(cm_stripe(&g_data.db, key.node.hcode), &key.node, entry_key_eq,
+                                 entry_make_zset, NULL, &inserted);
+        cm_write_end(&g_data.db, key.node.hcode);
+    }
+    Entry *entry = node ? container_of(node, Entry, node) : NULL;
+    if (entry && entry->type != T_ZSET) {
+        out_err(out, RES_ERR, "expect zset");
+        return RES_ERR;
     }
-    bool added = zset_add(entry->zset, name.data(), name.size(), score);
-    out_int(out, added ? 1 : 0); // 1 if new, 0 if updated
+    if (incr) {
+        // the new score, or nil if the flags stop the update
+        ZAddItem &item = items[0];
+        ZNode *cur = entry ? zset_lookup(entry->zset, item.name, item.len) : NULL;
+        item.score += cur ? cur->score : 0;
+        if (std::isnan(item.score)) {
+            out_err(out, RES_ERR, "resulting score is not a number");
+            return RES_ERR;
+        }
+        if (!entry || !zadd_allowed(cur, item.score, flags)) {
+            out_nil(out);
+            return RES_OK;
+        }
+        zset_add(entry->zset, item.name, item.len, item.score);
+        out_dbl(out, item.score);
+        return RES_OK;
+    }
+    uint64_t changed = 0;
+    uint64_t added = entry ? zset_add_batch(entry->zset, items.data(), npairs, flags, &changed) : 0;
+    out_int(out, (int64_t)(ch ? changed : added));
     return RES_OK;
 }
 
-uint32_t do_zscore(const std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() != 3) {
-        out_err(out, RES_ERR, "Usage: zscore <key> <name>");
-        return RES_ERR;
-    }
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+uint32_t do_zscore(const Cmd &cmd, Buffer &out) {
+    HNode *node = db_lookup(cmd[1]);
     if (!node) {
         out_nil(out);
         return RES_NX;
     }
     Entry *entry = container_of(node, Entry, node);
-    if (entry->type != 1 || !entry->zset) {
+    if (entry->type != T_ZSET) {
         out_nil(out);
         return RES_NX;
     }
-    const std::string &name = cmd[2];
+    std::string_view name = cmd[2];
     ZNode *znode = zset_lookup(entry->zset, name.data(), name.size());
     if (!znode) {
         out_nil(out);
@@ -264,28 +532,19 @@ uint32_t do_zscore(const std::vector<std::string> &cmd, std::string &out) {
     return RES_OK;
 }
 
-uint32_t do_zrem(const std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() != 3) {
-        out_err(out, RES_ERR, "Usage: zrem <key> <name>");
-        return RES_ERR;
-    }
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+uint32_t do_zrem(const Cmd &cmd, Buffer &out) {
+    HNode *node = db_lookup(cmd[1]);
     if (!node) {
         out_int(out, 0);
         return RES_OK;
     }
     Entry *entry = container_of(node, Entry, node);
-    if (entry->type != 1 || !entry->zset) {
+    if (entry->type != T_ZSET) {
         out_int(out, 0);
         return RES_OK;
     }
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_pop(entry->zset, name.data(), name.size());
-    if (znode) {
-        znode_del(znode);
+    std::string_view name = cmd[2];
+    if (zset_remove(entry->zset, name.data(), name.size())) {
         out_int(out, 1);
     } else {
         out_int(out, 0);
@@ -293,48 +552,40 @@ uint32_t do_zrem(const std::vector<std::string> &cmd, std::string &out) {
     return RES_OK;
 }
 
-uint32_t do_query(const std::vector<std::string> &cmd, std::string &out) {
-    if (cmd.size() != 6) {
-        out_err(out, RES_ERR, "Usage: zquery <key> <score> <name> <offset> <limit>");
-        return RES_ERR;
-    }
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+uint32_t do_query(const Cmd &cmd, Buffer &out) {
+    HNode *node = db_lookup(cmd[1]);
     if (!node) {
         return RES_NX;
     }
     Entry *entry = container_of(node, Entry, node);
-    if (entry->type != 1 || !entry->zset) {
+    if (entry->type != T_ZSET) {
         return RES_NX;
     }
-    double score = std::stod(cmd[2]);
-    const std::string &name = cmd[3];
-    int64_t offset = std::stoll(cmd[4]);
-    int64_t limit = std::stoll(cmd[5]);
+    double score = std::stod(std::string(cmd[2]));
+    std::string_view name = cmd[3];
+    int64_t offset = std::stoll(std::string(cmd[4]));
+    int64_t limit = std::stoll(std::string(cmd[5]));
     ZNode *znode = zset_query(entry->zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    znode = znode_offset(entry->zset, znode, offset);
+    size_t ctx = out_begin_arr(out);
     uint32_t n = 0;
     while (znode && n < (uint32_t)limit) {
-        out_str(out, std::string(znode->name, znode->len));
+        out_str(out, std::string_view(znode->name, znode->len));
         out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1); // successor
+        znode = znode_next(entry->zset, znode);
         n++;
     }
+    out_end_arr(out, ctx, 2 * n);
     return RES_OK;
 }
 
-uint32_t do_expire(std::vector<std::string> &cmd, std::string &out) {
+uint32_t do_expire(const Cmd &cmd, Buffer &out) {
     int64_t ttl_ms = 0;
     if (!str2int(cmd[2], ttl_ms)) {
         out_err(out, RES_ERR, "expect int64");
         return RES_ERR;
     }
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+    HNode *node = db_lookup(cmd[1]);
     if (node) {
         Entry *ent = container_of(node, Entry, node);
         entry_set_ttl(ent, ttl_ms);
@@ -343,11 +594,8 @@ uint32_t do_expire(std::vector<std::string> &cmd, std::string &out) {
     return RES_OK;
 }
 
-uint32_t do_ttl(std::vector<std::string> &cmd, std::string &out) {
-    Entry key;
-    key.key = cmd[1];
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    HNode *node = hm_lookup(&g_data.db, &key.node, entry_eq);
+uint32_t do_ttl(const Cmd &cmd, Buffer &out) {
+    HNode *node = db_lookup(cmd[1]);
     if (!node) {
         out_int(out, -2);
         return RES_OK;
@@ -363,36 +611,419 @@ uint32_t do_ttl(std::vector<std::string> &cmd, std::string &out) {
     return RES_OK;
 }
 
-bool str2int(const std::string &s, int64_t &out) {
-    char *end = nullptr;
-    errno = 0;
-    long long val = strtoll(s.c_str(), &end, 10);
-    if (errno != 0 || end != s.c_str() + s.size()) {
+bool str2int(std::string_view s, int64_t &out) {
+    int64_t val = 0;
+    auto res = std::from_chars(s.data(), s.data() + s.size(), val);
+    if (res.ec != std::errc() || res.ptr != s.data() + s.size()) {
+        return false;
+    }
+    out = val;
+    return true;
+}
+
+// Header and key, plus `extra` bytes after the key
+static Entry *entry_alloc(std::string_view key, uint64_t hcode, uint8_t type, size_t extra) {
+    Entry *ent = (Entry *)malloc(sizeof(Entry) + key.size() + extra);
+    if (!ent) {
+        throw std::bad_alloc();
+    }
+    ent->node.next = NULL;
+    ent->node.hcode = hcode;
+    ent->heap_idx = -1;
+    ent->klen = (uint32_t)key.size();
+    ent->vlen = 0;
+    ent->vcap = (uint32_t)extra;
+    ent->type = type;
+    ent->ext = NULL;
+    memcpy(ent->data, key.data(), key.size());
+    return ent;
+}
+
+Entry *entry_new_str(std::string_view key, uint64_t hcode, std::string_view val) {
+    bool inl = val.size() <= k_val_inline_max;
+    Entry *ent = entry_alloc(key, hcode, T_STR, inl ? val.size() : 0);
+    ent->vlen = (uint32_t)val.size();
+    char *dst = ent->data + ent->klen;
+    if (!inl) {
+        dst = ent->ext = (char *)malloc(val.size());
+        if (!dst) {
+            free(ent);
+            throw std::bad_alloc();
+        }
+    }
+    memcpy(dst, val.data(), val.size());
+    return ent;
+}
+
+Entry *entry_new_zset(std::string_view key, uint64_t hcode) {
+    Entry *ent = entry_alloc(key, hcode, T_ZSET, 0);
+    ent->zset = new ZSet();
+    return ent;
+}
+
+bool str2dbl(std::string_view s, double &out) {
+    std::string tmp(s); // strtod needs the terminator
+    char *end = NULL;
+    double val = strtod(tmp.c_str(), &end);
+    if (tmp.empty() || end != tmp.c_str() + tmp.size() || std::isnan(val)) {
         return false;
     }
     out = val;
     return true;
 }
 
+// The sorted set stored at `key`, or NULL if missing or not a zset
+static ZSet *db_zset(std::string_view key) {
+    HNode *node = db_lookup(key);
+    Entry *ent = node ? container_of(node, Entry, node) : NULL;
+    return ent && ent->type == T_ZSET ? ent->zset : NULL;
+}
+
+static uint32_t zrank_reply(const Cmd &cmd, Buffer &out, bool rev) {
+    ZSet *zset = db_zset(cmd[1]);
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2].data(), cmd[2].size()) : NULL;
+    if (!znode) {
+        out_nil(out);
+        return RES_OK;
+    }
+    uint64_t rank = znode_rank(zset, znode);
+    out_int(out, (int64_t)(rev ? zset_size(zset) - 1 - rank : rank));
+    return RES_OK;
+}
+
+// ZRANK key member: 0-based position by ascending score, nil if absent
+uint32_t do_zrank(const Cmd &cmd, Buffer &out) {
+    return zrank_reply(cmd, out, false);
+}
+
+// ZREVRANK key member: the same counted from the highest score
+uint32_t do_zrevrank(const Cmd &cmd, Buffer &out) {
+    return zrank_reply(cmd, out, true);
+}
+
+// ZCOUNT key min max: members with min <= score <= max
+uint32_t do_zcount(const Cmd &cmd, Buffer &out) {
+    double lo = 0, hi = 0;
+    if (!str2dbl(cmd[2], lo) || !str2dbl(cmd[3], hi)) {
+        out_err(out, RES_ERR, "expect fp number");
+        return RES_ERR;
+    }
+    ZSet *zset = db_zset(cmd[1]);
+    uint64_t n = 0;
+    if (zset && lo <= hi) {
+        n = zset_count_below(zset, hi, true) - zset_count_below(zset, lo, false);
+    }
+    out_int(out, (int64_t)n);
+    return RES_OK;
+}
+
+// ZRANGE key start stop: members at ranks start..stop inclusive, as
+// name, score pairs. Negative ranks count from the end.
+uint32_t do_zrange(const Cmd &cmd, Buffer &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        out_err(out, RES_ERR, "expect int64");
+        return RES_ERR;
+    }
+    ZSet *zset = db_zset(cmd[1]);
+    int64_t size = zset ? (int64_t)zset_size(zset) : 0;
+    start = start < 0 ? std::max<int64_t>(size + start, 0) : start;
+    stop = stop < 0 ? size + stop : std::min(stop, size - 1);
+    if (start > stop) {
+        out_arr(out, 0);
+        return RES_OK;
+    }
+    out_arr(out, (uint32_t)(2 * (stop - start + 1)));
+    ZNode *znode = zset_nth(zset, (uint64_t)start);
+    for (int64_t i = start; i <= stop; i++) {
+        out_str(out, std::string_view(znode->name, znode->len));
+        out_dbl(out, znode->score);
+        znode = znode_next(zset, znode);
+    }
+    return RES_OK;
+}
+
+// A score range bound: a number, -inf/+inf, or "(score" to exclude it
+static bool str2bound(std::string_view s, double &score, bool &excl) {
+    excl = !s.empty() && s[0] == '(';
+    return str2dbl(excl ? s.substr(1) : s, score);
+}
+
+static uint32_t zrangebyscore(const Cmd &cmd, Buffer &out, bool rev) {
+    double lo = 0, hi = 0;
+    bool lo_excl = false, hi_excl = false;
+    if (!str2bound(cmd[rev ? 3 : 2], lo, lo_excl) || !str2bound(cmd[rev ? 2 : 3], hi, hi_excl)) {
+        out_err(out, RES_ERR, "expect fp number");
+        return RES_ERR;
+    }
+    bool withscores = false;
+    int64_t offset = 0, count = -1; // a negative count means no limit
+    for (size_t i = 4; i < cmd.size(); i++) {
+        if (arg_is(cmd[i], "withscores")) {
+            withscores = true;
+        } else if (arg_is(cmd[i], "limit") && i + 2 < cmd.size()
+                && str2int(cmd[i + 1], offset) && str2int(cmd[i + 2], count) && offset >= 0) {
+            i += 2;
+        } else {
+            out_err(out, RES_ERR, "syntax error");
+            return RES_ERR;
+        }
+    }
+    // the members inside the bounds hold ranks [first, last)
+    ZSet *zset = db_zset(cmd[1]);
+    uint64_t first = zset ? zset_count_below(zset, lo, lo_excl) : 0;
+    uint64_t last = zset ? zset_count_below(zset, hi, !hi_excl) : 0;
+    uint64_t n = last > first + (uint64_t)offset ? last - first - (uint64_t)offset : 0;
+    if (count >= 0) {
+        n = std::min(n, (uint64_t)count);
+    }
+    out_arr(out, (uint32_t)(withscores ? 2 * n : n));
+    if (n == 0) {
+        return RES_OK;
+    }
+    // seek once by rank, then step to the neighbours
+    ZNode *znode = zset_nth(zset, rev ? last - 1 - (uint64_t)offset : first + (uint64_t)offset);
+    for (uint64_t i = 0; i < n; i++) {
+        out_str(out, std::string_view(znode->name, znode->len));
+        if (withscores) {
+            out_dbl(out, znode->score);
+        }
+        znode = rev ? znode_prev(zset, znode) : znode_next(zset, znode);
+    }
+    return RES_OK;
+}
+
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+uint32_t do_zrangebyscore(const Cmd &cmd, Buffer &out) {
+    return zrangebyscore(cmd, out, false);
+}
+
+// ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count], from the
+// highest score down
+uint32_t do_zrevrangebyscore(const Cmd &cmd, Buffer &out) {
+    return zrangebyscore(cmd, out, true);
+}
+
+// Replace whatever `key` holds by `zset`, or drop the key if `zset` is
+// empty. The old value goes, TTL included, as with DEL.
+static void db_put_zset(std::string_view key, ZSet *zset) {
+    HKey hkey;
+    hkey_init(&hkey, key);
+    Entry *ent = NULL;
+    if (zset_size(zset) > 0) {
+        ent = entry_alloc(key, hkey.node.hcode, T_ZSET, 0);
+        ent->zset = zset;
+    } else {
+        delete zset;
+    }
+    cm_write_begin(&g_data.db, hkey.node.hcode);
+    HMap *map = cm_stripe(&g_data.db, hkey.node.hcode);
+    HNode *old = hm_delete(map, &hkey.node, entry_key_eq);
+    if (ent) {
+        hm_insert(map, &ent->node);
+    }
+    cm_write_end(&g_data.db, hkey.node.hcode);
+    if (old) {
+        Entry *old_ent = container_of(old, Entry, node);
+        entry_set_ttl(old_ent, -1);
+        entry_del(old_ent);
+    }
+}
+
+// ZUNIONSTORE/ZINTERSTORE as a job: the sources are copied on the loop,
+// combined on its thread pool, and the result stored back on the loop
+struct ZStoreJob : ShardJob {
+    std::string dest;
+    ZCombine *zc = NULL;
+};
+
+static void zstore_done(void *arg) {
+    shard_job_done((ShardJob *)arg);
+}
+
+static void zstore_start(ShardJob *job) {
+    zcombine_start(static_cast<ZStoreJob *>(job)->zc, &g_data.tp, zstore_done, job);
+}
+
+static int32_t zstore_finish(ShardJob *job, Buffer &out) {
+    ZStoreJob *zj = static_cast<ZStoreJob *>(job);
+    ZSet *result = zcombine_result(zj->zc);
+    uint64_t size = zset_size(result);
+    db_put_zset(zj->dest, result);
+    out_int(out, (int64_t)size);
+    zcombine_free(zj->zc);
+    delete zj;
+    return RES_OK;
+}
+
+static ShardJob *zcombine_job(const Cmd &cmd, Buffer &out, bool inter) {
+    int64_t nkeys = 0;
+    if (!str2int(cmd[2], nkeys) || nkeys < 1 || (uint64_t)nkeys > cmd.size() - 3) {
+        out_err(out, RES_ERR, "syntax error");
+        return NULL;
+    }
+    size_t n = (size_t)nkeys;
+    std::vector<double> weights(n, 1.0);
+    uint32_t agg = ZAGG_SUM;
+    for (size_t pos = 3 + n; pos < cmd.size();) {
+        if (arg_is(cmd[pos], "weights") && pos + n < cmd.size()) {
+            for (size_t i = 0; i < n; i++) {
+                if (!str2dbl(cmd[pos + 1 + i], weights[i])) {
+                    out_err(out, RES_ERR, "expect fp number");
+                    return NULL;
+                }
+            }
+            pos += 1 + n;
+        } else if (arg_is(cmd[pos], "aggregate") && pos + 1 < cmd.size()
+                && (arg_is(cmd[pos + 1], "sum") || arg_is(cmd[pos + 1], "min") || arg_is(cmd[pos + 1], "max"))) {
+            agg = arg_is(cmd[pos + 1], "sum") ? ZAGG_SUM : arg_is(cmd[pos + 1], "min") ? ZAGG_MIN : ZAGG_MAX;
+            pos += 2;
+        } else {
+            out_err(out, RES_ERR, "syntax error");
+            return NULL;
+        }
+    }
+    std::vector<ZSet *> srcs(n);
+    for (size_t i = 0; i < n; i++) {
+        std::string_view key = cmd[3 + i];
+        if (g_shards.size() > 1 && shard_of(key) != g_shard_id) {
+            out_err(out, RES_ERR, "keys must live on the destination's loop");
+            return NULL;
+        }
+        HNode *node = db_lookup(key);
+        Entry *ent = node ? container_of(node, Entry, node) : NULL;
+        if (ent && ent->type != T_ZSET) {
+            out_err(out, RES_ERR, "expect zset");
+            return NULL;
+        }
+        srcs[i] = ent ? ent->zset : NULL;
+    }
+    // the result is built aside, as the destination may be a source
+    ZStoreJob *zj = new ZStoreJob();
+    zj->start = zstore_start;
+    zj->finish = zstore_finish;
+    zj->dest = std::string(cmd[1]);
+    zj->zc = zcombine_new(srcs.data(), weights.data(), n, agg, inter);
+    return zj;
+}
+
+ShardJob *zunionstore_job(const Cmd &cmd, Buffer &out) {
+    return zcombine_job(cmd, out, false);
+}
+
+ShardJob *zinterstore_job(const Cmd &cmd, Buffer &out) {
+    return zcombine_job(cmd, out, true);
+}
+
+// The same inline, for callers that cannot park a client
+static uint32_t zcombine_store(const Cmd &cmd, Buffer &out, bool inter) {
+    ShardJob *job = zcombine_job(cmd, out, inter);
+    if (!job) {
+        return RES_ERR;
+    }
+    zcombine_run(static_cast<ZStoreJob *>(job)->zc);
+    return (uint32_t)job->finish(job, out);
+}
+
+// ZUNIONSTORE dest numkeys key [key ...] [WEIGHTS w [w ...]] [AGGREGATE SUM|MIN|MAX]
+uint32_t do_zunionstore(const Cmd &cmd, Buffer &out) {
+    return zcombine_store(cmd, out, false);
+}
+
+// ZINTERSTORE, with the same arguments, keeps members found in every key
+uint32_t do_zinterstore(const Cmd &cmd, Buffer &out) {
+    return zcombine_store(cmd, out, true);
+}
+
 // Threaded ZSet destructor
-static void threaded_zset_destructor(void* arg) {
-    Entry* ent = (Entry*)arg;
-    if (ent->zset) {
-        // Free all ZSet nodes and the ZSet itself
-        // Free AVL tree nodes (if any)
-        // Free hash map inside ZSet
-        // For simplicity, just delete the ZSet (assuming its destructor is correct)
+static void threaded_zset_free(void *arg) {
+    delete (ZSet *)arg;
+}
+
+// Overwrite the value in place, turning a zset key into a string
+void entry_set_str(Entry *ent, std::string_view val) {
+    if (ent->type == T_ZSET) {
+        thread_pool_queue(&g_data.tp, threaded_zset_free, ent->zset);
+        ent->type = T_STR;
+        ent->ext = NULL;
+    }
+    if (val.size() <= ent->vcap) {
+        free(ent->ext);
+        ent->ext = NULL;
+        memcpy(ent->data + ent->klen, val.data(), val.size());
+    } else {
+        char *ext = (char *)realloc(ent->ext, val.size());
+        if (!ext) {
+            throw std::bad_alloc();
+        }
+        ent->ext = ext;
+        memcpy(ext, val.data(), val.size());
+    }
+    ent->vlen = (uint32_t)val.size();
+}
+
+static void entry_free(Entry *ent) {
+    if (ent->type == T_ZSET) {
         delete ent->zset;
-        ent->zset = nullptr;
+    } else {
+        free(ent->ext);
     }
-    delete ent;
+    free(ent);
+}
+
+static void threaded_zset_destructor(void* arg) {
+    entry_free((Entry *)arg);
 }
 
 void entry_del(Entry *ent) {
-    if (ent->type == 1 && ent->zset) {
+    if (ent->type == T_ZSET) {
         // Offload ZSet deletion to thread pool
         thread_pool_queue(&g_data.tp, threaded_zset_destructor, ent);
     } else {
-        delete ent;
+        entry_free(ent);
     }
-}
\ No newline at end of file
+}
+const int64_t k_scan_count = 10;     // keys per SCAN unless asked otherwise
+const int64_t k_scan_max_count = 1000;
+
+static void cb_collect(HNode *node, void *arg) {
+    ((std::vector<HNode *> *)arg)->push_back(node);
+}
+
+// SCAN cursor [count]: about `count` keys and the cursor to continue
+// from, as [cursor, [key...]]. Cursor 0 starts and ends a full pass.
+uint32_t do_scan(const Cmd &cmd, Buffer &out) {
+    int64_t cursor = 0;
+    int64_t count = k_scan_count;
+    if (!str2int(cmd[1], cursor) || (cmd.size() > 2 && !str2int(cmd[2], count)) || count <= 0) {
+        out_err(out, RES_ERR, "expect int64");
+        return RES_ERR;
+    }
+    count = std::min(count, k_scan_max_count);
+    uint64_t shard = (uint64_t)cursor >> k_scan_shard_shift;
+    uint64_t pos = (uint64_t)cursor & ((1ull << k_scan_shard_shift) - 1);
+    if (shard != g_shard_id) {
+        out_err(out, RES_ERR, "invalid cursor");
+        return RES_ERR;
+    }
+    // node pointers only; the keys are serialized once below
+    static thread_local std::vector<HNode *> nodes;
+    nodes.clear();
+    // bound the empty buckets one call may walk, as well as the keys
+    int64_t steps = count * 10;
+    do {
+        pos = cm_scan_step(&g_data.db, pos, &cb_collect, &nodes);
+    } while (pos != 0 && (int64_t)nodes.size() < count && --steps > 0);
+    uint64_t next = shard << k_scan_shard_shift | pos;
+    if (pos == 0) {
+        // on to the next loop's keys, or done
+        next = shard + 1 < g_shards.size() ? (shard + 1) << k_scan_shard_shift : 0;
+    }
+    out_arr(out, 2);
+    out_int(out, (int64_t)next);
+    out_arr(out, (uint32_t)nodes.size());
+    for (HNode *node : nodes) {
+        out_str(out, entry_key(container_of(node, Entry, node)));
+    }
+    return RES_OK;
+}
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <poll.h>
 #include <fcntl.h>
@@ -22,16 +23,21 @@
 #include "timer.h"
 #include "serialisation.h"
 #include "thread.h"
+#include "buffer.h"
 
-#define k_max_args 4
-const size_t k_max_msg = 4096; // Maximum message size
+#define k_max_args 8 // arguments Cmd holds inline; zrangebyscore takes 8
+const uint32_t k_args_any = UINT32_MAX; // max_args of a variadic command
+const size_t k_max_msg = 32 << 20; // Maximum message size of the protocol
+// Per-client cap on a single request or reply (--max-msg), at most k_max_msg
+extern size_t g_max_msg;
 int32_t read_full(int fd, char* buf, size_t len);
 int32_t write_all(int fd, const char* buf, size_t len);
 void die(const char* msg);
 enum {
     STATE_REQ = 0,
-    STATE_RES = 1,
+    STATE_RES = 1, // replies queued in wbuf; reading continues
     STATE_END = 2, // mark the connection for deletion
+    STATE_WAIT = 3, // a forwarded command is running on another loop
 };
 enum {
     RES_OK = 0,
@@ -40,47 +46,197 @@ enum {
 };
 struct Conn {
     int fd = -1;
-    uint32_t state = 0; // either STATE_REQ or STATE_RES
-    // buffer for reading
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
-    // buffer for writing
-    size_t wbuf_size = 0;
-    size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
+    uint32_t state = 0; // one of the STATE_* values
+    // buffers start empty and grow on demand up to about g_max_msg
+    Buffer rbuf;
+    Buffer wbuf;
+    // io_uring only: bytes owned by the in-flight send, and a tag that
+    // tells completions for this Conn from ones for an earlier fd owner
+    Buffer sbuf;
+    uint32_t gen = 0;
+    bool recv_armed = false;
+    // the peer failed while parked; the Conn lives until its forwarded
+    // reply is in, since the pending ShardReq still points at it
+    bool closing = false;
     uint64_t idle_start = 0;
     DList idle_list;
 };
+// Command IDs, resolved once per request by cmd_lookup()
+enum {
+    CMD_KEYS,
+    CMD_GET,
+    CMD_SET,
+    CMD_DEL,
+    CMD_ZADD,
+    CMD_ZSCORE,
+    CMD_ZREM,
+    CMD_ZQUERY,
+    CMD_EXPIRE,
+    CMD_TTL,
+    CMD_SCAN,
+    CMD_MGET,
+    CMD_ZRANK,
+    CMD_ZREVRANK,
+    CMD_ZCOUNT,
+    CMD_ZRANGE,
+    CMD_ZRANGEBYSCORE,
+    CMD_ZREVRANGEBYSCORE,
+    CMD_ZUNIONSTORE,
+    CMD_ZINTERSTORE,
+    CMD_INFO,
+    CMD_COUNT, // also the id of an unknown command
+};
+struct CmdStats {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+};
+// Closed connections are kept for reuse instead of going back to malloc.
+// Their buffers stay allocated (unless oversized), so a recycled Conn
+// usually serves its first request without touching the allocator.
+const size_t k_conn_pool_max = 256;
+struct ConnPool {
+    std::vector<Conn *> free_conns;
+    uint64_t allocs = 0;   // Conns obtained from malloc
+    uint64_t reuses = 0;   // Conns taken from the pool
+    uint64_t releases = 0; // Conns returned to the pool
+    uint64_t drops = 0;    // Conns freed because the pool was full
+};
 struct GlobalData {
-    HMap db;
+    CMap db;
     ZSet zset;
     std::vector<Conn *> fd2conn;
     DList idle_list;
     std::vector<HeapItem> heap;
     ThreadPool tp;
+    int epfd = -1; // epoll instance of the event loop (Linux only)
+    bool uring = false; // this loop runs the io_uring backend
+    CmdStats cmd_stats[CMD_COUNT];
+    ConnPool conn_pool;
+};
+
+// One instance per event loop thread; each loop owns a shard of the keyspace
+extern thread_local GlobalData g_data;
+
+// Request arguments as views into the request bytes (usually conn->rbuf).
+// They die with the request, so handlers copy only what they store.
+uint32_t cmd_lookup(std::string_view name);
+struct Cmd {
+    std::string_view args[k_max_args];
+    std::vector<std::string_view> more; // past k_max_args, variadic commands only
+    size_t argc = 0;
+    uint32_t id = CMD_COUNT;
+    Cmd() {}
+    Cmd(const std::vector<std::string> &v) {
+        for (const std::string &s : v) {
+            push(s);
+        }
+        if (argc) {
+            id = cmd_lookup(args[0]);
+        }
+    }
+    void push(std::string_view arg) {
+        if (argc < k_max_args) {
+            args[argc] = arg;
+        } else {
+            more.push_back(arg);
+        }
+        argc++;
+    }
+    size_t size() const { return argc; }
+    bool empty() const { return argc == 0; }
+    const std::string_view &operator[](size_t i) const {
+        assert(i < argc);
+        return i < k_max_args ? args[i] : more[i - k_max_args];
+    }
+};
+
+enum {
+    CMD_F_READ = 1,
+    CMD_F_WRITE = 2,
+    CMD_F_FANOUT = 4, // keyless, runs on every shard and merges the arrays
+    CMD_F_CURSOR = 8, // routed by the shard index in a SCAN cursor
+    CMD_F_KEYS = 16,  // every argument is a key; merged by position across shards
+    CMD_F_SHARED = 32, // reads another loop's key in place instead of forwarding
+};
+
+// A SCAN cursor carries the shard being scanned in its top byte
+const int k_scan_shard_shift = 56;
+struct ShardJob;
+// One row of the command table; arity counts the command name
+struct CmdSpec {
+    const char *name;
+    uint32_t (*handler)(const Cmd &cmd, Buffer &out);
+    uint32_t min_args;
+    uint32_t max_args;
+    uint32_t flags;
+    // optional: the command as a job for the thread pool; NULL after
+    // writing an error reply
+    ShardJob *(*job)(const Cmd &cmd, Buffer &out) = NULL;
 };
+extern const CmdSpec g_cmds[CMD_COUNT];
 
-extern GlobalData g_data;
-int32_t do_request(std::vector<std::string> &cmd, std::string &out);
-uint32_t do_get(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_set(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_del(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_keys(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_zadd(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_zscore(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_zrem(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_query(const std::vector<std::string> &cmd, std::string &out);
-uint32_t do_expire(std::vector<std::string> &cmd, std::string &out);
-uint32_t do_ttl(std::vector<std::string> &cmd, std::string &out);
-int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &cmd);
+// With `job`, a command that has a job form may return one in *job
+// instead of running; its reply then comes from the job
+int32_t do_request(const Cmd &cmd, Buffer &out, ShardJob **job = NULL);
+uint32_t do_get(const Cmd &cmd, Buffer &out);
+uint32_t do_set(const Cmd &cmd, Buffer &out);
+uint32_t do_del(const Cmd &cmd, Buffer &out);
+uint32_t do_keys(const Cmd &cmd, Buffer &out);
+uint32_t do_zadd(const Cmd &cmd, Buffer &out);
+uint32_t do_zscore(const Cmd &cmd, Buffer &out);
+uint32_t do_zrem(const Cmd &cmd, Buffer &out);
+uint32_t do_query(const Cmd &cmd, Buffer &out);
+uint32_t do_expire(const Cmd &cmd, Buffer &out);
+uint32_t do_ttl(const Cmd &cmd, Buffer &out);
+uint32_t do_scan(const Cmd &cmd, Buffer &out);
+uint32_t do_mget(const Cmd &cmd, Buffer &out);
+uint32_t do_zrank(const Cmd &cmd, Buffer &out);
+uint32_t do_zrevrank(const Cmd &cmd, Buffer &out);
+uint32_t do_zcount(const Cmd &cmd, Buffer &out);
+uint32_t do_zrange(const Cmd &cmd, Buffer &out);
+uint32_t do_zrangebyscore(const Cmd &cmd, Buffer &out);
+uint32_t do_zrevrangebyscore(const Cmd &cmd, Buffer &out);
+uint32_t do_zunionstore(const Cmd &cmd, Buffer &out);
+uint32_t do_zinterstore(const Cmd &cmd, Buffer &out);
+ShardJob *zunionstore_job(const Cmd &cmd, Buffer &out);
+ShardJob *zinterstore_job(const Cmd &cmd, Buffer &out);
+uint32_t do_info(const Cmd &cmd, Buffer &out);
+// Pipelined GETs look their keys up together, then reply one by one
+void db_lookup_batch(const std::string_view *keys, size_t n, HNode **out);
+int32_t do_get_node(HNode *node, Buffer &out);
+int32_t do_get_remote(size_t owner, std::string_view key, Buffer &out);
+int32_t parse_req(const uint8_t *data, size_t len, Cmd &cmd);
+enum {
+    T_STR = 0,
+    T_ZSET = 1,
+};
+
+// Values up to this size live in the Entry's own allocation
+const uint32_t k_val_inline_max = 256;
+
+// One allocation per key: the header, then the key bytes, then the value
+// bytes when the value is inline. Larger values and zsets hang off `ext`.
 struct Entry {
     struct HNode node;
-    std::string key;
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
-    size_t heap_idx = -1;
+    size_t heap_idx;    // TTL heap position, -1 when no TTL
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t vcap;      // inline value bytes after the key
+    uint8_t type;       // T_STR or T_ZSET
+    union {
+        char *ext;      // T_STR: malloc'd value, NULL when inline
+        ZSet *zset;     // T_ZSET
+    };
+    char data[0];
 };
+
+inline std::string_view entry_key(const Entry *ent) {
+    return std::string_view(ent->data, ent->klen);
+}
+
+inline std::string_view entry_val(const Entry *ent) {
+    return std::string_view(ent->ext ? ent->ext : ent->data + ent->klen, ent->vlen);
+}
 // Portable C++ version of container_of macro
 #include <cstddef>
 #define container_of(ptr, type, member) \
@@ -88,7 +244,12 @@ struct Entry {
 
 // entry_eq macro removed; use the function version in common.cpp
 bool entry_eq(HNode *lhs, HNode *rhs);
-bool str2int(const std::string &s, int64_t &out);
+bool entry_key_eq(HNode *node, HNode *key);
+bool str2int(std::string_view s, int64_t &out);
+bool str2dbl(std::string_view s, double &out);
+Entry *entry_new_str(std::string_view key, uint64_t hcode, std::string_view val);
+Entry *entry_new_zset(std::string_view key, uint64_t hcode);
+void entry_set_str(Entry *ent, std::string_view val);
 void entry_del(Entry *ent);
     
     
\ No newline at end of file
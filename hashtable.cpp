@@ -11,13 +11,20 @@
 #include <sys/types.h>  // for ssize_t
 #include "common.h"
 #include <vector>
+#include <algorithm>     // for std::max
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
 #include "utils.h"
 #include "hashtable.h"
+#include "log.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>  // for _mm_cmpeq_epi8, _mm_movemask_epi8
+#endif
 #include "serialisation.h"
 
+uint32_t g_hm_engine = HM_CHAIN;
+
 static void hinit(HTab *ht, size_t size) {
     assert(size > 0 && (size & (size - 1)) == 0); // size must be a power of 2
     ht->tab = (HNode **)calloc(size, sizeof(HNode *));
@@ -55,16 +62,26 @@ static HNode* h_detach(HTab *htab, HNode **from) {
     return node;
 }
 
-static void hm_start_resizing(HMap *hmap) {
+static size_t round_up_pow2(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Both growing and shrinking move every node to a new ht1 of `nbuckets`
+static void hm_start_resizing(HMap *hmap, size_t nbuckets) {
     assert(hmap->ht2.tab == NULL);
     hmap->ht2 = hmap->ht1;
-    hinit(&hmap->ht1, (hmap->ht1.mask + 1) * 2);
+    hinit(&hmap->ht1, nbuckets);
     hmap->resizing_pos = 0;
 }
 
 static void hm_help_resizing(HMap *hmap) {
     size_t nwork = 0;
-    while (nwork < k_resizing_work && hmap->ht2.size>0) {
+    size_t nscan = 0;
+    while (nwork < k_resizing_work && nscan++ < k_resizing_scan && hmap->ht2.size>0) {
         HNode **from = &hmap->ht2.tab[hmap->resizing_pos];
         if (!*from) {
             hmap->resizing_pos++;
@@ -79,8 +96,20 @@ static void hm_help_resizing(HMap *hmap) {
     }
 }
 
+static void sm_insert(HMap *hmap, HNode *node);
+static void sm_help_resizing(HMap *hmap);
+static HNode *sm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+static HNode *sm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+
 void hm_insert(HMap *hmap, HNode *node) {
-    printf("[DEBUG] hm_insert: inserting node at %p\n", (void*)node);
+    LOG(LOG_TRACE, "hm_insert: node %llx", (uintptr_t)node);
+    if (!hmap->ht1.tab && !hmap->st1.ctrl) {
+        hmap->engine = g_hm_engine; // nothing allocated yet
+    }
+    if (hmap->engine == HM_SWISS) {
+        sm_insert(hmap, node);
+        return;
+    }
     if (!hmap->ht1.tab){
         hinit(&hmap->ht1,4);
     }
@@ -88,7 +117,7 @@ void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->ht2.tab) {
         size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
         if (load_factor>k_max_load_factor) {
-            hm_start_resizing(hmap);
+            hm_start_resizing(hmap, (hmap->ht1.mask + 1) * 2);
         }
 
     }
@@ -98,17 +127,148 @@ void hm_insert(HMap *hmap, HNode *node) {
 
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_resizing(hmap);
+    if (hmap->engine == HM_SWISS) {
+        sm_help_resizing(hmap);
+    } else {
+        hm_help_resizing(hmap);
+    }
+    return hm_lookup_ro(hmap, key, eq);
+}
+
+HNode *hm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    if (hmap->engine == HM_SWISS) {
+        return sm_lookup_ro(hmap, key, eq);
+    }
     HNode **from = hlookup(&hmap->ht1, key, eq);
     from = from ? from : hlookup(&hmap->ht2, key, eq);
     return from ? *from : NULL;
 }
 
-HNode *hm_delete(HMap *hmap, HNode *key) {
+static HNode *sm_find_or_insert(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *),
+                               HNode *(*make)(HNode *, void *), void *arg, bool *inserted);
+
+static void sm_lookup_batch(HMap **maps, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out);
+
+// Walks the chains of a batch in lock step, one node per key per round,
+// prefetching each key's next node before moving on to the other keys.
+// keys[i] is looked up in maps[i]; resolved keys are cleared.
+static void h_lookup_batch(HMap **maps, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out) {
+    HNode *cur[k_lookup_batch];
+    bool in_ht2[k_lookup_batch];
+    for (size_t i = 0; i < n; i++) {
+        HTab *ht = &maps[i]->ht1;
+        if (ht->tab) {
+            __builtin_prefetch(&ht->tab[keys[i]->hcode & ht->mask]);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        HTab *ht = &maps[i]->ht1;
+        cur[i] = ht->tab ? ht->tab[keys[i]->hcode & ht->mask] : NULL;
+        in_ht2[i] = false;
+        __builtin_prefetch(cur[i]);
+    }
+    for (size_t left = n; left > 0;) {
+        left = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (!keys[i]) {
+                continue; // resolved
+            }
+            HNode *node = cur[i];
+            HTab *ht2 = &maps[i]->ht2;
+            if (!node && !in_ht2[i] && ht2->tab) {
+                in_ht2[i] = true;
+                node = cur[i] = ht2->tab[keys[i]->hcode & ht2->mask];
+            }
+            if (!node || (node->hcode == keys[i]->hcode && eq(node, keys[i]))) {
+                out[i] = node;
+                keys[i] = NULL;
+                continue;
+            }
+            cur[i] = node->next;
+            __builtin_prefetch(cur[i]);
+            left++;
+        }
+    }
+}
+
+void hm_lookup_batch_maps(HMap **maps, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out) {
+    // split each chunk by engine, then scatter the results back
+    HMap *emaps[2][k_lookup_batch];
+    HNode *ekeys[2][k_lookup_batch];
+    HNode *eout[2][k_lookup_batch];
+    size_t eidx[2][k_lookup_batch];
+    for (size_t start = 0; start < n; start += k_lookup_batch) {
+        size_t m = std::min(k_lookup_batch, n - start);
+        size_t cnt[2] = {0, 0};
+        for (size_t i = start; i < start + m; i++) {
+            int e = maps[i]->engine == HM_SWISS;
+            emaps[e][cnt[e]] = maps[i];
+            ekeys[e][cnt[e]] = keys[i];
+            eidx[e][cnt[e]++] = i;
+        }
+        h_lookup_batch(emaps[0], ekeys[0], cnt[0], eq, eout[0]);
+        sm_lookup_batch(emaps[1], ekeys[1], cnt[1], eq, eout[1]);
+        for (int e = 0; e < 2; e++) {
+            for (size_t j = 0; j < cnt[e]; j++) {
+                out[eidx[e][j]] = eout[e][j];
+            }
+        }
+    }
+}
+
+void hm_lookup_batch(HMap *hmap, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out) {
+    HMap *maps[k_lookup_batch];
+    std::fill(maps, maps + k_lookup_batch, hmap);
+    for (size_t start = 0; start < n; start += k_lookup_batch) {
+        hm_lookup_batch_maps(maps, keys + start, std::min(k_lookup_batch, n - start), eq, out + start);
+    }
+}
+
+HNode *hm_find_or_insert(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *),
+                         HNode *(*make)(HNode *key, void *arg), void *arg, bool *inserted) {
+    *inserted = false;
+    if (!hmap->ht1.tab && !hmap->st1.ctrl) {
+        hmap->engine = g_hm_engine; // nothing allocated yet
+    }
+    if (hmap->engine == HM_SWISS) {
+        return sm_find_or_insert(hmap, key, eq, make, arg, inserted);
+    }
+    HNode *node = hm_lookup(hmap, key, eq);
+    if (!node) {
+        // a new node goes to the head of its bucket, no second walk
+        node = make(key, arg);
+        *inserted = true;
+        hm_insert(hmap, node);
+    }
+    return node;
+}
+
+// Rebuild at about one node per bucket once the load factor drops below
+// 1/k_shrink_ratio, through the same incremental migration as growing
+static void hm_maybe_shrink(HMap *hmap) {
+    size_t nbuckets = hmap->ht1.mask + 1;
+    if (hmap->ht2.tab || nbuckets <= 4 || hmap->ht1.size * k_shrink_ratio >= nbuckets) {
+        return;
+    }
+    size_t target = round_up_pow2(hmap->ht1.size < 4 ? 4 : hmap->ht1.size);
+    hm_start_resizing(hmap, target);
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    if (hmap->engine == HM_SWISS) {
+        return sm_delete(hmap, key, eq);
+    }
     hm_help_resizing(hmap);
-    HNode **from = hlookup(&hmap->ht1, key, entry_eq);
-    if (!from) from = hlookup(&hmap->ht2, key, entry_eq);
-    return from ? h_detach(&hmap->ht1, from) : NULL;
+    HNode *node = NULL;
+    if (HNode **from = hlookup(&hmap->ht1, key, eq)) {
+        node = h_detach(&hmap->ht1, from);
+    } else if (HNode **from = hlookup(&hmap->ht2, key, eq)) {
+        node = h_detach(&hmap->ht2, from);
+    }
+    if (node) {
+        hm_maybe_shrink(hmap);
+    }
+    return node;
 }
 
 void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
@@ -125,10 +285,502 @@ void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
 }
 
 void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    out_str(out,container_of(node,Entry,node)->key);
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, entry_key(container_of(node, Entry, node)));
 }
 size_t hm_size(HMap *hmap) {
+    if (hmap->engine == HM_SWISS) {
+        return hmap->st1.size + hmap->st2.size;
+    }
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+// Open-addressing engine (HM_SWISS). A control byte is EMPTY, DELETED or
+// the top 7 bits of a live node's hash. Probing visits whole 16-slot
+// groups, comparing all tags at once, and only touches a node when its
+// tag matches. Growing works like the chained engine: the old table is
+// drained into the new one a little on every operation.
+
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xfe;
+
+static uint8_t stag(uint64_t hcode) {
+    return (uint8_t)(hcode >> 57);
+}
+
+// Bit i is set if slot i of the group has control byte `c`
+static uint32_t sgroup_match(const uint8_t *ctrl, uint8_t c) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group_size; i++) {
+        bits |= (uint32_t)(ctrl[i] == c) << i;
+    }
+    return bits;
+#endif
+}
+
+// Bit i is set if slot i is EMPTY or DELETED (the control byte's high bit)
+static uint32_t sgroup_free(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < k_group_size; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+static size_t sfirst_group(const STab *st, uint64_t hcode) {
+    return (size_t)hcode & st->mask & ~(k_group_size - 1);
+}
+
+// Triangular steps over groups visit every group of a power-of-2 table
+static size_t snext_group(const STab *st, size_t pos, size_t &step) {
+    step += k_group_size;
+    return (pos + step) & st->mask;
+}
+
+// Tables fill to 7/8 before they are rebuilt
+static size_t smax_used(const STab *st) {
+    return (st->mask + 1) / 8 * 7;
+}
+
+static void sinit(STab *st, size_t nslots) {
+    assert(nslots >= k_group_size && (nslots & (nslots - 1)) == 0);
+    st->ctrl = (uint8_t *)malloc(nslots);
+    st->slots = (HNode **)malloc(nslots * sizeof(HNode *));
+    if (!st->ctrl || !st->slots) {
+        die("malloc()");
+    }
+    memset(st->ctrl, k_ctrl_empty, nslots);
+    st->mask = nslots - 1;
+    st->size = 0;
+    st->used = 0;
+}
+
+static void sfree(STab *st) {
+    free(st->ctrl);
+    free(st->slots);
+    *st = STab{};
+}
+
+static void splace(STab *st, size_t i, HNode *node) {
+    st->used += st->ctrl[i] == k_ctrl_empty;
+    st->ctrl[i] = stag(node->hcode);
+    st->slots[i] = node;
+    st->size++;
+}
+
+static void sinsert(STab *st, HNode *node) {
+    size_t step = 0;
+    for (size_t pos = sfirst_group(st, node->hcode);; pos = snext_group(st, pos, step)) {
+        uint32_t bits = sgroup_free(&st->ctrl[pos]);
+        if (bits) {
+            splace(st, pos + (size_t)__builtin_ctz(bits), node);
+            return;
+        }
+    }
+}
+
+// Returns the slot index, or SIZE_MAX. If `free_i` is given it gets the
+// slot sinsert() would use for the key when it is not found.
+static size_t slookup(STab *st, HNode *key, bool (*eq)(HNode *, HNode *), size_t *free_i = NULL) {
+    if (!st->ctrl) {
+        return SIZE_MAX;
+    }
+    uint8_t tag = stag(key->hcode);
+    size_t step = 0;
+    bool want_free = free_i != NULL;
+    for (size_t pos = sfirst_group(st, key->hcode);; pos = snext_group(st, pos, step)) {
+        const uint8_t *group = &st->ctrl[pos];
+        for (uint32_t bits = sgroup_match(group, tag); bits; bits &= bits - 1) {
+            size_t i = pos + (size_t)__builtin_ctz(bits);
+            HNode *cur = st->slots[i];
+            if (cur->hcode == key->hcode && eq(cur, key)) {
+                return i;
+            }
+        }
+        if (want_free) {
+            if (uint32_t bits = sgroup_free(group)) {
+                *free_i = pos + (size_t)__builtin_ctz(bits);
+                want_free = false;
+            }
+        }
+        if (sgroup_match(group, k_ctrl_empty)) {
+            return SIZE_MAX; // the key would have gone here
+        }
+    }
+}
+
+static HNode *sdetach(STab *st, size_t i) {
+    HNode *node = st->slots[i];
+    // A group that still has an EMPTY slot was never full, so no probe
+    // ever went past it and the slot can be EMPTY again. Otherwise leave
+    // a tombstone to keep later probes going.
+    size_t pos = i & ~(k_group_size - 1);
+    if (sgroup_match(&st->ctrl[pos], k_ctrl_empty)) {
+        st->ctrl[i] = k_ctrl_empty;
+        st->used--;
+    } else {
+        st->ctrl[i] = k_ctrl_deleted;
+    }
+    st->size--;
+    return node;
+}
+
+static void sm_help_resizing(HMap *hmap) {
+    STab *from = &hmap->st2;
+    size_t nwork = 0;
+    size_t nscan = 0;
+    while (nwork < k_resizing_work && nscan++ < k_resizing_scan && from->size > 0) {
+        size_t i = hmap->resizing_pos++;
+        if (from->ctrl[i] & 0x80) {
+            continue; // EMPTY or DELETED
+        }
+        // tombstone, not EMPTY: other nodes in `from` may probe past it
+        from->ctrl[i] = k_ctrl_deleted;
+        from->size--;
+        sinsert(&hmap->st1, from->slots[i]);
+        nwork++;
+    }
+    if (from->ctrl && from->size == 0) {
+        sfree(from);
+    }
+}
+
+static void smove_all(STab *from, STab *to) {
+    for (size_t i = 0; from->size > 0 && i <= from->mask; i++) {
+        if (!(from->ctrl[i] & 0x80)) {
+            sinsert(to, from->slots[i]);
+            from->size--;
+        }
+    }
+    sfree(from);
+}
+
+// Move every node to a fresh st1 of `nslots`, a bit per operation.
+// `nslots` must hold the nodes of both tables.
+static void sm_start_resizing(HMap *hmap, size_t nslots) {
+    if (hmap->st2.ctrl) {
+        // Rare: the previous move is not done and st1 is already full.
+        // Draining st2 into st1 could overfill it, so move both tables
+        // into the new one right now.
+        STab fresh;
+        sinit(&fresh, nslots);
+        smove_all(&hmap->st2, &fresh);
+        smove_all(&hmap->st1, &fresh);
+        hmap->st1 = fresh;
+        return;
+    }
+    hmap->st2 = hmap->st1;
+    sinit(&hmap->st1, nslots);
+    hmap->resizing_pos = 0;
+}
+
+static void sm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->st1.ctrl) {
+        sinit(&hmap->st1, k_group_size);
+    }
+    if (hmap->st1.used + 1 > smax_used(&hmap->st1)) {
+        // twice the slots if more than half full of live nodes, else the
+        // same size, which just clears out the tombstones
+        size_t live = hmap->st1.size + hmap->st2.size + 1;
+        size_t nslots = hmap->st1.mask + 1;
+        if (live > smax_used(&hmap->st1) / 2) {
+            nslots = std::max(nslots * 2, round_up_pow2(live * 2));
+        }
+        sm_start_resizing(hmap, nslots);
+    }
+    sinsert(&hmap->st1, node);
+    sm_help_resizing(hmap);
+}
+
+static HNode *sm_find_or_insert(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *),
+                               HNode *(*make)(HNode *, void *), void *arg, bool *inserted) {
+    if (!hmap->st1.ctrl) {
+        sinit(&hmap->st1, k_group_size);
+    }
+    sm_help_resizing(hmap);
+    size_t free_i = SIZE_MAX;
+    size_t i = slookup(&hmap->st1, key, eq, &free_i);
+    if (i != SIZE_MAX) {
+        return hmap->st1.slots[i];
+    }
+    i = slookup(&hmap->st2, key, eq);
+    if (i != SIZE_MAX) {
+        return hmap->st2.slots[i];
+    }
+    HNode *node = make(key, arg);
+    *inserted = true;
+    if (hmap->st1.used + 1 > smax_used(&hmap->st1)) {
+        sm_insert(hmap, node); // rebuilds the table; the slot is stale
+    } else {
+        splace(&hmap->st1, free_i, node);
+        sm_help_resizing(hmap);
+    }
+    return node;
+}
+
+// Fetch the home groups of every key, then the nodes their tags point
+// at, then resolve each key with the lines already on their way
+static void sprefetch_groups(STab *st, HNode *key) {
+    if (st->ctrl) {
+        size_t pos = sfirst_group(st, key->hcode);
+        __builtin_prefetch(&st->ctrl[pos]);
+        __builtin_prefetch(&st->slots[pos]);
+    }
+}
+
+static void sprefetch_nodes(STab *st, HNode *key) {
+    if (st->ctrl) {
+        size_t pos = sfirst_group(st, key->hcode);
+        uint32_t bits = sgroup_match(&st->ctrl[pos], stag(key->hcode));
+        if (bits) {
+            __builtin_prefetch(st->slots[pos + (size_t)__builtin_ctz(bits)]);
+        }
+    }
+}
+
+static void sm_lookup_batch(HMap **maps, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out) {
+    for (size_t i = 0; i < n; i++) {
+        sprefetch_groups(&maps[i]->st1, keys[i]);
+        sprefetch_groups(&maps[i]->st2, keys[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        sprefetch_nodes(&maps[i]->st1, keys[i]);
+        sprefetch_nodes(&maps[i]->st2, keys[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[i] = hm_lookup_ro(maps[i], keys[i], eq);
+    }
+}
+
+static HNode *sm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    size_t i = slookup(&hmap->st1, key, eq);
+    if (i != SIZE_MAX) {
+        return hmap->st1.slots[i];
+    }
+    i = slookup(&hmap->st2, key, eq);
+    return i != SIZE_MAX ? hmap->st2.slots[i] : NULL;
+}
+
+// Rebuild at about half full once fewer than 1/(2*k_shrink_ratio) of the
+// slots are live
+static void sm_maybe_shrink(HMap *hmap) {
+    size_t nslots = hmap->st1.mask + 1;
+    if (hmap->st2.ctrl || nslots <= k_group_size
+        || hmap->st1.size * 2 * k_shrink_ratio >= nslots) {
+        return;
+    }
+    size_t target = round_up_pow2(hmap->st1.size * 2);
+    sm_start_resizing(hmap, target < k_group_size ? k_group_size : target);
+}
+
+static HNode *sm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    sm_help_resizing(hmap);
+    HNode *node = NULL;
+    size_t i = slookup(&hmap->st1, key, eq);
+    if (i != SIZE_MAX) {
+        node = sdetach(&hmap->st1, i);
+    } else if ((i = slookup(&hmap->st2, key, eq)) != SIZE_MAX) {
+        node = sdetach(&hmap->st2, i);
+    }
+    if (node) {
+        sm_maybe_shrink(hmap);
+    }
+    return node;
+}
+
+static void s_scan(STab *st, void (*f)(HNode *, void *), void *arg) {
+    if (st->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i <= st->mask; i++) {
+        if (!(st->ctrl[i] & 0x80)) {
+            f(st->slots[i], arg);
+        }
+    }
+}
+
+// Visit every node once, whichever engine the map uses
+void hm_scan(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    if (hmap->engine == HM_SWISS) {
+        s_scan(&hmap->st1, f, arg);
+        s_scan(&hmap->st2, f, arg);
+        return;
+    }
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+void hm_clear(HMap *hmap) {
+    free(hmap->ht1.tab);
+    free(hmap->ht2.tab);
+    sfree(&hmap->st1);
+    sfree(&hmap->st2);
+    *hmap = HMap{};
+}
+
+
+// Resumable scan. The cursor counts up in bit-reversed order over the
+// bucket index (as in Redis' dictScan): the high bits vary fastest, so a
+// bucket of a larger table is an expansion of a smaller table's bucket
+// and neither growing nor shrinking between steps skips nodes. For the
+// open-addressing engine the unit is a node's home group (its first
+// probe position); table size changes work the same way.
+
+static uint64_t rev64(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0full) | ((v & 0x0f0f0f0f0f0f0f0full) << 4);
+    v = ((v >> 8) & 0x00ff00ff00ff00ffull) | ((v & 0x00ff00ff00ff00ffull) << 8);
+    v = ((v >> 16) & 0x0000ffff0000ffffull) | ((v & 0x0000ffff0000ffffull) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+// Add one to the bits of v under `mask`, most significant bit first
+static uint64_t scan_next(uint64_t v, uint64_t mask) {
+    v |= ~mask;
+    return rev64(rev64(v) + 1);
+}
+
+// Scan units of the newer (which == 0) or older table; 0 if absent
+static uint64_t scan_units(HMap *hmap, int which) {
+    if (hmap->engine == HM_SWISS) {
+        STab *st = which ? &hmap->st2 : &hmap->st1;
+        return st->ctrl ? (st->mask + 1) / k_group_size : 0;
+    }
+    HTab *ht = which ? &hmap->ht2 : &hmap->ht1;
+    return ht->tab ? ht->mask + 1 : 0;
+}
+
+static void scan_unit(HMap *hmap, int which, uint64_t unit, void (*f)(HNode *, void *), void *arg) {
+    if (hmap->engine != HM_SWISS) {
+        HTab *ht = which ? &hmap->ht2 : &hmap->ht1;
+        for (HNode *node = ht->tab[unit]; node; node = node->next) {
+            f(node, arg);
+        }
+        return;
+    }
+    // Nodes with this home group sit on its probe path, no further than
+    // the first group with an EMPTY slot (such a group was never full)
+    STab *st = which ? &hmap->st2 : &hmap->st1;
+    size_t home = (size_t)unit * k_group_size;
+    size_t step = 0;
+    for (size_t pos = home;; pos = snext_group(st, pos, step)) {
+        for (size_t i = pos; i < pos + k_group_size; i++) {
+            if (!(st->ctrl[i] & 0x80) && sfirst_group(st, st->slots[i]->hcode) == home) {
+                f(st->slots[i], arg);
+            }
+        }
+        if (sgroup_match(&st->ctrl[pos], k_ctrl_empty)) {
+            return;
+        }
+    }
+}
+
+uint64_t hm_scan_step(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg) {
+    uint64_t n0 = scan_units(hmap, 0);
+    uint64_t n1 = scan_units(hmap, 1);
+    if (n0 == 0 && n1 == 0) {
+        return 0;
+    }
+    if (n0 == 0 || n1 == 0) {
+        int which = n0 ? 0 : 1;
+        uint64_t m = (n0 ? n0 : n1) - 1;
+        scan_unit(hmap, which, cursor & m, f, arg);
+        return scan_next(cursor, m);
+    }
+    // Resizing: visit the unit in the smaller table, then all units of
+    // the larger table that expand it
+    int small = n0 <= n1 ? 0 : 1;
+    uint64_t m0 = (small == 0 ? n0 : n1) - 1;
+    uint64_t m1 = (small == 0 ? n1 : n0) - 1;
+    scan_unit(hmap, small, cursor & m0, f, arg);
+    do {
+        scan_unit(hmap, 1 - small, cursor & m1, f, arg);
+        cursor = scan_next(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+// Stripes take hash bits above any bucket index and below the tag bits
+static size_t cm_index(uint64_t hcode) {
+    return (size_t)(hcode >> 48) & (k_cmap_stripes - 1);
+}
+
+HMap *cm_stripe(CMap *cm, uint64_t hcode) {
+    return &cm->stripes[cm_index(hcode)].map;
+}
+
+void cm_write_begin(CMap *cm, uint64_t hcode) {
+    if (cm->shared) {
+        pthread_rwlock_wrlock(&cm->stripes[cm_index(hcode)].lock);
+    }
+}
+
+void cm_write_end(CMap *cm, uint64_t hcode) {
+    if (cm->shared) {
+        pthread_rwlock_unlock(&cm->stripes[cm_index(hcode)].lock);
+    }
+}
+
+HNode *cm_lookup(CMap *cm, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    return hm_lookup_ro(cm_stripe(cm, key->hcode), key, eq);
+}
+
+void cm_lookup_batch(CMap *cm, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out) {
+    HMap *maps[k_lookup_batch];
+    for (size_t start = 0; start < n; start += k_lookup_batch) {
+        size_t m = std::min(k_lookup_batch, n - start);
+        for (size_t i = 0; i < m; i++) {
+            maps[i] = cm_stripe(cm, keys[start + i]->hcode);
+        }
+        hm_lookup_batch_maps(maps, keys + start, m, eq, out + start);
+    }
+}
+
+size_t cm_size(CMap *cm) {
+    size_t size = 0;
+    for (CMapStripe &stripe : cm->stripes) {
+        size += hm_size(&stripe.map);
+    }
+    return size;
+}
+
+void cm_scan(CMap *cm, void (*f)(HNode *, void *), void *arg) {
+    for (CMapStripe &stripe : cm->stripes) {
+        hm_scan(&stripe.map, f, arg);
+    }
+}
+
+const int k_cm_cursor_shift = 48;
+
+uint64_t cm_scan_step(CMap *cm, uint64_t cursor, void (*f)(HNode *, void *), void *arg) {
+    uint64_t idx = cursor >> k_cm_cursor_shift;
+    if (idx >= k_cmap_stripes) {
+        return 0;
+    }
+    uint64_t pos = cursor & ((1ull << k_cm_cursor_shift) - 1);
+    pos = hm_scan_step(&cm->stripes[idx].map, pos, f, arg);
+    if (pos == 0 && ++idx == k_cmap_stripes) {
+        return 0;
+    }
+    return idx << k_cm_cursor_shift | pos;
+}
+
+bool cm_read(CMap *cm, HNode *key, bool (*eq)(HNode *, HNode *), void (*f)(HNode *, void *), void *arg) {
+    CMapStripe &stripe = cm->stripes[cm_index(key->hcode)];
+    pthread_rwlock_rdlock(&stripe.lock);
+    HNode *node = hm_lookup_ro(&stripe.map, key, eq);
+    if (node) {
+        f(node, arg);
+    }
+    pthread_rwlock_unlock(&stripe.lock);
+    return node != NULL;
+}
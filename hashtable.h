@@ -15,6 +15,7 @@
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
+#include <pthread.h>     // for pthread_rwlock_t
 
 struct HNode {
     HNode *next = NULL;
@@ -27,9 +28,30 @@ struct HTab {
     size_t mask = 0;
 };
 
+// Open-addressing table: one control byte per slot, either a 7-bit tag
+// from the hash or EMPTY/DELETED, scanned 16 slots at a time
+struct STab {
+    uint8_t *ctrl = NULL;
+    HNode **slots = NULL;
+    size_t mask = 0; // slot count - 1, at least 15
+    size_t size = 0; // live nodes
+    size_t used = 0; // live nodes + tombstones
+};
+
+enum {
+    HM_CHAIN = 0, // chained buckets (HTab)
+    HM_SWISS = 1, // open addressing with tag groups (STab)
+};
+
+// Default engine for maps that have not stored anything yet
+extern uint32_t g_hm_engine;
+
 struct HMap {
+    uint32_t engine = HM_CHAIN; // fixed by the first insert
     HTab ht1; // newer
     HTab ht2; // older
+    STab st1; // newer
+    STab st2; // older
     size_t resizing_pos = 0;
 };
 
@@ -40,13 +62,79 @@ struct HKey {
 };
 
 const size_t k_max_load_factor = 8;
+// Shrink once a table is this many times emptier than the size it would
+// be rebuilt at. The gap to the grow threshold keeps a map from flipping
+// between two sizes.
+const size_t k_shrink_ratio = 8;
 
 const size_t k_resizing_work = 128;
+// Slots or buckets a resizing step may look at. Draining a mostly empty
+// table after a shrink would otherwise scan long empty runs in one go.
+const size_t k_resizing_scan = k_resizing_work * 16;
+
+const size_t k_group_size = 16; // slots per control-byte group
+const size_t k_lookup_batch = 16; // keys hm_lookup_batch keeps in flight
 
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
-HNode *hm_delete(HMap *hmap, HNode *key);
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// hm_lookup without helping a resize along, so it never writes to the map
+HNode *hm_lookup_ro(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
+// Lookups for n keys at once: out[i] gets the match for keys[i] or NULL.
+// Memory accesses for all keys are issued before any is waited on, so
+// cache misses overlap instead of adding up. Read-only like hm_lookup_ro.
+void hm_lookup_batch(HMap *hmap, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out);
+// The same with keys[i] looked up in maps[i]
+void hm_lookup_batch_maps(HMap **maps, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out);
+// Returns the node equal to `key`, or inserts and returns `make(key, arg)`
+// if there is none, setting `*inserted`. The key is probed for once, so a
+// write that may or may not add a node costs a single lookup.
+HNode *hm_find_or_insert(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *),
+                         HNode *(*make)(HNode *key, void *arg), void *arg, bool *inserted);
 void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg);
+void hm_scan(HMap *hmap, void (*f)(HNode *, void *), void *arg);
+// One step of a resumable scan: visits the nodes of one bucket (plus its
+// expansion in the other table while resizing) and returns the cursor
+// for the next step, 0 once the scan is complete. Start from cursor 0.
+// A node present for the whole scan is visited at least once even if the
+// map resizes in between; a node may be visited more than once.
+uint64_t hm_scan_step(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
 void cb_scan(HNode *node, void *arg);
 void cb_scan(HNode *node, void *arg);
-size_t hm_size(HMap *hmap);
\ No newline at end of file
+size_t hm_size(HMap *hmap);
+// Frees the tables and empties the map; the nodes are left to their owner
+void hm_clear(HMap *hmap);
+
+// Lock-striped map for one writer thread and any number of reader
+// threads. Each stripe is an independent HMap behind a reader/writer
+// lock, so a resize step only ever touches one stripe. The owner reads
+// without locking (nobody else writes) and write-locks the stripe it
+// changes once `shared` is set; other threads only read, through
+// cm_read(). Lookups never move nodes; writes drive resizing.
+const size_t k_cmap_stripes = 64;
+
+struct alignas(64) CMapStripe {
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    HMap map;
+};
+
+struct CMap {
+    CMapStripe stripes[k_cmap_stripes];
+    bool shared = false; // other threads may call cm_read()
+};
+
+HMap *cm_stripe(CMap *cm, uint64_t hcode);
+// Bracket every change to the stripe of `hcode`, including changes to
+// what its nodes hold that readers look at
+void cm_write_begin(CMap *cm, uint64_t hcode);
+void cm_write_end(CMap *cm, uint64_t hcode);
+// Owner thread only
+HNode *cm_lookup(CMap *cm, HNode *key, bool (*eq)(HNode *, HNode *));
+void cm_lookup_batch(CMap *cm, HNode **keys, size_t n, bool (*eq)(HNode *, HNode *), HNode **out);
+size_t cm_size(CMap *cm);
+void cm_scan(CMap *cm, void (*f)(HNode *, void *), void *arg);
+// hm_scan_step over all stripes; the cursor keeps the stripe above bit 48
+uint64_t cm_scan_step(CMap *cm, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
+// Any thread: runs f on the node matching `key` under the stripe's read
+// lock. Returns false, without calling f, if there is none.
+bool cm_read(CMap *cm, HNode *key, bool (*eq)(HNode *, HNode *), void (*f)(HNode *, void *), void *arg);
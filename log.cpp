@@ -0,0 +1,132 @@
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <unistd.h>      // for read, write, close
+#include <sys/socket.h>  // for socket, setsockopt, bind, listen, accept
+#include <netinet/in.h>  // for sockaddr_in, htons, htonl
+#include <csignal>       // for signal (optional cleanup handling)
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <arpa/inet.h>   // for inet_ntop (if needed)
+#include <sys/types.h>  // for ssize_t
+#include <vector>
+#include <poll.h>        // for poll
+#include <fcntl.h>       // for fcntl, O_NONBLOCK
+#include <sys/select.h>
+#include <pthread.h>
+#include "log.h"
+#include "timer.h"
+
+const size_t k_log_ring = 4096;        // records per thread, power of 2
+const useconds_t k_log_flush_us = 10 * 1000;
+
+// Single-producer ring: the owning thread advances tail, the flusher
+// advances head. Neither side takes a lock.
+struct LogRing {
+    LogRec recs[k_log_ring];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+int g_log_level = LOG_INFO;
+
+// Guards the ring list and serializes consumers; producers never take it
+// except to register their ring once.
+static pthread_mutex_t g_log_mu = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<LogRing *> g_log_rings;
+static uint64_t g_log_dropped = 0;
+static thread_local LogRing *t_log_ring = NULL;
+
+static const char *const k_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+static LogRing *log_ring() {
+    if (!t_log_ring) {
+        // never freed: the flusher may still read it after the thread exits
+        t_log_ring = new LogRing();
+        pthread_mutex_lock(&g_log_mu);
+        g_log_rings.push_back(t_log_ring);
+        pthread_mutex_unlock(&g_log_mu);
+    }
+    return t_log_ring;
+}
+
+void log_rec(uint32_t level, const char *fmt, uint64_t a0, uint64_t a1,
+             uint64_t a2, uint64_t a3) {
+    LogRing *ring = log_ring();
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= k_log_ring) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    LogRec &rec = ring->recs[tail & (k_log_ring - 1)];
+    rec.ts_us = get_monotonic_usec();
+    rec.fmt = fmt;
+    rec.args[0] = a0;
+    rec.args[1] = a1;
+    rec.args[2] = a2;
+    rec.args[3] = a3;
+    rec.level = level;
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+static void log_print(const LogRec &rec) {
+    char msg[256];
+    snprintf(msg, sizeof(msg), rec.fmt,
+             (unsigned long long)rec.args[0], (unsigned long long)rec.args[1],
+             (unsigned long long)rec.args[2], (unsigned long long)rec.args[3]);
+    const char *name = rec.level <= LOG_TRACE ? k_level_names[rec.level] : "?";
+    printf("[%llu.%06llu] %s %s\n", (unsigned long long)(rec.ts_us / 1000000),
+           (unsigned long long)(rec.ts_us % 1000000), name, msg);
+}
+
+size_t log_flush() {
+    size_t n = 0;
+    bool wrote = false;
+    pthread_mutex_lock(&g_log_mu);
+    for (LogRing *ring : g_log_rings) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        for (; head != tail; head++, n++) {
+            log_print(ring->recs[head & (k_log_ring - 1)]);
+        }
+        ring->head.store(head, std::memory_order_release);
+        uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped) {
+            g_log_dropped += dropped;
+            printf("log: %llu records dropped\n", (unsigned long long)dropped);
+            wrote = true;
+        }
+    }
+    if (n || wrote) {
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&g_log_mu);
+    return n;
+}
+
+uint64_t log_dropped() {
+    log_flush();
+    pthread_mutex_lock(&g_log_mu);
+    uint64_t n = g_log_dropped;
+    pthread_mutex_unlock(&g_log_mu);
+    return n;
+}
+
+static void *log_main(void *arg) {
+    (void)arg;
+    while (true) {
+        usleep(k_log_flush_us);
+        log_flush();
+    }
+    return NULL;
+}
+
+void log_start() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &log_main, NULL) != 0) {
+        perror("pthread_create()");
+        return; // records are still kept, up to the ring size
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <unistd.h>      // for read, write, close
+#include <sys/socket.h>  // for socket, setsockopt, bind, listen, accept
+#include <netinet/in.h>  // for sockaddr_in, htons, htonl
+#include <csignal>       // for signal (optional cleanup handling)
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <arpa/inet.h>   // for inet_ntop (if needed)
+#include <sys/types.h>  // for ssize_t
+#include <vector>
+#include <poll.h>        // for poll
+#include <fcntl.h>       // for fcntl, O_NONBLOCK
+#include <sys/select.h>
+#include <atomic>
+
+// Severity; lower is more important
+enum {
+    LOG_ERROR = 0,
+    LOG_WARN = 1,
+    LOG_INFO = 2,
+    LOG_DEBUG = 3,
+    LOG_TRACE = 4, // per-reply detail
+};
+
+// LOG() calls above this level compile to nothing. Build with
+// -DLOG_COMPILE_LEVEL=4 to get the TRACE records back.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+// Runtime verbosity (--log-level); records above it are skipped
+extern int g_log_level;
+
+// A binary trace record. Formatting is left to the flusher thread, so the
+// format must be a string literal and its conversions must take 64-bit
+// integers (%llu, %lld, %llx); strings and doubles are not captured.
+struct LogRec {
+    uint64_t ts_us = 0;
+    const char *fmt = NULL;
+    uint64_t args[4] = {};
+    uint32_t level = 0;
+};
+
+// Queue a record on the calling thread's ring. Never blocks: when the
+// ring is full the record is dropped and counted.
+void log_rec(uint32_t level, const char *fmt, uint64_t a0 = 0, uint64_t a1 = 0,
+             uint64_t a2 = 0, uint64_t a3 = 0);
+// Start the background thread that writes queued records to stdout
+void log_start();
+// Write out everything queued so far; returns the number of records
+size_t log_flush();
+// Records lost to full rings since startup
+uint64_t log_dropped();
+
+#define LOG(level, fmt, ...)                                                  \
+    do {                                                                      \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= g_log_level) {         \
+            log_rec((level), fmt, ##__VA_ARGS__);                             \
+        }                                                                     \
+    } while (0)
@@ -10,10 +10,12 @@
 #include <arpa/inet.h>   // for inet_ntop (if needed)
 #include <sys/types.h>  // for ssize_t
 #include <vector>
+#include <new>           // for std::bad_alloc
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
 #include "serialisation.h"
+#include "log.h"
 #if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
 #define htobe64(x) OSSwapHostToBigInt64(x)
@@ -24,54 +26,67 @@
 #include <endian.h>
 #endif
 
-void out_nil(std::string &out) {
-    out.push_back(SER_NIL);
+// Writes are not limited here; the caller checks the finished reply
+static void out_raw(Buffer &out, const void *data, size_t n) {
+    if (!buf_append(&out, data, n, SIZE_MAX)) {
+        throw std::bad_alloc();
+    }
+}
+
+static void out_tag(Buffer &out, uint8_t tag) {
+    out_raw(out, &tag, 1);
 }
 
-void out_str(std::string &out, const std::string &val) {
-    out.push_back(SER_STR);
+void out_nil(Buffer &out) {
+    out_tag(out, SER_NIL);
+}
+
+void out_str(Buffer &out, std::string_view val) {
+    out_tag(out, SER_STR);
     uint32_t len = (uint32_t)val.size();
-    out.append((char *)&len,4);
-    out.append(val);
+    out_raw(out, &len, 4);
+    out_raw(out, val.data(), val.size());
 }
 
-void out_int(std::string &out, int64_t val) {
+void out_int(Buffer &out, int64_t val) {
 
-    out.push_back(SER_INT);
+    out_tag(out, SER_INT);
     int64_t nval = htobe64(val);
-    out.append((char *)&nval, 8);
-    // Debug print
-    printf("[DEBUG] out_int: val=%lld, nval=0x%016llx\n", (long long)val, (unsigned long long)nval);
-    for (int i = 0; i < 8; ++i) {
-        printf("%02x ", ((unsigned char*)&nval)[i]);
-    }
-    printf("\n");
+    out_raw(out, &nval, 8);
+    LOG(LOG_TRACE, "out_int: val=%lld, nval=0x%016llx", val, nval);
 }
 
 
-void out_dbl(std::string &out, double val) {
-    out.push_back(SER_DOUBLE);
+void out_dbl(Buffer &out, double val) {
+    out_tag(out, SER_DOUBLE);
     uint64_t nval;
     static_assert(sizeof(double) == sizeof(uint64_t), "double must be 8 bytes");
     memcpy(&nval, &val, sizeof(double));
     nval = htobe64(nval);
-    out.append((char *)&nval, 8);
-    // Debug print
-    printf("[DEBUG] out_dbl: val=%f, nval=0x%016llx\n", val, (unsigned long long)nval);
-    for (int i = 0; i < 8; ++i) {
-        printf("%02x ", ((unsigned char*)&nval)[i]);
-    }
-    printf("\n");
+    out_raw(out, &nval, 8);
+    LOG(LOG_TRACE, "out_dbl: nval=0x%016llx", nval);
 }
-void out_err(std::string &out, int32_t code, const std::string &msg) {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
+void out_err(Buffer &out, int32_t code, std::string_view msg) {
+    out_tag(out, SER_ERR);
+    out_raw(out, &code, 4);
     uint32_t len = (uint32_t)msg.size();
-    out.append((char *)&len,4);
-    out.append(msg);
+    out_raw(out, &len, 4);
+    out_raw(out, msg.data(), msg.size());
+}
+
+void out_arr(Buffer &out, uint32_t n) {
+    out_tag(out, SER_ARR);
+    out_raw(out, &n, 4);
+}
+
+// The context is an offset from the read cursor, which stays valid when
+// the buffer grows or compacts.
+size_t out_begin_arr(Buffer &out) {
+    out_arr(out, 0);
+    return buf_len(&out) - 4;
 }
 
-void out_arr(std::string &out, uint32_t n) {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
+void out_end_arr(Buffer &out, size_t ctx, uint32_t n) {
+    assert(ctx + 4 <= buf_len(&out));
+    memcpy(buf_begin(&out) + ctx, &n, 4);
 }
@@ -10,10 +10,13 @@
 #include <cstdint>       // for uint32_t
 #include <arpa/inet.h>   // for inet_ntop (if needed)
 #include <sys/types.h>  // for ssize_t
+#include <string>
+#include <string_view>
 #include <vector>
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
+#include "buffer.h"
 enum {
     SER_NIL = 0, // Like `NULL`
     SER_ERR = 1, // An error code and message
@@ -23,9 +26,15 @@ enum {
     SER_DOUBLE = 5,
 };
 
-void out_nil(std::string &out);
-void out_str(std::string &out, const std::string &val);
-void out_int(std::string &out, int64_t val);
-void out_err(std::string &out, int32_t code, const std::string &msg);
-void out_arr(std::string &out, uint32_t n);
-void out_dbl(std::string &out, double val);
\ No newline at end of file
+// Replies are serialized straight into a Buffer, normally the connection's
+// wbuf, so a response is written once and not copied again.
+void out_nil(Buffer &out);
+void out_str(Buffer &out, std::string_view val);
+void out_int(Buffer &out, int64_t val);
+void out_err(Buffer &out, int32_t code, std::string_view msg);
+void out_arr(Buffer &out, uint32_t n);
+void out_dbl(Buffer &out, double val);
+// For arrays whose length is only known at the end: begin returns a
+// context for end, which fills in the element count
+size_t out_begin_arr(Buffer &out);
+void out_end_arr(Buffer &out, size_t ctx, uint32_t n);
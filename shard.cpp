@@ -0,0 +1,299 @@
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <unistd.h>      // for read, write, close
+#include <sys/socket.h>  // for socket, setsockopt, bind, listen, accept
+#include <netinet/in.h>  // for sockaddr_in, htons, htonl
+#include <csignal>       // for signal (optional cleanup handling)
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <arpa/inet.h>   // for inet_ntop (if needed)
+#include <sys/types.h>  // for ssize_t
+#include <cerrno>
+#include <vector>
+#include <deque>
+#include <utility>       // for std::swap
+#include <fcntl.h>       // for fcntl, O_NONBLOCK
+#include "shard.h"
+#include "common.h"
+#include "utils.h"
+#include "serialisation.h"
+
+std::vector<Shard *> g_shards;
+thread_local size_t g_shard_id = 0;
+
+void shards_init(size_t n) {
+    assert(g_shards.empty() && n > 0);
+    for (size_t i = 0; i < n; i++) {
+        Shard *shard = new Shard();
+        int fds[2];
+        if (pipe(fds) < 0) {
+            die("pipe()");
+        }
+        fd_set_nb(fds[0]);
+        fd_set_nb(fds[1]);
+        shard->wake_rfd = fds[0];
+        shard->wake_wfd = fds[1];
+        int rv = pthread_mutex_init(&shard->mu, NULL);
+        assert(rv == 0);
+        g_shards.push_back(shard);
+    }
+}
+
+size_t shard_of(std::string_view key) {
+    return shard_of_hash(str_hash((const uint8_t *)key.data(), key.size()));
+}
+
+size_t shard_of_hash(uint64_t hcode) {
+    // Use the middle bits; the low bits pick the HMap bucket inside the
+    // shard and the high ones its stripe and tag
+    return (size_t)((hcode >> 32) % g_shards.size());
+}
+
+void shard_publish_db(CMap *db) {
+    db->shared = true; // from now on writes lock out readers
+    g_shards[g_shard_id]->db.store(db, std::memory_order_release);
+}
+
+CMap *shard_db(size_t id) {
+    return g_shards[id]->db.load(std::memory_order_acquire);
+}
+
+static void shard_post(size_t id, ShardMsg *msg) {
+    Shard *shard = g_shards[id];
+    pthread_mutex_lock(&shard->mu);
+    shard->inbox.push_back(msg);
+    pthread_mutex_unlock(&shard->mu);
+    char c = 1;
+    // EAGAIN means the pipe is full, so a wakeup is already pending
+    (void)!write(shard->wake_wfd, &c, 1);
+}
+
+// Length of one serialized nil, string, int or double
+static size_t ser_elem_len(const uint8_t *data) {
+    if (data[0] == SER_STR) {
+        uint32_t len = 0;
+        memcpy(&len, &data[1], 4);
+        return 5 + len;
+    }
+    return data[0] == SER_NIL ? 1 : 9;
+}
+
+// Both are arrays with one element per key, nil where the key belongs to
+// another loop; take the non-nil element at each position
+static void shard_merge_bykey(Buffer *dst, Buffer *src) {
+    if (buf_len(dst) == 0) {
+        std::swap(*dst, *src);
+        return;
+    }
+    if (buf_len(src) == 0) {
+        return;
+    }
+    Buffer merged;
+    const uint8_t *a = buf_begin(dst);
+    const uint8_t *b = buf_begin(src);
+    uint32_t n = 0;
+    memcpy(&n, &a[1], 4);
+    if (!buf_append(&merged, a, 5, SIZE_MAX)) {
+        die("out of memory");
+    }
+    a += 5;
+    b += 5;
+    for (uint32_t i = 0; i < n; i++) {
+        size_t alen = ser_elem_len(a);
+        size_t blen = ser_elem_len(b);
+        const uint8_t *pick = a[0] == SER_NIL ? b : a;
+        if (!buf_append(&merged, pick, pick == a ? alen : blen, SIZE_MAX)) {
+            die("out of memory");
+        }
+        a += alen;
+        b += blen;
+    }
+    std::swap(*dst, merged);
+    buf_free(&merged);
+}
+
+static void shard_merge(ShardReq *req, ShardMsg *msg) {
+    if (msg->err != RES_OK) {
+        req->err = msg->err;
+    }
+    if (req->bykey) {
+        shard_merge_bykey(&req->out, &msg->out);
+        return;
+    }
+    if (!req->fanout) {
+        std::swap(req->out, msg->out);
+        return;
+    }
+    // Fan-out replies are arrays; concatenate their elements
+    const uint8_t *data = buf_begin(&msg->out);
+    size_t len = buf_len(&msg->out);
+    if (len >= 5 && data[0] == SER_ARR) {
+        uint32_t n = 0;
+        memcpy(&n, &data[1], 4);
+        req->nitems += n;
+        if (!buf_append(&req->out, data + 5, len - 5, SIZE_MAX)) {
+            die("out of memory");
+        }
+    }
+}
+
+static void shard_complete(ShardReq *req, std::vector<Conn *> &resumed) {
+    Buffer out;
+    if (req->fanout) {
+        out_arr(out, req->nitems);
+        if (!buf_append(&out, buf_begin(&req->out), buf_len(&req->out), SIZE_MAX)) {
+            die("out of memory");
+        }
+    } else {
+        std::swap(out, req->out);
+    }
+    Conn *conn = req->conn;
+    int32_t err = req->err;
+    delete req;
+    conn_resume(conn, err, out);
+    buf_free(&out);
+    resumed.push_back(conn);
+}
+
+// The connection waits in STATE_WAIT, off the idle list, for its reply
+static void shard_park(Conn *conn) {
+    conn->state = STATE_WAIT;
+    dlist_detach(&conn->idle_list);
+    dList_init(&conn->idle_list);
+}
+
+// Returns true if the command was handed to other loops, in which case the
+// connection waits in STATE_WAIT until shard_drain() delivers the reply.
+
+bool shard_dispatch(Conn *conn, const Cmd &cmd) {
+    if (g_shards.size() < 2) {
+        return false;
+    }
+    if (cmd.id >= CMD_COUNT) {
+        return false; // unknown, fails locally
+    }
+    bool fanout = (g_cmds[cmd.id].flags & CMD_F_FANOUT) != 0;
+    bool bykey = false;
+    size_t owner = g_shard_id;
+    if (g_cmds[cmd.id].flags & CMD_F_CURSOR) {
+        int64_t cursor = 0;
+        if (cmd.size() < 2 || !str2int(cmd[1], cursor)) {
+            return false; // fails locally
+        }
+        owner = (size_t)((uint64_t)cursor >> k_scan_shard_shift);
+        if (owner == g_shard_id || owner >= g_shards.size()) {
+            return false;
+        }
+    } else if (!fanout) {
+        if (cmd.size() < 2) {
+            return false;
+        }
+        owner = shard_of(cmd[1]);
+        if (g_cmds[cmd.id].flags & CMD_F_KEYS) {
+            // keys on one loop are routed like a single key, else every
+            // loop answers for its own
+            for (size_t i = 2; i < cmd.size() && !bykey; i++) {
+                bykey = shard_of(cmd[i]) != owner;
+            }
+        }
+        if (!bykey && owner == g_shard_id) {
+            return false;
+        }
+        if ((g_cmds[cmd.id].flags & CMD_F_SHARED) && shard_db(owner)) {
+            return false; // reads the owner's keyspace in place
+        }
+    }
+    ShardReq *req = new ShardReq();
+    req->conn = conn;
+    req->origin = g_shard_id;
+    for (size_t i = 0; i < cmd.size(); i++) {
+        req->cmd.emplace_back(cmd[i]);
+    }
+    req->fanout = fanout;
+    req->bykey = bykey;
+    bool everywhere = fanout || bykey;
+    for (size_t i = 0; i < g_shards.size(); i++) {
+        if (everywhere ? i == g_shard_id : i != owner) {
+            continue;
+        }
+        ShardMsg *msg = new ShardMsg();
+        msg->req = req;
+        req->pending++;
+        shard_post(i, msg);
+    }
+    if (everywhere) {
+        // Our own part runs inline; the other loops reply via the inbox
+        ShardMsg self;
+        self.err = do_request(req->cmd, self.out);
+        shard_merge(req, &self);
+    }
+    shard_park(conn);
+    return true;
+}
+
+static void shard_job_start(ShardMsg *msg, ShardJob *job) {
+    job->loop = g_shard_id;
+    job->msg = msg;
+    msg->job = job;
+    job->start(job);
+}
+
+void shard_job_park(Conn *conn, ShardJob *job) {
+    ShardReq *req = new ShardReq();
+    req->conn = conn;
+    req->origin = g_shard_id;
+    req->pending = 1;
+    ShardMsg *msg = new ShardMsg();
+    msg->req = req;
+    shard_park(conn);
+    shard_job_start(msg, job);
+}
+
+void shard_job_done(ShardJob *job) {
+    shard_post(job->loop, job->msg);
+}
+
+// Runs forwarded commands against this loop's keyspace, finishes jobs back
+// from the thread pool and completes the replies that came back;
+// connections that left STATE_WAIT are returned.
+void shard_drain(std::vector<Conn *> &resumed) {
+    Shard *shard = g_shards[g_shard_id];
+    char buf[256];
+    while (read(shard->wake_rfd, buf, sizeof(buf)) > 0) {}
+
+    std::deque<ShardMsg *> inbox;
+    pthread_mutex_lock(&shard->mu);
+    inbox.swap(shard->inbox);
+    pthread_mutex_unlock(&shard->mu);
+
+    for (ShardMsg *msg : inbox) {
+        ShardReq *req = msg->req;
+        if (msg->job) {
+            // back from the thread pool: finish here, then reply as usual
+            ShardJob *job = msg->job;
+            msg->job = NULL;
+            msg->err = job->finish(job, msg->out);
+            msg->done = true;
+            if (req->origin != g_shard_id) {
+                shard_post(req->origin, msg);
+                continue;
+            }
+        } else if (!msg->done) {
+            ShardJob *job = NULL;
+            msg->err = do_request(req->cmd, msg->out, &job);
+            if (job) {
+                shard_job_start(msg, job);
+                continue;
+            }
+            msg->done = true;
+            shard_post(req->origin, msg);
+            continue;
+        }
+        shard_merge(req, msg);
+        delete msg;
+        if (--req->pending == 0) {
+            shard_complete(req, resumed);
+        }
+    }
+}
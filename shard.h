@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <unistd.h>      // for read, write, close
+#include <sys/socket.h>  // for socket, setsockopt, bind, listen, accept
+#include <netinet/in.h>  // for sockaddr_in, htons, htonl
+#include <csignal>       // for signal (optional cleanup handling)
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <arpa/inet.h>   // for inet_ntop (if needed)
+#include <sys/types.h>  // for ssize_t
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <pthread.h>
+#include "buffer.h"
+
+struct Conn;
+struct Cmd;
+struct CMap;
+
+// A command parked on its origin loop while other loops execute it
+struct ShardReq {
+    Conn *conn = NULL;
+    size_t origin = 0;
+    std::vector<std::string> cmd; // owned copy, the request bytes are gone
+    bool fanout = false;   // sent to every shard, replies are merged
+    bool bykey = false;    // multi-key fan-out, replies merged by position
+    uint32_t pending = 0;  // replies still outstanding
+    uint32_t nitems = 0;   // merged array length (fan-out only)
+    int32_t err = 0;
+    Buffer out;
+    ~ShardReq() { buf_free(&out); }
+};
+
+struct ShardMsg;
+
+// The heavy part of a command, run on a loop's thread pool while its
+// client waits parked. start() runs on the loop and hands the work to the
+// pool, which ends it with shard_job_done(). finish() runs back on the
+// loop, writes the reply and frees the job.
+struct ShardJob {
+    void (*start)(ShardJob *job) = NULL;
+    int32_t (*finish)(ShardJob *job, Buffer &out) = NULL;
+    size_t loop = 0;       // where finish() runs
+    ShardMsg *msg = NULL;  // carries the reply from there
+};
+
+// One unit of cross-loop traffic: a request to run, then its reply
+struct ShardMsg {
+    ShardReq *req = NULL;
+    ShardJob *job = NULL;  // set while the request runs on the thread pool
+    bool done = false;
+    int32_t err = 0;
+    Buffer out;
+    ~ShardMsg() { buf_free(&out); }
+};
+
+// Per event loop mailbox
+struct Shard {
+    pthread_t thread;
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    pthread_mutex_t mu;
+    std::deque<ShardMsg *> inbox;
+    std::atomic<CMap *> db{NULL}; // the loop's keyspace, once it runs
+};
+
+// One per event loop; empty only in the unit tests
+extern std::vector<Shard *> g_shards;
+// Index of the loop owning the calling thread
+extern thread_local size_t g_shard_id;
+
+void shards_init(size_t n);
+size_t shard_of(std::string_view key);
+size_t shard_of_hash(uint64_t hcode);
+// Lets other loops read this loop's keyspace in place (CMD_F_SHARED)
+void shard_publish_db(CMap *db);
+// Loop `id`'s keyspace, or NULL until that loop has published it
+CMap *shard_db(size_t id);
+bool shard_dispatch(Conn *conn, const Cmd &cmd);
+void shard_drain(std::vector<Conn *> &resumed);
+// Parks `conn` until `job` has run; shard_drain() then delivers the reply
+void shard_job_park(Conn *conn, ShardJob *job);
+// Called from the pool once the job's work is done
+void shard_job_done(ShardJob *job);
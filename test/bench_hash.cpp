@@ -0,0 +1,53 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../utils.h"
+
+// Throughput of str_hash against the byte-wise FNV-1a it replaced
+static uint64_t fnv1a(const uint8_t *data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template <typename F>
+static double ns_per_hash(F f, const std::vector<std::string> &keys, size_t rounds) {
+    uint64_t sink = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (const std::string &k : keys) {
+            sink += f((const uint8_t *)k.data(), k.size());
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    // keep the loop from being optimized out
+    volatile uint64_t keep = sink;
+    (void)keep;
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    return ns / (double)(rounds * keys.size());
+}
+
+int main() {
+    const size_t k_lens[] = {4, 8, 16, 24, 32, 64, 128, 256, 1024, 4096};
+    printf("%6s %12s %12s %10s %10s\n", "bytes", "fnv ns/op", "str ns/op", "fnv GB/s", "str GB/s");
+    for (size_t len : k_lens) {
+        std::vector<std::string> keys(256);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[i].resize(len);
+            for (size_t j = 0; j < len; ++j) {
+                keys[i][j] = (char)('a' + (i * 31 + j * 7) % 26);
+            }
+        }
+        size_t rounds = (64u << 20) / (len * keys.size()) + 1;
+        double fnv = ns_per_hash(fnv1a, keys, rounds);
+        double str = ns_per_hash(str_hash, keys, rounds);
+        printf("%6zu %12.2f %12.2f %10.2f %10.2f\n", len, fnv, str, len / fnv, len / str);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "../common.h"
+#include "../hashtable.h"
+#include "../utils.h"
+
+// Random-key lookups one at a time against hm_lookup_batch, on a keyspace
+// much larger than the CPU caches
+static double ns_per_lookup(HMap *map, const std::vector<HKey> &keys, size_t batch) {
+    std::vector<HNode *> key_nodes(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        key_nodes[i] = (HNode *)&keys[i].node;
+    }
+    std::vector<HNode *> out(batch);
+    size_t found = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i + batch <= keys.size(); i += batch) {
+        if (batch == 1) {
+            out[0] = hm_lookup(map, key_nodes[i], entry_key_eq);
+        } else {
+            hm_lookup_batch(map, &key_nodes[i], batch, entry_key_eq, out.data());
+        }
+        for (size_t j = 0; j < batch; ++j) {
+            found += out[j] != NULL;
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    if (found != keys.size() / batch * batch) {
+        fprintf(stderr, "lost keys: %zu\n", found);
+    }
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)found;
+}
+
+int main(int argc, char **argv) {
+    size_t nkeys = argc > 1 ? strtoull(argv[1], NULL, 10) : (4u << 20);
+    const size_t k_queries = 2u << 20;
+    std::vector<std::string> names(nkeys);
+    for (size_t i = 0; i < nkeys; ++i) {
+        names[i] = "key:" + std::to_string(i * 2654435761u % 1000000007u);
+    }
+    // query names in query order, as they would sit in a request buffer
+    std::mt19937_64 rng(1);
+    std::vector<std::string> queries(k_queries);
+    for (std::string &name : queries) {
+        name = names[rng() % nkeys];
+    }
+    std::vector<HKey> keys(k_queries);
+    for (size_t i = 0; i < k_queries; ++i) {
+        HKey &key = keys[i];
+        const std::string &name = queries[i];
+        key.node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+        key.name = name.data();
+        key.len = name.size();
+    }
+    printf("%zu keys, %zu random lookups\n", nkeys, k_queries);
+    printf("%6s %8s %10s\n", "engine", "batch", "ns/lookup");
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        for (const std::string &name : names) {
+            uint64_t hcode = str_hash((const uint8_t *)name.data(), name.size());
+            hm_insert(&map, &entry_new_str(name, hcode, "value")->node);
+        }
+        for (size_t batch : {1, 4, 8, 16, 32}) {
+            double ns = ns_per_lookup(&map, keys, batch);
+            printf("%6s %8zu %10.1f\n", engine == HM_SWISS ? "swiss" : "chain", batch, ns);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "../common.h"
+#include "../zset.h"
+
+static double ns_since(std::chrono::steady_clock::time_point t0, size_t ops) {
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t1 - t0).count() / (double)ops;
+}
+
+#if defined(__GLIBC__)
+// Heap bytes per set, ZSet object included, for many sets of `members`
+// short names each
+static double heap_per_set(size_t members) {
+    const size_t k_sets = 10000;
+    std::vector<ZSet *> sets(k_sets);
+    size_t before = mallinfo2().uordblks;
+    for (ZSet *&zset : sets) {
+        zset = new ZSet();
+        for (size_t i = 0; i < members; ++i) {
+            std::string name = "user:" + std::to_string(i);
+            zset_add(zset, name.data(), name.size(), (double)i);
+        }
+    }
+    double bytes = (double)(mallinfo2().uordblks - before) / k_sets;
+    for (ZSet *zset : sets) {
+        delete zset;
+    }
+    return bytes;
+}
+#endif
+
+// Inserts in random order, then rank lookups and 100-member range scans
+// from random scores, on a set much larger than the CPU caches, and
+// dropping the set, and finally loading it again in one sorted batch
+int main(int argc, char **argv) {
+    size_t nmembers = argc > 1 ? strtoull(argv[1], NULL, 10) : (2u << 20);
+    const size_t k_queries = 200000, k_scan_len = 100;
+    std::mt19937_64 rng(1);
+    std::vector<std::string> names(nmembers);
+    std::vector<double> scores(nmembers);
+    for (size_t i = 0; i < nmembers; ++i) {
+        names[i] = "member:" + std::to_string(rng() % 1000000007u);
+        scores[i] = (double)(rng() % (nmembers * 4));
+    }
+    std::vector<double> starts(k_queries);
+    for (double &score : starts) {
+        score = (double)(rng() % (nmembers * 4));
+    }
+#if defined(__GLIBC__)
+    printf("%8s %14s %14s\n", "members", "small bytes", "indexed bytes");
+    for (size_t members : {3, 16, 128}) {
+        double small = heap_per_set(members);
+        uint32_t small_max = g_zset_small_max;
+        g_zset_small_max = 0;
+        double indexed = heap_per_set(members);
+        g_zset_small_max = small_max;
+        printf("%8zu %14.0f %14.0f\n", members, small, indexed);
+    }
+#endif
+    printf("%zu members, %zu queries\n", nmembers, k_queries);
+    printf("%6s %12s %12s %12s %12s %12s\n", "index", "insert ns", "rank ns", "scan ns/row", "drop ns", "bulk ns");
+    for (uint32_t index : {ZS_AVL, ZS_BTREE}) {
+        // a fresh process each, so neither index inherits the other's heap
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid != 0) {
+            waitpid(pid, NULL, 0);
+            continue;
+        }
+        g_zset_index = index;
+        ZSet &zset = *new ZSet();
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < nmembers; ++i) {
+            zset_add(&zset, names[i].data(), names[i].size(), scores[i]);
+        }
+        double insert_ns = ns_since(t0, nmembers);
+
+        uint64_t sum = 0;
+        t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < k_queries; ++i) {
+            sum += zset_count_below(&zset, starts[i], false);
+        }
+        double rank_ns = ns_since(t0, k_queries);
+
+        size_t rows = 0;
+        t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < k_queries; ++i) {
+            ZNode *znode = zset_query(&zset, starts[i], "", 0);
+            for (size_t j = 0; znode && j < k_scan_len; ++j, ++rows) {
+                sum += znode->len;
+                znode = znode_next(&zset, znode);
+            }
+        }
+        double scan_ns = ns_since(t0, rows);
+
+        t0 = std::chrono::steady_clock::now();
+        delete &zset;
+        double drop_ns = ns_since(t0, nmembers);
+
+        std::vector<ZAddItem> items(nmembers);
+        for (size_t i = 0; i < nmembers; ++i) {
+            items[i] = ZAddItem{names[i].data(), names[i].size(), scores[i]};
+        }
+        ZSet *bulk = new ZSet();
+        uint64_t changed = 0;
+        t0 = std::chrono::steady_clock::now();
+        sum += zset_add_batch(bulk, items.data(), nmembers, 0, &changed);
+        double bulk_ns = ns_since(t0, nmembers);
+        delete bulk;
+        printf("%6s %12.1f %12.1f %12.1f %12.1f %12.1f\n", index == ZS_BTREE ? "btree" : "avl",
+               insert_ns, rank_ns, scan_ns, drop_ns, bulk_ns);
+        if (sum == 0) {
+            printf("\n");
+        }
+        return 0;
+    }
+    return 0;
+}
@@ -5,10 +5,19 @@
 #include "../common.h"
 #include "../hashtable.h"
 #include "../zset.h"
+#include "../arena.h"
 #include "../utils.h"
 #include "../serialisation.h"
 #include "../timer.h"
+#include "../log.h"
+#include "../shard.h"
 #include <cmath>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <atomic>
+#include <pthread.h>
+#include <csignal>
 #if defined(__APPLE__)
 #include <libkern/OSByteOrder.h>
 #define be64toh(x) OSSwapBigToHostInt64(x)
@@ -18,6 +27,11 @@
 #include <endian.h>
 #endif
 
+// The serialized reply bytes a handler left in `out`
+static std::string out_bytes(Buffer &out) {
+    return std::string((const char *)buf_begin(&out), buf_len(&out));
+}
+
 void assert_dbl_response(const std::string& out, double expected) {
     assert(out.size() >= 9);
     assert((uint8_t)out[0] == 5); // SER_DOUBLE
@@ -30,74 +44,78 @@ void assert_dbl_response(const std::string& out, double expected) {
 }
 
 void test_set_get_del_keys() {
-    std::string out;
+    Buffer out;
     std::vector<std::string> cmd;
     // set
     cmd = {"set", "foo", "bar"};
     assert(do_set(cmd, out) == RES_OK);
     // get
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"get", "foo"};
     assert(do_get(cmd, out) == RES_OK);
-    assert(out.find("bar") != std::string::npos);
+    assert(out_bytes(out).find("bar") != std::string::npos);
     // del
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"del", "foo"};
     assert(do_del(cmd, out) == RES_OK);
     // get non-existent
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"get", "foo"};
     assert(do_get(cmd, out) == RES_NX);
     // keys (should be empty)
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"keys"};
     assert(do_keys(cmd, out) == RES_OK);
 }
 
 void test_zset() {
-    std::string out;
+    Buffer out;
     std::vector<std::string> cmd;
     // zadd
     cmd = {"zadd", "myzset", "1.5", "alice"};
     assert(do_zadd(cmd, out) == RES_OK);
     // zscore
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zscore", "myzset", "alice"};
     assert(do_zscore(cmd, out) == RES_OK);
-    assert_dbl_response(out, 1.5);
+    assert_dbl_response(out_bytes(out), 1.5);
     // zrem
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zrem", "myzset", "alice"};
     assert(do_zrem(cmd, out) == RES_OK);
     // zscore non-existent
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zscore", "myzset", "alice"};
     assert(do_zscore(cmd, out) == RES_NX);
     // zadd multiple
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zadd", "myzset", "2.0", "bob"};
     assert(do_zadd(cmd, out) == RES_OK);
     cmd = {"zadd", "myzset", "3.0", "carol"};
     assert(do_zadd(cmd, out) == RES_OK);
     // zquery
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zquery", "myzset", "2.0", "bob", "0", "2"};
     assert(do_query(cmd, out) == RES_OK);
-    // Check that the response contains two entries: bob/2.0 and carol/3.0
-    size_t pos = 0;
+    std::string resp = out_bytes(out);
+    // Check that the response is an array of two entries: bob/2.0 and carol/3.0
+    uint32_t nitems = 0;
+    memcpy(&nitems, resp.data() + 1, 4);
+    assert((uint8_t)resp[0] == 4 && nitems == 4); // SER_ARR
+    size_t pos = 5;
     for (int i = 0; i < 2; ++i) {
-        assert(pos < out.size());
-        assert((uint8_t)out[pos] == 2); // SER_STR
+        assert(pos < resp.size());
+        assert((uint8_t)resp[pos] == 2); // SER_STR
         uint32_t slen = 0;
-        memcpy(&slen, out.data() + pos + 1, 4);
-        std::string name = out.substr(pos + 5, slen);
+        memcpy(&slen, resp.data() + pos + 1, 4);
+        std::string name = resp.substr(pos + 5, slen);
         if (i == 0) assert(name == "bob");
         if (i == 1) assert(name == "carol");
         pos += 5 + slen;
-        assert(pos < out.size());
-        assert((uint8_t)out[pos] == 5); // SER_DOUBLE
+        assert(pos < resp.size());
+        assert((uint8_t)resp[pos] == 5); // SER_DOUBLE
         uint64_t nval = 0;
-        memcpy(&nval, out.data() + pos + 1, 8);
+        memcpy(&nval, resp.data() + pos + 1, 8);
         nval = be64toh(nval);
         double val = 0;
         memcpy(&val, &nval, 8);
@@ -108,30 +126,25 @@ void test_zset() {
 }
 
 void test_edge_cases() {
-    std::string out;
+    Buffer out;
     std::vector<std::string> cmd;
     // set with empty key/value
     cmd = {"set", "", ""};
     assert(do_set(cmd, out) == RES_OK);
     // get empty key
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"get", ""};
     assert(do_get(cmd, out) == RES_OK);
     // del empty key
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"del", ""};
     assert(do_del(cmd, out) == RES_OK);
     // zadd with invalid score
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zadd", "myzset", "notanumber", "dave"};
-    try {
-        do_zadd(cmd, out);
-        assert(false && "Should throw on invalid score");
-    } catch (...) {
-        // expected
-    }
+    assert(do_zadd(cmd, out) == RES_ERR);
     // zquery with invalid offset/limit
-    out.clear();
+    buf_truncate(&out, 0);
     cmd = {"zquery", "myzset", "2.0", "bob", "notanumber", "notanumber"};
     try {
         do_query(cmd, out);
@@ -141,6 +154,30 @@ void test_edge_cases() {
     }
 }
 
+void test_command_table() {
+    // every registered name resolves to its own id
+    for (uint32_t id = 0; id < CMD_COUNT; ++id) {
+        assert(cmd_lookup(g_cmds[id].name) == id);
+    }
+    assert(cmd_lookup("") == CMD_COUNT);
+    assert(cmd_lookup("gets") == CMD_COUNT);
+    assert(cmd_lookup("GET") == CMD_COUNT);
+
+    Buffer out;
+    std::vector<std::string> cmd = {"ttl"};
+    uint64_t calls = g_data.cmd_stats[CMD_TTL].calls;
+    uint64_t errors = g_data.cmd_stats[CMD_TTL].errors;
+    assert(do_request(cmd, out) == RES_ERR); // wrong arity
+    assert(*buf_begin(&out) == SER_ERR);
+    cmd = {"ttl", "nokey"};
+    buf_truncate(&out, 0);
+    assert(do_request(cmd, out) == RES_OK);
+    assert(g_data.cmd_stats[CMD_TTL].calls == calls + 2);
+    assert(g_data.cmd_stats[CMD_TTL].errors == errors + 1);
+    cmd = {"nosuchcmd"};
+    assert(do_request(cmd, out) == RES_ERR);
+}
+
 void test_timer_basics() {
     std::cout << "Testing timer basics..." << std::endl;
     
@@ -155,11 +192,1591 @@ void test_timer_basics() {
     std::cout << "  Timer basics test passed!" << std::endl;
 }
 
+static void append_req(std::string &buf, const std::vector<std::string> &cmd) {
+    uint32_t len = 4;
+    for (const std::string &arg : cmd) {
+        len += 4 + (uint32_t)arg.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    buf.append((char *)&len, 4);
+    buf.append((char *)&n, 4);
+    for (const std::string &arg : cmd) {
+        uint32_t arglen = (uint32_t)arg.size();
+        buf.append((char *)&arglen, 4);
+        buf.append(arg);
+    }
+}
+
+void test_pipelining() {
+    std::cout << "Testing pipelining..." << std::endl;
+    dList_init(&g_data.idle_list);
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fd_set_nb(fds[0]);
+    Conn *conn = (Conn *)calloc(1, sizeof(Conn));
+    conn->fd = fds[0];
+    conn->state = STATE_REQ;
+    dList_init(&conn->idle_list);
+    conn_put(g_data.fd2conn, conn);
+
+    // 100 requests in one write, the last one split across two writes
+    const int k_reqs = 100;
+    std::string req;
+    for (int i = 0; i < k_reqs; ++i) {
+        append_req(req, {"set", "p" + std::to_string(i), std::to_string(i)});
+    }
+    assert(write(fds[1], req.data(), req.size() - 3) == (ssize_t)req.size() - 3);
+    connection_io(conn);
+    assert(conn->state == STATE_REQ || conn->state == STATE_RES);
+    assert(write(fds[1], req.data() + req.size() - 3, 3) == 3);
+    connection_io(conn);
+    assert(conn->state == STATE_REQ);
+    assert(buf_len(&conn->rbuf) == 0);
+
+    // every reply is a framed SER_INT
+    std::string resp(k_reqs * (4 + 9), '\0');
+    size_t got = 0;
+    while (got < resp.size()) {
+        ssize_t rv = read(fds[1], &resp[got], resp.size() - got);
+        assert(rv > 0);
+        got += (size_t)rv;
+    }
+    for (int i = 0; i < k_reqs; ++i) {
+        uint32_t len = 0;
+        memcpy(&len, &resp[i * 13], 4);
+        assert(len == 9);
+        assert((uint8_t)resp[i * 13 + 4] == 3); // SER_INT
+    }
+
+    // runs of GETs are answered in batches, in order, around other commands
+    req.clear();
+    for (int i = 0; i < k_reqs; ++i) {
+        append_req(req, {"get", "p" + std::to_string(i)});
+        if (i % 37 == 0) {
+            append_req(req, {"ttl", "p0"});
+        }
+    }
+    assert(write(fds[1], req.data(), req.size()) == (ssize_t)req.size());
+    connection_io(conn);
+    assert(conn->state == STATE_REQ && buf_len(&conn->rbuf) == 0);
+    resp.clear();
+    for (int i = 0; i < k_reqs; ++i) {
+        std::string val = std::to_string(i);
+        std::string want(4 + 5 + val.size(), '\0');
+        uint32_t len = 5 + (uint32_t)val.size();
+        memcpy(&want[0], &len, 4);
+        want[4] = 2; // SER_STR
+        len = (uint32_t)val.size();
+        memcpy(&want[5], &len, 4);
+        memcpy(&want[9], val.data(), val.size());
+        if (i % 37 == 0) {
+            want += std::string("\x09\0\0\0\x03\xff\xff\xff\xff\xff\xff\xff\xff", 13);
+        }
+        std::string got_reply(want.size(), '\0');
+        for (size_t off = 0; off < got_reply.size();) {
+            ssize_t rv = read(fds[1], &got_reply[off], got_reply.size() - off);
+            assert(rv > 0);
+            off += (size_t)rv;
+        }
+        assert(got_reply == want);
+    }
+
+    // a value far beyond the old 4 KB frame limit round-trips
+    std::string big(100 * 1000, 'x');
+    req.clear();
+    append_req(req, {"set", "big", big});
+    append_req(req, {"get", "big"});
+    size_t sent = 0;
+    resp.clear();
+    while (sent < req.size() || resp.size() < 13 + 4 + 5 + big.size()) {
+        if (sent < req.size()) {
+            ssize_t rv = write(fds[1], req.data() + sent, req.size() - sent);
+            if (rv > 0) {
+                sent += (size_t)rv;
+            }
+        }
+        connection_io(conn);
+        assert(conn->state != STATE_END);
+        char tmp[64 * 1024];
+        ssize_t rv = recv(fds[1], tmp, sizeof(tmp), MSG_DONTWAIT);
+        if (rv > 0) {
+            resp.append(tmp, (size_t)rv);
+        }
+    }
+    assert(resp.compare(13 + 4 + 5, big.size(), big) == 0);
+    // once idle, the connection gives the big buffers back
+    connection_io(conn);
+    assert(conn->rbuf.cap <= k_buf_init && conn->wbuf.cap <= k_buf_init);
+    close(fds[1]);
+    conn_destroy(conn);
+    std::cout << "  Pipelining test passed!" << std::endl;
+}
+
+void test_conn_pool() {
+    std::cout << "Testing connection pool..." << std::endl;
+    dList_init(&g_data.idle_list);
+    ConnPool &pool = g_data.conn_pool;
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    Conn *conn = conn_new(fds[0], g_data.fd2conn);
+    assert(conn && g_data.fd2conn[fds[0]] == conn);
+    assert(buf_append(&conn->rbuf, "abc", 3, 64));
+    uint8_t *kept = conn->rbuf.data;
+    uint64_t reuses = pool.reuses;
+    uint64_t releases = pool.releases;
+    conn_destroy(conn);
+    close(fds[1]);
+    assert(pool.releases == releases + 1);
+    assert(g_data.fd2conn[fds[0]] == NULL);
+
+    // the next connection gets the same struct and read buffer, emptied
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    Conn *again = conn_new(fds[0], g_data.fd2conn);
+    assert(again == conn && pool.reuses == reuses + 1);
+    assert(again->fd == fds[0] && again->state == STATE_REQ);
+    assert(again->rbuf.data == kept && buf_len(&again->rbuf) == 0);
+    conn_destroy(again);
+    close(fds[1]);
+
+    // INFO reports the same counters as name/value pairs
+    Buffer out;
+    std::vector<std::string> cmd = {"info"};
+    assert(do_request(cmd, out) == RES_OK);
+    const uint8_t *p = buf_begin(&out);
+    uint32_t n = 0;
+    assert(p[0] == SER_ARR);
+    memcpy(&n, &p[1], 4);
+    assert(n == 12);
+    p += 5;
+    std::map<std::string, int64_t> info;
+    for (uint32_t i = 0; i < n; i += 2) {
+        uint32_t len = 0;
+        assert(p[0] == SER_STR);
+        memcpy(&len, &p[1], 4);
+        std::string name((const char *)p + 5, len);
+        p += 5 + len;
+        assert(p[0] == SER_INT);
+        uint64_t val = 0;
+        memcpy(&val, &p[1], 8);
+        info[name] = (int64_t)be64toh(val);
+        p += 9;
+    }
+    assert(p == buf_begin(&out) + buf_len(&out));
+    assert(info["loop"] == 0);
+    assert(info["conn_allocs"] == (int64_t)pool.allocs);
+    assert(info["conn_reuses"] == (int64_t)pool.reuses);
+    assert(info["conn_releases"] == (int64_t)pool.releases);
+    assert(info["conn_drops"] == (int64_t)pool.drops);
+    assert(info["conn_pooled"] == (int64_t)pool.free_conns.size());
+    assert(info["conn_releases"] >= 2 && info["conn_pooled"] >= 1);
+    buf_free(&out);
+    std::cout << "  Connection pool test passed!" << std::endl;
+}
+
+// A key that shard_of() places on loop `id`
+static std::string key_on_shard(size_t id, const std::string &prefix) {
+    for (int i = 0;; i++) {
+        std::string key = prefix + std::to_string(i);
+        if (shard_of(key) == id) {
+            return key;
+        }
+    }
+}
+
+static void shards_free() {
+    for (Shard *shard : g_shards) {
+        close(shard->wake_rfd);
+        close(shard->wake_wfd);
+        pthread_mutex_destroy(&shard->mu);
+        delete shard;
+    }
+    g_shards.clear();
+}
+
+void test_parked_close() {
+    std::cout << "Testing client close while parked..." << std::endl;
+    signal(SIGPIPE, SIG_IGN);
+    dList_init(&g_data.idle_list);
+    shards_init(2);
+    g_shard_id = 0;
+    std::string local = key_on_shard(0, "pl");
+    std::string remote = key_on_shard(1, "pr");
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fd_set_nb(fds[0]);
+    // a small send buffer keeps the GET reply from fitting in the socket
+    int sndbuf = 4096;
+    assert(setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    Conn *conn = conn_new(fds[0], g_data.fd2conn);
+    std::vector<std::string> args = {"set", local, std::string(32 * 1024, 'v')};
+    Buffer out;
+    assert(do_request(Cmd(args), out) == RES_OK);
+    buf_free(&out);
+
+    // the forwarded SET parks the connection behind unsent GET output
+    std::string req;
+    append_req(req, {"get", local});
+    append_req(req, {"set", remote, "x"});
+    assert(write(fds[1], req.data(), req.size()) == (ssize_t)req.size());
+    connection_io(conn);
+    assert(conn->state == STATE_WAIT && conn_pending_output(conn));
+
+    // the client goes away; the failed flush must not end the Conn while
+    // the forwarded command still points at it
+    close(fds[1]);
+    connection_io(conn);
+    assert(conn->state == STATE_WAIT && conn->closing);
+    assert(g_data.fd2conn[fds[0]] == conn);
+
+    // loop 1 runs the SET, then loop 0 gets the reply and ends the Conn
+    std::vector<Conn *> resumed;
+    g_shard_id = 1;
+    shard_drain(resumed);
+    assert(resumed.empty());
+    g_shard_id = 0;
+    shard_drain(resumed);
+    assert(resumed.size() == 1 && resumed[0] == conn);
+    assert(conn->state == STATE_END);
+    conn_destroy(conn);
+
+    // a recycled Conn starts out healthy
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    Conn *again = conn_new(fds[0], g_data.fd2conn);
+    assert(again == conn && !again->closing);
+    conn_destroy(again);
+    close(fds[1]);
+
+    shards_free();
+    std::cout << "  Parked close test passed!" << std::endl;
+}
+
+void test_remote_get_batch() {
+    std::cout << "Testing pipelined GETs across loops..." << std::endl;
+    dList_init(&g_data.idle_list);
+    shards_init(2);
+    g_shard_id = 0;
+    // every key lands in this thread's keyspace; loop 1 reads it as its own
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < 12; ++i) {
+        std::string key = key_on_shard(i % 3 == 0 ? 1 : 0, "rg" + std::to_string(i) + "_");
+        keys.push_back(key);
+        std::vector<std::string> args = {"set", key, "v" + std::to_string(i)};
+        Buffer out;
+        assert(do_request(Cmd(args), out) == RES_OK);
+        buf_free(&out);
+    }
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    fd_set_nb(fds[0]);
+    Conn *conn = conn_new(fds[0], g_data.fd2conn);
+    std::string req;
+    for (const std::string &key : keys) {
+        append_req(req, {"get", key});
+    }
+
+    // loop 1 has not published its keyspace: the run stops at its first
+    // key, which is forwarded
+    uint64_t calls = g_data.cmd_stats[CMD_GET].calls;
+    assert(write(fds[1], req.data(), req.size()) == (ssize_t)req.size());
+    connection_io(conn);
+    assert(conn->state == STATE_WAIT);
+    std::vector<Conn *> resumed;
+    while (conn->state == STATE_WAIT) {
+        for (size_t id : {1, 0}) {
+            g_shard_id = id;
+            shard_drain(resumed);
+        }
+    }
+    g_shard_id = 0;
+
+    // once it has, the whole run is answered in one go
+    shard_publish_db(&g_data.db);
+    g_shard_id = 1;
+    shard_publish_db(&g_data.db);
+    g_shard_id = 0;
+    assert(write(fds[1], req.data(), req.size()) == (ssize_t)req.size());
+    connection_io(conn);
+    assert(conn->state == STATE_REQ && buf_len(&conn->rbuf) == 0);
+    assert(g_data.cmd_stats[CMD_GET].calls == calls + 2 * keys.size());
+
+    std::string want;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        std::string val = "v" + std::to_string(i);
+        uint32_t len = 5 + (uint32_t)val.size();
+        want.append((char *)&len, 4);
+        want += '\x02';
+        len = (uint32_t)val.size();
+        want.append((char *)&len, 4);
+        want += val;
+    }
+    want += want;
+    std::string got(want.size(), '\0');
+    for (size_t off = 0; off < got.size();) {
+        ssize_t rv = read(fds[1], &got[off], got.size() - off);
+        assert(rv > 0);
+        off += (size_t)rv;
+    }
+    assert(got == want);
+    conn_destroy(conn);
+    close(fds[1]);
+    g_data.db.shared = false;
+    for (const std::string &key : keys) {
+        std::vector<std::string> args = {"del", key};
+        Buffer out;
+        do_request(Cmd(args), out);
+        buf_free(&out);
+    }
+    shards_free();
+    std::cout << "  Cross-loop GET batch test passed!" << std::endl;
+}
+
+void test_buffer() {
+    Buffer buf;
+    assert(buf_append(&buf, "hello", 5, 64));
+    assert(buf.cap == k_buf_init && buf_len(&buf) == 5);
+    buf_consume(&buf, 2);
+    assert(memcmp(buf_begin(&buf), "llo", 3) == 0);
+    // over the limit is refused, the contents stay intact
+    assert(!buf_reserve(&buf, 62, 64));
+    assert(buf_len(&buf) == 3);
+    // filling the tail compacts instead of growing
+    assert(buf_reserve(&buf, k_buf_init - 3, k_buf_init));
+    assert(buf.head == 0 && buf.cap == k_buf_init);
+    assert(memcmp(buf_begin(&buf), "llo", 3) == 0);
+    std::string big(3 * k_buf_keep, 'y');
+    assert(buf_append(&buf, big.data(), big.size(), 4 * k_buf_keep));
+    assert(buf.cap >= 3 * k_buf_keep);
+    buf_consume(&buf, buf_len(&buf));
+    buf_shrink(&buf);
+    assert(buf.cap == 0 && buf.data == NULL);
+    // trimming cuts an empty buffer back to its first size, never a full one
+    assert(buf_append(&buf, big.data(), k_buf_keep, SIZE_MAX));
+    buf_trim(&buf);
+    assert(buf.cap >= k_buf_keep);
+    buf_consume(&buf, buf_len(&buf));
+    buf_trim(&buf);
+    assert(buf.cap == k_buf_init && buf_len(&buf) == 0);
+    assert(buf_append(&buf, "abc", 3, 64) && memcmp(buf_begin(&buf), "abc", 3) == 0);
+    buf_free(&buf);
+}
+
+void test_out_writer() {
+    std::cout << "Testing reply writer..." << std::endl;
+    Buffer out;
+    // an earlier reply, half sent
+    out_int(out, 7);
+    buf_consume(&out, 4);
+    size_t ctx = out_begin_arr(out);
+    for (int i = 0; i < 1000; ++i) {
+        out_str(out, "member" + std::to_string(i)); // grows the buffer
+    }
+    out_end_arr(out, ctx, 1000);
+    std::string resp = out_bytes(out);
+    assert((uint8_t)resp[5] == SER_ARR);
+    uint32_t n = 0;
+    memcpy(&n, &resp[6], 4);
+    assert(n == 1000);
+    assert((uint8_t)resp[10] == SER_STR);
+    buf_free(&out);
+    std::cout << "  Reply writer test passed!" << std::endl;
+}
+
+void test_log() {
+    std::cout << "Testing log..." << std::endl;
+    int level = g_log_level;
+    log_flush();
+    g_log_level = LOG_WARN;
+    LOG(LOG_INFO, "skipped %llu", 1);
+    assert(log_flush() == 0);
+    LOG(LOG_WARN, "kept %llu of %llu", 1, 2);
+    g_log_level = LOG_DEBUG;
+    LOG(LOG_ERROR, "negative %lld", -5);
+    assert(log_flush() == 2);
+    assert(log_dropped() == 0);
+    g_log_level = level;
+    std::cout << "  Log test passed!" << std::endl;
+}
+
+struct TestNode {
+    HNode node;
+    uint64_t val = 0;
+};
+
+static bool test_node_eq(HNode *a, HNode *b) {
+    return container_of(a, TestNode, node)->val == container_of(b, TestNode, node)->val;
+}
+
+static void test_count_cb(HNode *node, void *arg) {
+    (void)node;
+    (*(size_t *)arg)++;
+}
+
+void test_hmap_engines() {
+    std::cout << "Testing hash map engines..." << std::endl;
+    const uint64_t k_n = 50000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        std::vector<TestNode> nodes(k_n);
+        for (uint64_t i = 0; i < k_n; ++i) {
+            nodes[i].val = i;
+            // few distinct tags so tag matches need the full compare
+            nodes[i].node.hcode = str_hash((const uint8_t *)&i, sizeof(i)) & ~(7ull << 57);
+            hm_insert(&map, &nodes[i].node);
+        }
+        assert(map.engine == engine && hm_size(&map) == k_n);
+        for (uint64_t i = 0; i < k_n; ++i) {
+            assert(hm_lookup(&map, &nodes[i].node, test_node_eq) == &nodes[i].node);
+        }
+        // delete the even values; lookups by a separate key node
+        for (uint64_t i = 0; i < k_n; i += 2) {
+            TestNode key;
+            key.val = i;
+            key.node.hcode = nodes[i].node.hcode;
+            assert(hm_delete(&map, &key.node, test_node_eq) == &nodes[i].node);
+            assert(hm_delete(&map, &key.node, test_node_eq) == NULL);
+        }
+        assert(hm_size(&map) == k_n / 2);
+        size_t seen = 0;
+        hm_scan(&map, test_count_cb, &seen);
+        assert(seen == k_n / 2);
+        // refill the freed slots; tombstones get reused
+        for (uint64_t i = 0; i < k_n; i += 2) {
+            hm_insert(&map, &nodes[i].node);
+        }
+        for (uint64_t i = 0; i < k_n; ++i) {
+            assert(hm_lookup(&map, &nodes[i].node, test_node_eq) == &nodes[i].node);
+        }
+        assert(hm_size(&map) == k_n);
+    }
+    g_hm_engine = HM_CHAIN;
+    std::cout << "  Hash map engines test passed!" << std::endl;
+}
+
+static size_t hmap_slots(HMap *map) {
+    if (map->engine == HM_SWISS) {
+        return (map->st1.mask + 1) + (map->st2.ctrl ? map->st2.mask + 1 : 0);
+    }
+    return (map->ht1.mask + 1) + (map->ht2.tab ? map->ht2.mask + 1 : 0);
+}
+
+void test_hmap_shrink() {
+    std::cout << "Testing hash map shrinking..." << std::endl;
+    const uint64_t k_n = 100000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        std::vector<TestNode> nodes(k_n);
+        for (uint64_t i = 0; i < k_n; ++i) {
+            nodes[i].val = i;
+            nodes[i].node.hcode = str_hash((const uint8_t *)&i, sizeof(i));
+            hm_insert(&map, &nodes[i].node);
+        }
+        size_t peak = hmap_slots(&map);
+        for (uint64_t i = 10; i < k_n; ++i) {
+            assert(hm_delete(&map, &nodes[i].node, test_node_eq));
+        }
+        // lookups finish the migration
+        for (int i = 0; i < 100; ++i) {
+            assert(hm_lookup(&map, &nodes[i % 10].node, test_node_eq));
+        }
+        assert(hm_size(&map) == 10);
+        size_t small = hmap_slots(&map);
+        assert(small <= 64 && small < peak);
+        // hysteresis: churn around the current size does not resize
+        for (int i = 0; i < 1000; ++i) {
+            hm_insert(&map, &nodes[10].node);
+            assert(hm_delete(&map, &nodes[10].node, test_node_eq));
+            assert(hmap_slots(&map) == small);
+        }
+        // grows back; a burst of inserts can land mid-shrink
+        for (uint64_t i = 10; i < k_n; ++i) {
+            hm_insert(&map, &nodes[i].node);
+            if (i % 1000 == 0) {
+                for (uint64_t j = i - 990; j < i; ++j) {
+                    assert(hm_delete(&map, &nodes[j].node, test_node_eq));
+                    hm_insert(&map, &nodes[j].node);
+                }
+            }
+        }
+        for (uint64_t i = 0; i < k_n; ++i) {
+            assert(hm_lookup(&map, &nodes[i].node, test_node_eq) == &nodes[i].node);
+        }
+        assert(hm_size(&map) == k_n);
+    }
+    g_hm_engine = HM_CHAIN;
+    std::cout << "  Hash map shrinking test passed!" << std::endl;
+}
+
+void test_str_hash() {
+    std::cout << "Testing str_hash..." << std::endl;
+    std::string s(200, '\0');
+    for (size_t i = 0; i < s.size(); ++i) {
+        s[i] = (char)('a' + i % 26);
+    }
+    // every prefix length takes a different path through the tail code
+    std::vector<uint64_t> seen;
+    for (size_t len = 0; len <= s.size(); ++len) {
+        uint64_t h = str_hash((const uint8_t *)s.data(), len);
+        assert(h == str_hash((const uint8_t *)s.data(), len));
+        seen.push_back(h);
+    }
+    // one flipped bit anywhere changes the hash
+    for (size_t i = 0; i < s.size(); i += 7) {
+        std::string t = s;
+        t[i] ^= 1;
+        seen.push_back(str_hash((const uint8_t *)t.data(), t.size()));
+    }
+    std::sort(seen.begin(), seen.end());
+    assert(std::adjacent_find(seen.begin(), seen.end()) == seen.end());
+    std::cout << "  str_hash test passed!" << std::endl;
+}
+
+static void test_mark_cb(HNode *node, void *arg) {
+    std::vector<uint32_t> &seen = *(std::vector<uint32_t> *)arg;
+    uint64_t val = container_of(node, TestNode, node)->val;
+    if (val < seen.size()) {
+        seen[val]++;
+    }
+}
+
+void test_scan() {
+    std::cout << "Testing SCAN..." << std::endl;
+    const uint64_t k_stable = 2000;
+    const uint64_t k_churn = 30000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        std::vector<TestNode> nodes(k_stable + k_churn);
+        for (uint64_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].val = i;
+            nodes[i].node.hcode = str_hash((const uint8_t *)&i, sizeof(i));
+        }
+        for (uint64_t i = 0; i < k_stable; ++i) {
+            hm_insert(&map, &nodes[i].node);
+        }
+        // grow, then shrink the map between steps of one pass
+        std::vector<uint32_t> seen(k_stable);
+        uint64_t cursor = 0, steps = 0, churn = 0;
+        do {
+            cursor = hm_scan_step(&map, cursor, test_mark_cb, &seen);
+            steps++;
+            for (int i = 0; i < 200 && churn < 2 * k_churn; ++i, ++churn) {
+                TestNode *node = &nodes[k_stable + churn % k_churn];
+                if (churn < k_churn) {
+                    hm_insert(&map, &node->node);
+                } else {
+                    assert(hm_delete(&map, &node->node, test_node_eq));
+                }
+            }
+        } while (cursor != 0);
+        assert(steps > 1);
+        for (uint64_t i = 0; i < k_stable; ++i) {
+            assert(seen[i] >= 1);
+        }
+        // a quiet pass sees each node exactly once
+        std::fill(seen.begin(), seen.end(), 0);
+        do {
+            cursor = hm_scan_step(&map, cursor, test_mark_cb, &seen);
+        } while (cursor != 0);
+        for (uint64_t i = 0; i < k_stable; ++i) {
+            assert(seen[i] == 1);
+        }
+    }
+    g_hm_engine = HM_CHAIN;
+
+    // the command: [cursor, [key...]] until the cursor comes back as 0
+    Buffer out;
+    std::vector<std::string> cmd;
+    for (int i = 0; i < 300; ++i) {
+        cmd = {"set", "scan:" + std::to_string(i), "v"};
+        assert(do_set(cmd, out) == RES_OK);
+    }
+    std::vector<std::string> keys;
+    std::string cursor = "0";
+    do {
+        buf_truncate(&out, 0);
+        cmd = {"scan", cursor, "7"};
+        assert(do_scan(cmd, out) == RES_OK);
+        std::string r = out_bytes(out);
+        uint32_t n = 0;
+        assert((uint8_t)r[0] == 4); // SER_ARR
+        memcpy(&n, &r[1], 4);
+        assert(n == 2 && (uint8_t)r[5] == 3); // SER_INT
+        uint64_t next = 0;
+        memcpy(&next, &r[6], 8);
+        cursor = std::to_string(be64toh(next));
+        assert((uint8_t)r[14] == 4);
+        memcpy(&n, &r[15], 4);
+        assert(n <= 70); // a bucket may add a few past the count
+        size_t pos = 19;
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t len = 0;
+            assert((uint8_t)r[pos] == 2); // SER_STR
+            memcpy(&len, &r[pos + 1], 4);
+            keys.push_back(r.substr(pos + 5, len));
+            pos += 5 + len;
+        }
+        assert(pos == r.size());
+    } while (cursor != "0");
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    assert(std::count_if(keys.begin(), keys.end(), [](const std::string &k) {
+        return k.compare(0, 5, "scan:") == 0;
+    }) == 300);
+    for (int i = 0; i < 300; ++i) {
+        cmd = {"del", "scan:" + std::to_string(i)};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    // bad counts, and a cursor naming a shard that does not exist
+    for (auto bad : std::vector<std::vector<std::string>>{
+             {"scan", "x"}, {"scan", "0", "0"}, {"scan", std::to_string(1ull << 56)}}) {
+        buf_truncate(&out, 0);
+        assert(do_scan(bad, out) == RES_ERR);
+    }
+    std::cout << "  SCAN test passed!" << std::endl;
+}
+
+void test_entry_layout() {
+    std::cout << "Testing entry layout..." << std::endl;
+    // header only; key and small values share its allocation
+    assert(sizeof(Entry) <= 48);
+    std::string big(k_val_inline_max + 1, 'x');
+    for (std::string val : {std::string(), std::string("v"), std::string(k_val_inline_max, 'y'), big}) {
+        Entry *ent = entry_new_str("key", 42, val);
+        assert(entry_key(ent) == "key" && entry_val(ent) == val);
+        assert((ent->ext != NULL) == (val.size() > k_val_inline_max));
+        assert(ent->node.hcode == 42 && ent->heap_idx == (size_t)-1);
+        entry_del(ent);
+    }
+    Buffer out;
+    std::vector<std::string> cmd = {"set", "big", big};
+    assert(do_set(cmd, out) == RES_OK);
+    buf_truncate(&out, 0);
+    cmd = {"get", "big"};
+    assert(do_get(cmd, out) == RES_OK);
+    assert(out_bytes(out).substr(5) == big);
+    // a string key is not a zset, and the other way round
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "big", "1", "m"};
+    assert(do_zadd(cmd, out) == RES_ERR);
+    cmd = {"zadd", "zs", "1", "m"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    cmd = {"get", "zs"};
+    assert(do_get(cmd, out) == RES_NX);
+    for (const char *key : {"big", "zs"}) {
+        cmd = {"del", key};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    std::cout << "  Entry layout test passed!" << std::endl;
+}
+
+static HNode *test_make_cb(HNode *key, void *arg) {
+    std::vector<TestNode> &nodes = *(std::vector<TestNode> *)arg;
+    return &nodes[container_of(key, TestNode, node)->val].node;
+}
+
+void test_find_or_insert() {
+    std::cout << "Testing find-or-insert..." << std::endl;
+    const uint64_t k_n = 20000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        std::vector<TestNode> nodes(k_n);
+        for (int round = 0; round < 2; ++round) {
+            for (uint64_t i = 0; i < k_n; ++i) {
+                TestNode key;
+                key.val = i;
+                key.node.hcode = str_hash((const uint8_t *)&i, sizeof(i));
+                nodes[i].val = i;
+                nodes[i].node.hcode = key.node.hcode;
+                bool inserted = false;
+                HNode *node = hm_find_or_insert(&map, &key.node, test_node_eq, test_make_cb, &nodes, &inserted);
+                assert(node == &nodes[i].node && inserted == (round == 0));
+            }
+            assert(hm_size(&map) == k_n);
+        }
+        // slots freed by deletes are reused
+        for (uint64_t i = 0; i < k_n; i += 3) {
+            assert(hm_delete(&map, &nodes[i].node, test_node_eq));
+        }
+        for (uint64_t i = 0; i < k_n; ++i) {
+            bool inserted = false;
+            hm_find_or_insert(&map, &nodes[i].node, test_node_eq, test_make_cb, &nodes, &inserted);
+            assert(inserted == (i % 3 == 0));
+        }
+        assert(hm_size(&map) == k_n);
+    }
+    g_hm_engine = HM_CHAIN;
+
+    // SET overwrites in place, across inline and external values
+    Buffer out;
+    std::vector<std::string> cmd;
+    size_t keys = cm_size(&g_data.db);
+    cmd = {"set", "k", "x"};
+    assert(do_set(cmd, out) == RES_OK);
+    cmd = {"expire", "k", "10000"};
+    assert(do_expire(cmd, out) == RES_OK);
+    for (size_t len : {0, 1, 300, 10, 2000, 5}) {
+        std::string val(len, (char)('a' + len % 26));
+        cmd = {"set", "k", val};
+        assert(do_set(cmd, out) == RES_OK);
+        buf_truncate(&out, 0);
+        cmd = {"get", "k"};
+        assert(do_get(cmd, out) == RES_OK);
+        assert(out_bytes(out).substr(5) == val);
+    }
+    assert(cm_size(&g_data.db) == keys + 1);
+    buf_truncate(&out, 0);
+    cmd = {"ttl", "k"};
+    assert(do_ttl(cmd, out) == RES_OK);
+    assert(out_bytes(out) == std::string("\x03\xff\xff\xff\xff\xff\xff\xff\xff", 9)); // -1, no TTL
+    // a zset key becomes a string
+    cmd = {"zadd", "z", "1", "m"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    cmd = {"zadd", "z", "2", "m"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    cmd = {"set", "z", "s"};
+    assert(do_set(cmd, out) == RES_OK);
+    buf_truncate(&out, 0);
+    cmd = {"get", "z"};
+    assert(do_get(cmd, out) == RES_OK && out_bytes(out).substr(5) == "s");
+    for (const char *key : {"k", "z"}) {
+        cmd = {"del", key};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    assert(cm_size(&g_data.db) == keys);
+    std::cout << "  Find-or-insert test passed!" << std::endl;
+}
+
+void test_lookup_batch() {
+    std::cout << "Testing batched lookups..." << std::endl;
+    const uint64_t k_n = 30000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        HMap map;
+        std::vector<TestNode> nodes(2 * k_n);
+        for (uint64_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].val = i;
+            nodes[i].node.hcode = str_hash((const uint8_t *)&i, sizeof(i));
+        }
+        // batches of every size, half the keys absent, while the map grows
+        for (uint64_t i = 0; i < k_n; ++i) {
+            hm_insert(&map, &nodes[2 * i].node);
+            size_t n = i % 40;
+            HNode *keys[40];
+            HNode *out[40];
+            for (size_t j = 0; j < n; ++j) {
+                keys[j] = &nodes[(i * 7 + j * 13) % (2 * i + 2)].node;
+            }
+            hm_lookup_batch(&map, keys, n, test_node_eq, out);
+            for (size_t j = 0; j < n; ++j) {
+                assert(out[j] == hm_lookup(&map, keys[j], test_node_eq));
+                assert(out[j] == ((container_of(keys[j], TestNode, node)->val % 2) ? NULL : keys[j]));
+            }
+        }
+    }
+    g_hm_engine = HM_CHAIN;
+
+    Buffer out;
+    std::vector<std::string> cmd = {"set", "m1", "a"};
+    assert(do_set(cmd, out) == RES_OK);
+    cmd = {"zadd", "mz", "1", "x"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    buf_truncate(&out, 0);
+    cmd = {"mget", "m1", "nope", "mz", "m1"};
+    assert(do_mget(cmd, out) == RES_OK);
+    std::string want("\x04\x04\0\0\0" "\x02\x01\0\0\0a" "\0" "\0" "\x02\x01\0\0\0a", 5 + 6 + 1 + 1 + 6);
+    assert(out_bytes(out) == want);
+
+    // more keys than one lookup batch, past the inline arguments
+    cmd = {"mget"};
+    want = std::string("\x04\0\0\0\0", 5);
+    for (size_t i = 0; i < 3 * k_lookup_batch + 5; ++i) {
+        const char *key = i % 3 == 0 ? "m1" : i % 3 == 1 ? "nope" : "mz";
+        cmd.push_back(key);
+        want += i % 3 == 0 ? std::string("\x02\x01\0\0\0a", 6) : std::string(1, '\0');
+    }
+    want[1] = (char)(cmd.size() - 1);
+    buf_truncate(&out, 0);
+    assert(do_request(cmd, out) == RES_OK);
+    assert(out_bytes(out) == want);
+    for (const char *key : {"m1", "mz"}) {
+        cmd = {"del", key};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    std::cout << "  Batched lookup test passed!" << std::endl;
+}
+
+struct CMapReader {
+    CMap *cm = NULL;
+    std::vector<TestNode> *nodes = NULL;
+    size_t nstable = 0;
+    std::atomic<bool> *stop = NULL;
+    uint64_t reads = 0;
+};
+
+static void test_read_cb(HNode *node, void *arg) {
+    *(uint64_t *)arg = container_of(node, TestNode, node)->val;
+}
+
+// Stable keys must stay visible with their value through every write
+static void *cmap_reader(void *arg) {
+    CMapReader *rd = (CMapReader *)arg;
+    for (uint64_t i = 0; !rd->stop->load(); i = (i + 7919) % rd->nstable, rd->reads++) {
+        TestNode key;
+        key.val = i;
+        key.node.hcode = (*rd->nodes)[i].node.hcode;
+        uint64_t val = UINT64_MAX;
+        assert(cm_read(rd->cm, &key.node, test_node_eq, test_read_cb, &val));
+        assert(val == i);
+    }
+    return NULL;
+}
+
+void test_cmap() {
+    std::cout << "Testing striped concurrent map..." << std::endl;
+    const uint64_t k_stable = 5000;
+    const uint64_t k_churn = 50000;
+    for (uint32_t engine : {HM_CHAIN, HM_SWISS}) {
+        g_hm_engine = engine;
+        CMap *cm = new CMap();
+        std::vector<TestNode> nodes(k_stable + k_churn);
+        for (uint64_t i = 0; i < nodes.size(); ++i) {
+            nodes[i].val = i;
+            nodes[i].node.hcode = str_hash((const uint8_t *)&i, sizeof(i));
+        }
+        for (uint64_t i = 0; i < k_stable; ++i) {
+            hm_insert(cm_stripe(cm, nodes[i].node.hcode), &nodes[i].node);
+        }
+        cm->shared = true;
+        std::atomic<bool> stop(false);
+        CMapReader readers[3];
+        pthread_t threads[3];
+        for (int t = 0; t < 3; ++t) {
+            readers[t].cm = cm;
+            readers[t].nodes = &nodes;
+            readers[t].nstable = k_stable;
+            readers[t].stop = &stop;
+            assert(pthread_create(&threads[t], NULL, cmap_reader, &readers[t]) == 0);
+        }
+        // grow and shrink every stripe a few times under the readers
+        for (int round = 0; round < 3; ++round) {
+            for (uint64_t i = k_stable; i < nodes.size(); ++i) {
+                HNode *node = &nodes[i].node;
+                cm_write_begin(cm, node->hcode);
+                hm_insert(cm_stripe(cm, node->hcode), node);
+                cm_write_end(cm, node->hcode);
+            }
+            assert(cm_size(cm) == nodes.size());
+            for (uint64_t i = k_stable; i < nodes.size(); ++i) {
+                HNode *node = &nodes[i].node;
+                cm_write_begin(cm, node->hcode);
+                assert(hm_delete(cm_stripe(cm, node->hcode), node, test_node_eq) == node);
+                cm_write_end(cm, node->hcode);
+            }
+        }
+        stop = true;
+        for (int t = 0; t < 3; ++t) {
+            pthread_join(threads[t], NULL);
+            assert(readers[t].reads > 0);
+        }
+        // the owner's lookups, single and batched, and a full scan
+        for (uint64_t i = 0; i < k_stable; ++i) {
+            assert(cm_lookup(cm, &nodes[i].node, test_node_eq) == &nodes[i].node);
+        }
+        HNode *keys[2] = {&nodes[0].node, &nodes[k_stable].node};
+        HNode *out[2];
+        cm_lookup_batch(cm, keys, 2, test_node_eq, out);
+        assert(out[0] == keys[0] && out[1] == NULL);
+        size_t seen = 0;
+        uint64_t cursor = 0;
+        do {
+            cursor = cm_scan_step(cm, cursor, test_count_cb, &seen);
+        } while (cursor != 0);
+        assert(seen == k_stable && cm_size(cm) == k_stable);
+        delete cm;
+    }
+    g_hm_engine = HM_CHAIN;
+    std::cout << "  Striped concurrent map test passed!" << std::endl;
+}
+
+// The value of an INT reply
+static int64_t int_response(const std::string &out) {
+    assert(out.size() == 9 && (uint8_t)out[0] == 3); // SER_INT
+    uint64_t nval = 0;
+    memcpy(&nval, out.data() + 1, 8);
+    return (int64_t)be64toh(nval);
+}
+
+void test_zset_rank() {
+    std::cout << "Testing zset rank queries..." << std::endl;
+    // unit level: ranks, nth and counts against a sorted copy
+    ZSet zset;
+    std::vector<std::pair<double, std::string>> sorted;
+    srand(7);
+    for (int i = 0; i < 2000; ++i) {
+        std::string name = "m" + std::to_string(rand() % 5000);
+        double score = rand() % 300; // plenty of ties, ordered by name
+        if (zset_add(&zset, name.data(), name.size(), score)) {
+            sorted.push_back({score, name});
+        } else {
+            for (auto &p : sorted) {
+                if (p.second == name) p.first = score;
+            }
+        }
+    }
+    std::sort(sorted.begin(), sorted.end());
+    assert(zset_size(&zset) == sorted.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        ZNode *znode = zset_nth(&zset, i);
+        assert(znode && std::string(znode->name, znode->len) == sorted[i].second);
+        assert(znode_rank(&zset, znode) == i);
+    }
+    assert(!zset_nth(&zset, sorted.size()));
+    for (double score : {-1.0, 0.0, 10.0, 150.0, 299.0, 300.0}) {
+        auto lt = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(score, std::string()));
+        uint64_t below = lt - sorted.begin();
+        uint64_t upto = below;
+        while (upto < sorted.size() && sorted[upto].first == score) upto++;
+        assert(zset_count_below(&zset, score, false) == below);
+        assert(zset_count_below(&zset, score, true) == upto);
+    }
+    // ranks stay consistent as deletes rebalance the tree
+    std::vector<std::pair<double, std::string>> kept;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        const std::string &name = sorted[i].second;
+        if (i % 3 == 0) {
+            assert(zset_remove(&zset, name.data(), name.size()));
+        } else {
+            kept.push_back(sorted[i]);
+        }
+    }
+    assert(zset_size(&zset) == kept.size());
+    for (size_t i = 0; i < kept.size(); ++i) {
+        ZNode *znode = zset_nth(&zset, i);
+        assert(std::string(znode->name, znode->len) == kept[i].second && znode_rank(&zset, znode) == i);
+    }
+
+    // commands
+    Buffer out;
+    std::vector<std::string> cmd;
+    const char *names[] = {"a", "b", "c", "d", "e"};
+    for (int i = 0; i < 5; ++i) {
+        cmd = {"zadd", "rz", std::to_string(i * 10), names[i]};
+        assert(do_zadd(cmd, out) == RES_OK);
+    }
+    buf_truncate(&out, 0);
+    cmd = {"zrank", "rz", "b"};
+    assert(do_zrank(cmd, out) == RES_OK && int_response(out_bytes(out)) == 1);
+    buf_truncate(&out, 0);
+    cmd = {"zrevrank", "rz", "b"};
+    assert(do_zrevrank(cmd, out) == RES_OK && int_response(out_bytes(out)) == 3);
+    buf_truncate(&out, 0);
+    cmd = {"zrank", "rz", "zz"};
+    assert(do_zrank(cmd, out) == RES_OK && out_bytes(out) == std::string(1, '\0')); // nil
+    buf_truncate(&out, 0);
+    cmd = {"zcount", "rz", "10", "30"};
+    assert(do_zcount(cmd, out) == RES_OK && int_response(out_bytes(out)) == 3);
+    buf_truncate(&out, 0);
+    cmd = {"zcount", "rz", "-inf", "+inf"};
+    assert(do_zcount(cmd, out) == RES_OK && int_response(out_bytes(out)) == 5);
+    buf_truncate(&out, 0);
+    cmd = {"zcount", "rz", "30", "10"};
+    assert(do_zcount(cmd, out) == RES_OK && int_response(out_bytes(out)) == 0);
+    cmd = {"zcount", "rz", "x", "10"};
+    assert(do_zcount(cmd, out) == RES_ERR);
+    // -2..-1 are the last two members
+    buf_truncate(&out, 0);
+    cmd = {"zrange", "rz", "-2", "-1"};
+    assert(do_zrange(cmd, out) == RES_OK);
+    std::string resp = out_bytes(out);
+    uint32_t n = 0;
+    memcpy(&n, resp.data() + 1, 4);
+    assert((uint8_t)resp[0] == 4 && n == 4); // SER_ARR of name, score pairs
+    assert(resp.substr(5, 6) == std::string("\x02\x01\0\0\0d", 6));
+    assert_dbl_response(resp.substr(11, 9), 30);
+    assert(resp.substr(20, 6) == std::string("\x02\x01\0\0\0e", 6));
+    // out of range yields an empty array, oversized stop is clamped
+    buf_truncate(&out, 0);
+    cmd = {"zrange", "rz", "3", "1"};
+    assert(do_zrange(cmd, out) == RES_OK && out_bytes(out) == std::string("\x04\0\0\0\0", 5));
+    buf_truncate(&out, 0);
+    cmd = {"zrange", "rz", "0", "100"};
+    assert(do_zrange(cmd, out) == RES_OK);
+    memcpy(&n, out_bytes(out).data() + 1, 4);
+    assert(n == 10);
+    cmd = {"del", "rz"};
+    assert(do_del(cmd, out) == RES_OK);
+    std::cout << "  Zset rank test passed!" << std::endl;
+}
+
+// The names, and scores if present, of an array reply made of STR and DOUBLE items
+static std::vector<std::string> arr_response(const std::string &out) {
+    assert((uint8_t)out[0] == 4); // SER_ARR
+    uint32_t n = 0;
+    memcpy(&n, out.data() + 1, 4);
+    std::vector<std::string> items;
+    size_t pos = 5;
+    for (uint32_t i = 0; i < n; ++i) {
+        if ((uint8_t)out[pos] == 2) { // SER_STR
+            uint32_t len = 0;
+            memcpy(&len, out.data() + pos + 1, 4);
+            items.push_back(out.substr(pos + 5, len));
+            pos += 5 + len;
+        } else {
+            assert((uint8_t)out[pos] == 5); // SER_DOUBLE
+            uint64_t nval = 0;
+            memcpy(&nval, out.data() + pos + 1, 8);
+            nval = be64toh(nval);
+            double val = 0;
+            memcpy(&val, &nval, 8);
+            items.push_back(std::to_string((int64_t)val));
+            pos += 9;
+        }
+    }
+    assert(pos == out.size());
+    return items;
+}
+
+void test_zset_range() {
+    std::cout << "Testing zset score ranges..." << std::endl;
+    // in-order walk in both directions visits every member once
+    ZSet zset;
+    const int k_n = 3000;
+    for (int i = 0; i < k_n; ++i) {
+        std::string name = std::to_string(i * 7919 % k_n);
+        zset_add(&zset, name.data(), name.size(), (double)(i * 7919 % k_n));
+    }
+    int seen = 0;
+    for (ZNode *znode = zset_nth(&zset, 0); znode; znode = znode_next(&zset, znode)) {
+        assert(znode->score == seen++);
+    }
+    assert(seen == k_n);
+    for (ZNode *znode = zset_nth(&zset, k_n - 1); znode; znode = znode_prev(&zset, znode)) {
+        assert(znode->score == --seen);
+    }
+    assert(seen == 0);
+
+    Buffer out;
+    std::vector<std::string> cmd;
+    for (int i = 1; i <= 9; ++i) {
+        cmd = {"zadd", "sz", std::to_string(i), "m" + std::to_string(i)};
+        assert(do_zadd(cmd, out) == RES_OK);
+    }
+    using Items = std::vector<std::string>;
+    auto range = [&](const std::vector<std::string> &args) {
+        buf_truncate(&out, 0);
+        assert(do_request(Cmd(args), out) == RES_OK);
+        return arr_response(out_bytes(out));
+    };
+    assert(range({"zrangebyscore", "sz", "3", "5"}) == (Items{"m3", "m4", "m5"}));
+    assert(range({"zrangebyscore", "sz", "(3", "(5"}) == (Items{"m4"}));
+    assert(range({"zrangebyscore", "sz", "8", "+inf", "WITHSCORES"}) == (Items{"m8", "8", "m9", "9"}));
+    assert(range({"zrangebyscore", "sz", "-inf", "+inf", "limit", "2", "3"}) == (Items{"m3", "m4", "m5"}));
+    assert(range({"zrangebyscore", "sz", "-inf", "+inf", "limit", "7", "-1"}) == (Items{"m8", "m9"}));
+    assert(range({"zrangebyscore", "sz", "5", "3"}).empty());
+    assert(range({"zrangebyscore", "nokey", "0", "1"}).empty());
+    assert(range({"zrevrangebyscore", "sz", "5", "(2"}) == (Items{"m5", "m4", "m3"}));
+    assert(range({"zrevrangebyscore", "sz", "+inf", "-inf", "withscores", "limit", "1", "2"})
+           == (Items{"m8", "8", "m7", "7"}));
+    buf_truncate(&out, 0);
+    cmd = {"zrangebyscore", "sz", "1", "2", "limit", "0"};
+    assert(do_request(Cmd(cmd), out) == RES_ERR);
+    cmd = {"del", "sz"};
+    assert(do_del(cmd, out) == RES_OK);
+    std::cout << "  Zset range test passed!" << std::endl;
+}
+
+// Random inserts, score updates and deletes on a B+-tree indexed set,
+// checked against a sorted copy; deletes shrink the tree back to nothing
+void test_zset_btree() {
+    std::cout << "Testing zset B+-tree index..." << std::endl;
+    g_zset_index = ZS_BTREE;
+    ZSet zset;
+    g_zset_index = ZS_AVL;
+    std::map<std::string, double> scores;
+    auto sorted = [&]() {
+        std::vector<std::pair<double, std::string>> v;
+        for (auto &kv : scores) v.push_back({kv.second, kv.first});
+        std::sort(v.begin(), v.end());
+        return v;
+    };
+    auto check = [&]() {
+        auto v = sorted();
+        assert(zset_size(&zset) == v.size());
+        ZNode *znode = zset_nth(&zset, 0);
+        for (size_t i = 0; i < v.size(); ++i) {
+            assert(znode && znode->score == v[i].first && std::string(znode->name, znode->len) == v[i].second);
+            assert(znode_rank(&zset, znode) == i && zset_nth(&zset, i) == znode);
+            znode = znode_next(&zset, znode);
+        }
+        assert(!znode);
+        for (int t = 0; t < 50 && !v.empty(); ++t) {
+            double score = rand() % 120;
+            std::string name = "k" + std::to_string(rand() % 3000);
+            auto it = std::lower_bound(v.begin(), v.end(), std::make_pair(score, name));
+            ZNode *found = zset_query(&zset, score, name.data(), name.size());
+            assert(it == v.end() ? !found : found && std::string(found->name, found->len) == it->second);
+            auto lt = std::lower_bound(v.begin(), v.end(), std::make_pair(score, std::string()));
+            auto le = std::lower_bound(v.begin(), v.end(), std::make_pair(score + 0.5, std::string()));
+            assert(zset_count_below(&zset, score, false) == (uint64_t)(lt - v.begin()));
+            assert(zset_count_below(&zset, score, true) == (uint64_t)(le - v.begin()));
+        }
+    };
+    srand(11);
+    for (int round = 0; round < 4; ++round) {
+        for (int i = 0; i < 20000; ++i) {
+            std::string name = "k" + std::to_string(rand() % 3000);
+            double score = rand() % 120;
+            zset_add(&zset, name.data(), name.size(), score);
+            scores[name] = score;
+        }
+        check();
+        // delete most members, in random order
+        std::vector<std::string> names;
+        for (auto &kv : scores) names.push_back(kv.first);
+        std::shuffle(names.begin(), names.end(), std::mt19937(round));
+        for (size_t i = 0; i < names.size() * 9 / 10; ++i) {
+            assert(zset_remove(&zset, names[i].data(), names[i].size()));
+            scores.erase(names[i]);
+        }
+        check();
+    }
+    for (auto &kv : scores) {
+        assert(zset_remove(&zset, kv.first.data(), kv.first.size()));
+    }
+    assert(zset_size(&zset) == 0 && !zset.big->btree.root);
+    std::cout << "  Zset B+-tree test passed!" << std::endl;
+}
+
+// Small sets stay in one buffer until a threshold is crossed, then
+// convert to the index with their members intact
+void test_zset_small() {
+    std::cout << "Testing zset small encoding..." << std::endl;
+    for (uint32_t index : {ZS_AVL, ZS_BTREE}) {
+        g_zset_index = index;
+        ZSet zset;
+        std::map<std::string, double> scores;
+        for (uint32_t i = 0; i < g_zset_small_max; ++i) {
+            std::string name = "s" + std::to_string(i * 37 % 101);
+            zset_add(&zset, name.data(), name.size(), (double)(i % 7));
+            scores[name] = i % 7;
+        }
+        assert(zset.small && !zset.big && zset_size(&zset) == scores.size());
+        // updates and removals keep the order
+        assert(!zset_add(&zset, "s5", 2, -1.0));
+        scores["s5"] = -1;
+        assert(zset_remove(&zset, "s7", 2) && !zset_remove(&zset, "s7", 2));
+        scores.erase("s7");
+        auto check = [&]() {
+            std::vector<std::pair<double, std::string>> v;
+            for (auto &kv : scores) v.push_back({kv.second, kv.first});
+            std::sort(v.begin(), v.end());
+            assert(zset_size(&zset) == v.size());
+            ZNode *znode = zset_nth(&zset, 0);
+            for (size_t i = 0; i < v.size(); ++i) {
+                assert(znode && znode->score == v[i].first && std::string(znode->name, znode->len) == v[i].second);
+                assert(znode_rank(&zset, znode) == i);
+                znode = znode_next(&zset, znode);
+            }
+            assert(!znode);
+            ZNode *found = zset_lookup(&zset, "s5", 2);
+            assert(found && found->score == -1.0 && zset_query(&zset, -1.0, "", 0) == found);
+        };
+        check();
+        // a long name converts the set
+        std::string name(g_zset_small_len + 1, 'x');
+        assert(zset_add(&zset, name.data(), name.size(), 3.5));
+        scores[name] = 3.5;
+        assert(!zset.small && zset.big);
+        check();
+    }
+    g_zset_index = ZS_AVL;
+
+    // crossing the member count converts a set created by ZADD
+    Buffer out;
+    std::vector<std::string> cmd;
+    for (uint32_t i = 0; i <= g_zset_small_max; ++i) {
+        cmd = {"zadd", "small", std::to_string(g_zset_small_max - i), "m" + std::to_string(i)};
+        assert(do_zadd(cmd, out) == RES_OK);
+    }
+    buf_truncate(&out, 0);
+    cmd = {"zrank", "small", "m0"};
+    assert(do_zrank(cmd, out) == RES_OK && int_response(out_bytes(out)) == g_zset_small_max);
+    buf_truncate(&out, 0);
+    cmd = {"zcount", "small", "-inf", "+inf"};
+    assert(do_zcount(cmd, out) == RES_OK && int_response(out_bytes(out)) == g_zset_small_max + 1);
+    cmd = {"del", "small"};
+    assert(do_del(cmd, out) == RES_OK);
+    std::cout << "  Zset small encoding test passed!" << std::endl;
+}
+
+void test_zset_arena() {
+    std::cout << "Testing zset member arena..." << std::endl;
+    Arena arena;
+    void *a = arena_alloc(&arena, 70);
+    void *b = arena_alloc(&arena, 70);
+    assert(a != b && (uintptr_t)a % k_arena_align == 0 && (uintptr_t)b % k_arena_align == 0);
+    arena_free(&arena, a, 70);
+    assert(arena_alloc(&arena, 80) == a); // same size class
+    void *big = arena_alloc(&arena, 4000); // a chunk of its own
+    memset(big, 1, 4000);
+    arena_free(&arena, big, 4000);
+    for (size_t i = 0; i < 10000; ++i) {
+        memset(arena_alloc(&arena, 16 + i % 300), 2, 16 + i % 300);
+    }
+    arena_clear(&arena);
+    assert(!arena.chunks && !arena.bump);
+
+    // removed members are recycled; long names use their own chunks
+    for (uint32_t index : {ZS_AVL, ZS_BTREE}) {
+        g_zset_index = index;
+        ZSet *zset = new ZSet();
+        std::map<std::string, double> scores;
+        for (uint32_t round = 0; round < 3; ++round) {
+            for (uint32_t i = 0; i < 2000; ++i) {
+                std::string name = "m" + std::to_string(i);
+                if (i % 100 == 0) {
+                    name += std::string(1000, 'x');
+                }
+                if ((i + round) % 3 == 0) {
+                    zset_remove(zset, name.data(), name.size());
+                    scores.erase(name);
+                } else {
+                    zset_add(zset, name.data(), name.size(), (double)(i % 50));
+                    scores[name] = i % 50;
+                }
+            }
+        }
+        assert(zset->big && zset_size(zset) == scores.size());
+        for (auto &kv : scores) {
+            ZNode *znode = zset_lookup(zset, kv.first.data(), kv.first.size());
+            assert(znode && znode->score == kv.second);
+        }
+        delete zset;
+    }
+    g_zset_index = ZS_AVL;
+    std::cout << "  Zset member arena test passed!" << std::endl;
+}
+
+// Batches checked against pairs applied one at a time to a std::map
+void test_zadd_batch() {
+    std::cout << "Testing zadd batches..." << std::endl;
+    std::mt19937 rng(11);
+    for (uint32_t index : {ZS_AVL, ZS_BTREE}) {
+        g_zset_index = index;
+        for (uint32_t flags : {0u, (uint32_t)ZADD_NX, (uint32_t)ZADD_XX, (uint32_t)ZADD_GT,
+                               (uint32_t)ZADD_LT, (uint32_t)(ZADD_XX | ZADD_GT)}) {
+            ZSet zset;
+            std::map<std::string, double> ref;
+            for (size_t n : {(size_t)5000, (size_t)40, (size_t)3000, (size_t)200}) {
+                std::vector<std::string> names(n);
+                std::vector<ZAddItem> items(n);
+                for (size_t i = 0; i < n; ++i) {
+                    names[i] = "m" + std::to_string(rng() % 6000); // with repeats
+                    items[i].name = names[i].data();
+                    items[i].len = names[i].size();
+                    items[i].score = (double)(rng() % 500);
+                }
+                // the first batch fills the set whatever the flags
+                uint32_t f = ref.empty() ? 0 : flags;
+                uint64_t want_added = 0, want_changed = 0;
+                for (const ZAddItem &item : items) {
+                    std::string name(item.name, item.len);
+                    auto it = ref.find(name);
+                    bool exists = it != ref.end();
+                    if ((!exists && (f & ZADD_XX)) || (exists && (f & ZADD_NX))
+                            || (exists && (f & ZADD_GT) && !(item.score > it->second))
+                            || (exists && (f & ZADD_LT) && !(item.score < it->second))
+                            || (exists && it->second == item.score)) {
+                        continue;
+                    }
+                    want_added += !exists;
+                    want_changed++;
+                    ref[name] = item.score;
+                }
+                uint64_t changed = 0;
+                assert(zset_add_batch(&zset, items.data(), n, f, &changed) == want_added);
+                assert(changed == want_changed);
+                // order, ranks and lookups, then single updates on the
+                // rebuilt index
+                std::vector<std::pair<double, std::string>> sorted;
+                for (auto &kv : ref) sorted.push_back({kv.second, kv.first});
+                std::sort(sorted.begin(), sorted.end());
+                assert(zset_size(&zset) == sorted.size());
+                ZNode *znode = zset_nth(&zset, 0);
+                for (size_t i = 0; i < sorted.size(); ++i) {
+                    assert(znode && znode->score == sorted[i].first);
+                    assert(std::string(znode->name, znode->len) == sorted[i].second);
+                    assert(znode_rank(&zset, znode) == i);
+                    znode = znode_next(&zset, znode);
+                }
+                assert(!znode);
+                for (size_t i = 0; i < sorted.size(); i += 7) {
+                    const std::string &name = sorted[i].second;
+                    assert(zset_lookup(&zset, name.data(), name.size()));
+                    if (i % 2) {
+                        assert(zset_remove(&zset, name.data(), name.size()));
+                        ref.erase(name);
+                    } else {
+                        zset_add(&zset, name.data(), name.size(), -(double)i);
+                        ref[name] = -(double)i;
+                    }
+                }
+                assert(zset_size(&zset) == ref.size());
+                assert(zset_count_below(&zset, 0, false) == (uint64_t)std::count_if(
+                    ref.begin(), ref.end(), [](auto &kv) { return kv.second < 0; }));
+            }
+        }
+    }
+    g_zset_index = ZS_AVL;
+
+    // command level: flags, CH, INCR and the errors
+    Buffer out;
+    std::vector<std::string> cmd = {"zadd", "bz", "1", "a", "2", "b", "3", "a"};
+    assert(do_zadd(cmd, out) == RES_OK && int_response(out_bytes(out)) == 2);
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "bz", "nx", "ch", "9", "a", "4", "c"};
+    assert(do_zadd(cmd, out) == RES_OK && int_response(out_bytes(out)) == 1);
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "bz", "XX", "CH", "GT", "1", "a", "5", "b", "1", "d"};
+    assert(do_zadd(cmd, out) == RES_OK && int_response(out_bytes(out)) == 1);
+    buf_truncate(&out, 0);
+    cmd = {"zscore", "bz", "b"};
+    assert(do_zscore(cmd, out) == RES_OK);
+    assert_dbl_response(out_bytes(out), 5);
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "bz", "incr", "2.5", "a"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    assert_dbl_response(out_bytes(out), 5.5);
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "bz", "lt", "incr", "1", "a"};
+    assert(do_zadd(cmd, out) == RES_OK && out_bytes(out) == std::string("\0", 1));
+    buf_truncate(&out, 0);
+    cmd = {"zadd", "nokey", "xx", "1", "a"};
+    assert(do_zadd(cmd, out) == RES_OK && int_response(out_bytes(out)) == 0);
+    buf_truncate(&out, 0);
+    cmd = {"get", "nokey"};
+    assert(do_get(cmd, out) == RES_NX);
+    for (std::vector<std::string> bad : std::vector<std::vector<std::string>>{
+            {"zadd", "bz", "1", "a", "2"},
+            {"zadd", "bz", "nx", "xx", "1", "a"},
+            {"zadd", "bz", "gt", "lt", "1", "a"},
+            {"zadd", "bz", "incr", "1", "a", "2", "b"},
+            {"zadd", "bz", "nan", "a"},
+            {"zadd", "bz", "nx"}}) {
+        buf_truncate(&out, 0);
+        assert(do_zadd(bad, out) == RES_ERR);
+    }
+    // a batch larger than Cmd's inline arguments, through the parser
+    std::vector<std::string> args = {"zadd", "bulk"};
+    for (int i = 0; i < 1000; ++i) {
+        args.push_back(std::to_string(i % 10));
+        args.push_back("k" + std::to_string(i));
+    }
+    std::string req;
+    uint32_t nargs = (uint32_t)args.size();
+    req.append((const char *)&nargs, 4);
+    for (const std::string &arg : args) {
+        uint32_t len = (uint32_t)arg.size();
+        req.append((const char *)&len, 4);
+        req += arg;
+    }
+    Cmd parsed;
+    assert(parse_req((const uint8_t *)req.data(), req.size(), parsed) == 0);
+    assert(parsed.size() == args.size() && parsed[2001] == "k999");
+    buf_truncate(&out, 0);
+    assert(do_request(parsed, out) == RES_OK && int_response(out_bytes(out)) == 1000);
+    buf_truncate(&out, 0);
+    cmd = {"zcount", "bulk", "3", "3"};
+    assert(do_zcount(cmd, out) == RES_OK && int_response(out_bytes(out)) == 100);
+    for (const char *key : {"bz", "bulk"}) {
+        cmd = {"del", key};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    std::cout << "  Zadd batch test passed!" << std::endl;
+}
+
+static void test_combine_done(void *arg) {
+    ((std::atomic<bool> *)arg)->store(true);
+}
+
+// Runs a ZCombine inline, or on `pool` while this thread waits
+static ZSet *test_combine(std::vector<ZSet *> &srcs, const double *weights, uint32_t agg, bool inter, ThreadPool *pool) {
+    ZCombine *zc = zcombine_new(srcs.data(), weights, srcs.size(), agg, inter);
+    if (!pool) {
+        zcombine_run(zc);
+    } else {
+        std::atomic<bool> done{false};
+        zcombine_start(zc, pool, test_combine_done, &done);
+        while (!done.load()) {
+            usleep(100);
+        }
+    }
+    ZSet *result = zcombine_result(zc);
+    zcombine_free(zc);
+    return result;
+}
+
+// Unions and intersections against std::map, inline and on a pool
+void test_zset_combine() {
+    std::cout << "Testing zset union and intersection..." << std::endl;
+    ThreadPool tp;
+    thread_pool_init(&tp, 3);
+    std::mt19937 rng(5);
+    std::vector<std::map<std::string, double>> refs(3);
+    std::vector<ZSet *> sets(3);
+    uint32_t sizes[3] = {40000, 100, 25000}; // indexed, small, indexed
+    for (size_t s = 0; s < 3; ++s) {
+        g_zset_index = s == 2 ? ZS_BTREE : ZS_AVL;
+        sets[s] = new ZSet();
+        while (refs[s].size() < sizes[s]) {
+            std::string name = "c" + std::to_string(rng() % 60000);
+            double score = (double)(rng() % 1000) - 500;
+            zset_add(sets[s], name.data(), name.size(), score);
+            refs[s][name] = score;
+        }
+    }
+    g_zset_index = ZS_AVL;
+    assert(!sets[0]->small && sets[1]->small);
+    double weights[4] = {2, -1, 0.5, 1};
+    for (bool inter : {false, true}) {
+        for (uint32_t agg : {(uint32_t)ZAGG_SUM, (uint32_t)ZAGG_MIN, (uint32_t)ZAGG_MAX}) {
+            // the third set twice, and a missing key for the unions
+            std::vector<size_t> pick = inter ? std::vector<size_t>{0, 2, 2} : std::vector<size_t>{0, 1, 2, 3};
+            std::vector<ZSet *> srcs;
+            std::map<std::string, std::pair<double, size_t>> want;
+            for (size_t k = 0; k < pick.size(); ++k) {
+                srcs.push_back(pick[k] < 3 ? sets[pick[k]] : NULL);
+                if (pick[k] == 3) continue;
+                for (auto &kv : refs[pick[k]]) {
+                    double score = kv.second * weights[k];
+                    auto it = want.find(kv.first);
+                    if (it == want.end()) {
+                        want[kv.first] = {score, 1};
+                        continue;
+                    }
+                    double &acc = it->second.first;
+                    acc = agg == ZAGG_SUM ? acc + score : agg == ZAGG_MIN ? std::min(acc, score) : std::max(acc, score);
+                    it->second.second++;
+                }
+            }
+            for (ThreadPool *pool : {(ThreadPool *)NULL, &tp}) {
+                ZSet *result = test_combine(srcs, weights, agg, inter, pool);
+                size_t expect = 0;
+                for (auto &kv : want) {
+                    if (inter && kv.second.second != pick.size()) {
+                        continue;
+                    }
+                    expect++;
+                    ZNode *node = zset_lookup(result, kv.first.data(), kv.first.size());
+                    assert(node && node->score == kv.second.first);
+                }
+                assert(zset_size(result) == expect);
+                delete result;
+            }
+        }
+    }
+    // the sources are copied up front and may change while it runs
+    ZCombine *zc = zcombine_new(&sets[1], weights, 1, ZAGG_SUM, false);
+    ZNode *node = zset_nth(sets[1], 0);
+    std::string name(node->name, node->len);
+    double score = node->score;
+    zset_add(sets[1], name.data(), name.size(), score + 1000);
+    zset_add(sets[1], "fresh", 5, 1);
+    zcombine_run(zc);
+    ZSet *result = zcombine_result(zc);
+    zcombine_free(zc);
+    assert(zset_size(result) == refs[1].size() && !zset_lookup(result, "fresh", 5));
+    assert(zset_lookup(result, name.data(), name.size())->score == 2 * score);
+    delete result;
+    for (ZSet *zset : sets) {
+        delete zset;
+    }
+
+    // command level, with the destination among the sources
+    Buffer out;
+    std::vector<std::string> cmd = {"zadd", "ua", "1", "a", "2", "b", "3", "c"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    cmd = {"zadd", "ub", "10", "b", "20", "c", "30", "d"};
+    assert(do_zadd(cmd, out) == RES_OK);
+    buf_truncate(&out, 0);
+    cmd = {"zunionstore", "ua", "3", "ua", "ub", "nokey", "weights", "1", "2", "5", "aggregate", "max"};
+    assert(do_request(cmd, out) == RES_OK && int_response(out_bytes(out)) == 4);
+    buf_truncate(&out, 0);
+    cmd = {"zscore", "ua", "c"};
+    assert(do_zscore(cmd, out) == RES_OK);
+    assert_dbl_response(out_bytes(out), 40);
+    buf_truncate(&out, 0);
+    cmd = {"zinterstore", "ui", "2", "ua", "ub"};
+    assert(do_request(cmd, out) == RES_OK && int_response(out_bytes(out)) == 3);
+    buf_truncate(&out, 0);
+    cmd = {"zscore", "ui", "d"};
+    assert(do_zscore(cmd, out) == RES_OK);
+    assert_dbl_response(out_bytes(out), 90);
+    // an empty result drops the destination
+    buf_truncate(&out, 0);
+    cmd = {"zinterstore", "ui", "2", "ua", "nokey"};
+    assert(do_request(cmd, out) == RES_OK && int_response(out_bytes(out)) == 0);
+    buf_truncate(&out, 0);
+    cmd = {"zscore", "ui", "d"};
+    assert(do_zscore(cmd, out) == RES_NX);
+    cmd = {"set", "str", "x"};
+    assert(do_set(cmd, out) == RES_OK);
+    for (std::vector<std::string> bad : std::vector<std::vector<std::string>>{
+            {"zunionstore", "d", "0", "ua"},
+            {"zunionstore", "d", "3", "ua", "ub"},
+            {"zunionstore", "d", "2", "ua", "ub", "weights", "1"},
+            {"zunionstore", "d", "1", "ua", "aggregate", "avg"},
+            {"zinterstore", "d", "2", "ua", "str"}}) {
+        buf_truncate(&out, 0);
+        assert(do_request(bad, out) == RES_ERR);
+    }
+    for (const char *key : {"ua", "ub", "str"}) {
+        cmd = {"del", key};
+        assert(do_del(cmd, out) == RES_OK);
+    }
+    std::cout << "  Zset union and intersection test passed!" << std::endl;
+}
+
 int main() {
     test_set_get_del_keys();
     test_zset();
     test_edge_cases();
+    test_command_table();
     test_timer_basics();
+    test_buffer();
+    test_pipelining();
+    test_conn_pool();
+    test_parked_close();
+    test_remote_get_batch();
+    test_out_writer();
+    test_log();
+    test_hmap_engines();
+    test_str_hash();
+    test_hmap_shrink();
+    test_scan();
+    test_entry_layout();
+    test_find_or_insert();
+    test_lookup_batch();
+    test_cmap();
+    for (uint32_t index : {ZS_AVL, ZS_BTREE}) {
+        g_zset_index = index;
+        test_zset_rank();
+        test_zset_range();
+    }
+    g_zset_index = ZS_AVL;
+    // the same with sets that never leave the small encoding
+    g_zset_small_max = 1u << 20;
+    test_zset_rank();
+    test_zset_range();
+    g_zset_small_max = 128;
+    test_zset_btree();
+    test_zset_small();
+    test_zset_arena();
+    test_zadd_batch();
+    test_zset_combine();
     std::cout << "All tests passed!\n";
     return 0;
 } 
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include <sys/types.h>  // for ssize_t
 #include <vector>
 #include <deque>
+#include <pthread.h>
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
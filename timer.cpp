@@ -14,8 +14,10 @@
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
 #include "timer.h"
+#include "log.h"
 #include "DList.h"
 #include "common.h"
+#include "utils.h"
 
 uint64_t get_monotonic_usec() {
     timespec tv = {0, 0};
@@ -44,18 +46,17 @@ void process_timers() {
         if (next_us > now_us) {
             break;
         }
-        printf("removing idle connection: %d\n",next->fd);
-        g_data.fd2conn[next->fd] = NULL;
-        (void)close(next->fd); // Close the socket
-        dlist_detach(&next->idle_list);
-        free(next); // Free the memory
+        LOG(LOG_INFO, "removing idle connection: %lld", next->fd);
+        conn_destroy(next);
     }
     const size_t k_max_works = 2000;
     size_t nworks = 0;
     while (!g_data.heap.empty() && g_data.heap[0].val < now_us) {
         Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
         // Remove from hash table
-        HNode *node = hm_delete(&g_data.db, &ent->node);
+        cm_write_begin(&g_data.db, ent->node.hcode);
+        HNode *node = hm_delete(cm_stripe(&g_data.db, ent->node.hcode), &ent->node, entry_eq);
+        cm_write_end(&g_data.db, ent->node.hcode);
         assert(node == &ent->node);
         // Remove from heap
         size_t pos = ent->heap_idx;
@@ -0,0 +1,405 @@
+#include <cstdio>        // for printf, perror
+#include <cstdlib>       // for exit
+#include <cstring>       // for memset, strlen
+#include <unistd.h>      // for read, write, close
+#include <sys/socket.h>  // for socket, setsockopt, bind, listen, accept
+#include <netinet/in.h>  // for sockaddr_in, htons, htonl
+#include <cassert>       // for assert
+#include <cstdint>       // for uint32_t
+#include <sys/types.h>  // for ssize_t
+#include <cerrno>
+#include <vector>
+#include "uring.h"
+#include "common.h"
+#include "utils.h"
+#include "timer.h"
+#include "shard.h"
+#include "log.h"
+
+bool g_use_uring = false;
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// Multishot recv and SINGLE_ISSUER (our feature gate) both need Linux 6.0
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT) && defined(IORING_SETUP_SINGLE_ISSUER)
+#include <sys/mman.h>     // for mmap
+#include <sys/syscall.h>  // for SYS_io_uring_setup, SYS_io_uring_enter
+#include <poll.h>         // for POLLIN
+#include <poll.h>         // for POLLIN
+
+const unsigned k_uring_entries = 1024;
+const unsigned k_uring_nbufs = 512;        // provided recv buffers
+const size_t k_uring_buf_size = 16 * 1024;
+const uint16_t k_uring_bgid = 0;
+
+enum {
+    UOP_ACCEPT = 1,
+    UOP_RECV = 2,
+    UOP_SEND = 3,
+    UOP_WAKE = 4,
+    UOP_PROVIDE = 5,
+};
+
+struct Uring {
+    int fd = -1;
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local = 0;   // our tail, published on submit
+    unsigned sq_flushed = 0; // tail the kernel has been told about
+    io_uring_sqe *sqes = NULL;
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = NULL;
+    // recv buffers handed to the kernel; it picks one per completion
+    uint8_t *bufs = NULL;
+    uint32_t next_gen = 0;
+};
+
+// user_data: op in the top byte, Conn generation, then the fd
+static uint64_t uring_tag(uint32_t op, uint32_t gen, int fd) {
+    return ((uint64_t)op << 56) | ((uint64_t)(gen & 0xffffff) << 32) | (uint32_t)fd;
+}
+
+static int sys_uring_setup(unsigned entries, io_uring_params *p) {
+    return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+static int sys_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                           void *arg, size_t argsz) {
+    return (int)syscall(SYS_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static bool uring_init(Uring *r) {
+    io_uring_params p = {};
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * k_uring_entries;
+    r->fd = sys_uring_setup(k_uring_entries, &p);
+    if (r->fd < 0) {
+        perror("io_uring_setup()");
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        close(r->fd);
+        return false;
+    }
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    uint8_t *ring = (uint8_t *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        perror("mmap(io_uring)");
+        close(r->fd);
+        return false;
+    }
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = r->sq_flushed = *r->sq_tail;
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i; // SQE slots are used in ring order
+    }
+    r->sqes = (io_uring_sqe *)sqes;
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    r->bufs = (uint8_t *)malloc(k_uring_nbufs * k_uring_buf_size);
+    if (!r->bufs) {
+        perror("malloc()");
+        close(r->fd);
+        return false;
+    }
+    return true;
+}
+
+// Submit everything queued and wait up to timeout_ms for a completion
+static void uring_submit_and_wait(Uring *r, int timeout_ms) {
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    unsigned to_submit = r->sq_local - r->sq_flushed;
+    r->sq_flushed = r->sq_local;
+    __kernel_timespec ts = {};
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg = {};
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned wait = 0;
+    if (timeout_ms != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        wait = 1;
+    }
+    int rv = sys_uring_enter(r->fd, to_submit, wait, flags, &arg, sizeof(arg));
+    if (rv < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        die("io_uring_enter()");
+    }
+}
+
+static io_uring_sqe *uring_sqe(Uring *r) {
+    if (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uring_submit_and_wait(r, 0); // SQ full: flush what we have
+    }
+    io_uring_sqe *sqe = &r->sqes[r->sq_local & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local++;
+    return sqe;
+}
+
+// Hand nbufs recv buffers starting at bid to the kernel. These go through
+// IORING_OP_PROVIDE_BUFFERS rather than a registered buffer ring: the ring
+// variant is newer and not reliably usable on every kernel that has
+// multishot recv. The SQE rides along with the next batch at no extra cost.
+static void uring_provide(Uring *r, uint16_t bid, unsigned nbufs) {
+    io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)nbufs;
+    sqe->addr = (uint64_t)(uintptr_t)(r->bufs + bid * k_uring_buf_size);
+    sqe->len = (uint32_t)k_uring_buf_size;
+    sqe->off = bid;
+    sqe->buf_group = k_uring_bgid;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = uring_tag(UOP_PROVIDE, 0, 0);
+}
+
+static void uring_arm_accept(Uring *r, int fd) {
+    io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_tag(UOP_ACCEPT, 0, fd);
+}
+
+static void uring_arm_wake(Uring *r, int fd) {
+    io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring_tag(UOP_WAKE, 0, fd);
+}
+
+static void uring_arm_recv(Uring *r, Conn *conn) {
+    io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = k_uring_bgid;
+    sqe->user_data = uring_tag(UOP_RECV, conn->gen, conn->fd);
+    conn->recv_armed = true;
+}
+
+// Start a send of the queued replies unless one is already in flight. The
+// in-flight bytes move to sbuf so new replies can keep appending to wbuf.
+static void uring_kick_send(Uring *r, Conn *conn) {
+    if (conn->closing || buf_len(&conn->sbuf) > 0 || buf_len(&conn->wbuf) == 0) {
+        return;
+    }
+    Buffer tmp = conn->sbuf;
+    conn->sbuf = conn->wbuf;
+    conn->wbuf = tmp;
+    io_uring_sqe *sqe = uring_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf_begin(&conn->sbuf);
+    sqe->len = (uint32_t)buf_len(&conn->sbuf);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = uring_tag(UOP_SEND, conn->gen, conn->fd);
+}
+
+static Conn *uring_conn(uint64_t tag) {
+    int fd = (int)(uint32_t)tag;
+    uint32_t gen = (uint32_t)(tag >> 32) & 0xffffff;
+    if (fd < 0 || fd >= (int)g_data.fd2conn.size()) {
+        return NULL;
+    }
+    Conn *conn = g_data.fd2conn[fd];
+    return (conn && (conn->gen & 0xffffff) == gen) ? conn : NULL;
+}
+
+static void uring_touch(Conn *conn) {
+    conn->idle_start = get_monotonic_usec();
+    dlist_detach(&conn->idle_list);
+    list_insert_before(&g_data.idle_list, &conn->idle_list);
+}
+
+// Run whatever is complete in rbuf and get the replies moving
+static void uring_process(Uring *r, Conn *conn) {
+    if (conn->state == STATE_REQ || conn->state == STATE_RES) {
+        while (one_request(conn)) {}
+    }
+    if (conn->state != STATE_END) {
+        uring_kick_send(r, conn);
+        conn_trim(conn);
+    }
+}
+
+static void uring_on_accept(Uring *r, io_uring_cqe *cqe, int listen_fd) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(r, listen_fd); // multishot ended, re-arm
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EAGAIN && cqe->res != -ECANCELED) {
+            LOG(LOG_WARN, "accept(): errno %lld", -cqe->res);
+        }
+        return;
+    }
+    Conn *conn = conn_new(cqe->res, g_data.fd2conn);
+    if (!conn) {
+        return;
+    }
+    conn->gen = ++r->next_gen;
+    uring_arm_recv(r, conn);
+}
+
+static void uring_on_recv(Uring *r, io_uring_cqe *cqe) {
+    Conn *conn = uring_conn(cqe->user_data);
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (conn && cqe->res > 0) {
+            // requests stall behind unsent replies, so leave rbuf some slack
+            size_t limit = 4 + g_max_msg + k_uring_buf_size * 16;
+            if (!buf_append(&conn->rbuf, r->bufs + bid * k_uring_buf_size,
+                            (size_t)cqe->res, limit)) {
+                conn_fail(conn); // not reading its replies
+            }
+        }
+        uring_provide(r, bid, 1); // recycle it
+    }
+    if (!conn) {
+        return; // completion for a connection that is gone
+    }
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        conn_fail(conn); // EOF or error
+    } else if (!more) {
+        conn->recv_armed = false;
+    }
+    if (conn->state != STATE_END && conn->state != STATE_WAIT) {
+        uring_touch(conn);
+        uring_process(r, conn);
+    }
+    if (conn->state == STATE_END) {
+        conn_destroy(conn);
+    } else if (!conn->recv_armed && !conn->closing) {
+        uring_arm_recv(r, conn);
+    }
+}
+
+static void uring_on_send(Uring *r, io_uring_cqe *cqe) {
+    Conn *conn = uring_conn(cqe->user_data);
+    if (!conn) {
+        return;
+    }
+    if (cqe->res < 0) {
+        // a parked Conn is only flagged; uring_on_wake() destroys it
+        conn_fail(conn);
+        if (conn->state == STATE_END) {
+            conn_destroy(conn);
+        }
+        return;
+    }
+    buf_consume(&conn->sbuf, (size_t)cqe->res);
+    if (buf_len(&conn->sbuf) > 0 && !conn->closing) {
+        // short send: push the rest of the same bytes
+        io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf_begin(&conn->sbuf);
+        sqe->len = (uint32_t)buf_len(&conn->sbuf);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(UOP_SEND, conn->gen, conn->fd);
+        return;
+    }
+    if (conn->state == STATE_RES && !conn_pending_output(conn)) {
+        conn->state = STATE_REQ;
+    }
+    // requests may have stalled on the wbuf high-water mark
+    uring_process(r, conn);
+    if (conn->state == STATE_END) {
+        conn_destroy(conn);
+    }
+}
+
+static void uring_on_wake(Uring *r, io_uring_cqe *cqe, int wake_fd) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_wake(r, wake_fd);
+    }
+    static thread_local std::vector<Conn *> resumed;
+    resumed.clear();
+    shard_drain(resumed);
+    for (Conn *conn : resumed) {
+        if (conn->state == STATE_END) {
+            conn_destroy(conn);
+        } else {
+            uring_kick_send(r, conn);
+        }
+    }
+}
+
+bool uring_event_loop(int listen_fd) {
+    Uring *r = new Uring();
+    if (!uring_init(r)) {
+        delete r;
+        fprintf(stderr, "io_uring unavailable, falling back to epoll\n");
+        return false;
+    }
+    g_data.uring = true;
+    uring_provide(r, 0, k_uring_nbufs);
+    uring_arm_accept(r, listen_fd);
+    int wake_fd = -1;
+    if (!g_shards.empty()) {
+        wake_fd = g_shards[g_shard_id]->wake_rfd;
+        uring_arm_wake(r, wake_fd);
+    }
+    while (true) {
+        // one io_uring_enter() submits every send queued last round
+        uring_submit_and_wait(r, (int)next_timer_ms());
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            switch (cqe->user_data >> 56) {
+            case UOP_ACCEPT:
+                uring_on_accept(r, cqe, listen_fd);
+                break;
+            case UOP_RECV:
+                uring_on_recv(r, cqe);
+                break;
+            case UOP_SEND:
+                uring_on_send(r, cqe);
+                break;
+            case UOP_WAKE:
+                uring_on_wake(r, cqe, wake_fd);
+                break;
+            case UOP_PROVIDE:
+                die("io_uring: provide buffers"); // only failures post a CQE
+                break;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        // Process idle timeouts
+        process_timers();
+    }
+    return true;
+}
+
+#else
+
+bool uring_event_loop(int listen_fd) {
+    (void)listen_fd;
+    fprintf(stderr, "built without io_uring support, using the default loop\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstdint>       // for uint32_t
+
+// Set by --io-uring; each event loop then tries the io_uring backend
+extern bool g_use_uring;
+
+// Runs the calling thread's event loop on io_uring: multishot accept,
+// multishot recv into provided buffers, and sends batched into one
+// io_uring_enter() per iteration. Returns false right away if the kernel
+// (or the build) lacks what it needs, so the caller can use epoll instead.
+bool uring_event_loop(int listen_fd);
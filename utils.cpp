@@ -16,6 +16,9 @@
 #include <sys/select.h>
 #include "serialisation.h"
 #include "timer.h"
+#include "utils.h"
+#include "log.h"
+#include "shard.h"
 #define ERR_2BIG 1001
 
 void fd_set_nb(int fd) {
@@ -32,111 +35,365 @@ void fd_set_nb(int fd) {
         die("fcntl error");
     }
 }
+// Stop running requests while this much output is still unsent
+const size_t k_wbuf_highwater = 64 * 1024;
+
+// One write() of everything queued in wbuf. Returns true if any bytes left.
 bool try_flush_buffer(Conn *conn) {
+    if (buf_len(&conn->wbuf) == 0) {
+        return false; // nothing queued
+    }
     ssize_t rv;
     do {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        rv = write(conn->fd, buf_begin(&conn->wbuf), buf_len(&conn->wbuf));
     } while (rv < 0 && errno == EINTR);
     if (rv < 0 && errno == EAGAIN) {
-        return false; // No space available, return false to indicate no more space
+        return false; // No space available, wait for EPOLLOUT
 
     }
     if (rv < 0) {
-        perror("write()");
-        conn->state = STATE_END; // Mark the connection for deletion
+        LOG(LOG_WARN, "write(): fd %lld, errno %lld", conn->fd, errno);
+        conn_fail(conn); // Mark the connection for deletion
         return false; // Indicate an error
     }
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size) {
-        conn->state = STATE_REQ; // Transition back to request state
-        conn->wbuf_size = 0; // Reset the write buffer size
-        conn->wbuf_sent = 0; // Reset the write buffer sent size
+    buf_consume(&conn->wbuf, (size_t)rv);
+    if (buf_len(&conn->wbuf) == 0) {
+        if (conn->state == STATE_RES) {
+            conn->state = STATE_REQ; // Nothing left to send
+        }
+        buf_shrink(&conn->wbuf);
+    }
+    return true;
+}
+
+// Reserve a frame header in wbuf; the reply is serialized right behind it
+static size_t reply_begin(Conn *conn) {
+    size_t hdr = buf_len(&conn->wbuf);
+    uint32_t wlen = 0;
+    if (!buf_append(&conn->wbuf, &wlen, 4, SIZE_MAX)) {
+        die("out of memory");
+    }
+    return hdr;
+}
+
+// Finish the reply started at `hdr` by filling in its length; it goes out
+// with the next flush
+static void reply_end(Conn *conn, size_t hdr, int32_t err) {
+    Buffer *wbuf = &conn->wbuf;
+    if (err != RES_OK) {
+        LOG(LOG_DEBUG, "error in request processing: fd %lld, err %lld", conn->fd, err);
+        buf_truncate(wbuf, hdr);
+        conn->state = STATE_END; // Mark the connection for deletion
+        return;
+    }
+    if (buf_len(wbuf) - hdr - 4 > g_max_msg) {
+        buf_truncate(wbuf, hdr + 4);
+        out_err(*wbuf, ERR_2BIG, "response is too big");
+    }
+    uint32_t wlen = (uint32_t)(buf_len(wbuf) - hdr - 4);
+    memcpy(buf_begin(wbuf) + hdr, &wlen, 4);
+    conn->state = STATE_RES;
+}
+
+// The key of a well-formed two-argument GET, read straight from the
+// request bytes; anything else is left for parse_req() to take apart
+static bool req_get_key(const uint8_t *data, size_t len, std::string_view &key) {
+    const size_t k_get_hdr = 4 + 4 + 3 + 4; // argc, "get", key length
+    if (len < k_get_hdr) {
         return false;
     }
+    uint32_t argc = 0;
+    uint32_t arg_len = 0;
+    memcpy(&argc, data, 4);
+    memcpy(&arg_len, data + 4, 4);
+    if (argc != 2 || arg_len != 3 || memcmp(data + 8, "get", 3) != 0) {
+        return false;
+    }
+    memcpy(&arg_len, data + 11, 4);
+    if (k_get_hdr + (size_t)arg_len != len) {
+        return false;
+    }
+    key = std::string_view((const char *)data + k_get_hdr, arg_len);
     return true;
 }
-void stateres(Conn *conn) {
-    while (try_flush_buffer(conn)){}
+
+// A run of pipelined GETs at the head of rbuf is looked up in one batch
+// so the cache misses of its keys overlap; keys of other loops are read
+// in their keyspaces on the way. Returns how many requests were answered;
+// 0 leaves the head request to the general path.
+static size_t get_batch(Conn *conn) {
+    std::string_view keys[k_lookup_batch];
+    size_t owners[k_lookup_batch];
+    size_t ends[k_lookup_batch]; // rbuf offset past each request
+    size_t end = 0;
+    size_t n = 0;
+    const uint8_t *data = buf_begin(&conn->rbuf);
+    size_t avail = buf_len(&conn->rbuf);
+    while (n < k_lookup_batch && avail - end >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, data + end, 4);
+        if (len > g_max_msg || 4 + (size_t)len > avail - end) {
+            break;
+        }
+        // only the GET check here; other requests are parsed once, later
+        if (!req_get_key(data + end + 4, len, keys[n])) {
+            break;
+        }
+        size_t owner = g_shards.size() > 1 ? shard_of(keys[n]) : g_shard_id;
+        if (owner != g_shard_id && !shard_db(owner)) {
+            break; // forwarded by shard_dispatch until that loop is up
+        }
+        end += 4 + len;
+        owners[n] = owner;
+        ends[n++] = end;
+    }
+    if (n < 2) {
+        return 0;
+    }
+    LOG(LOG_DEBUG, "get batch: fd %lld, %llu requests", conn->fd, n);
+    std::string_view local[k_lookup_batch];
+    size_t nlocal = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (owners[i] == g_shard_id) {
+            local[nlocal++] = keys[i];
+        }
+    }
+    HNode *found[k_lookup_batch];
+    db_lookup_batch(local, nlocal, found);
+    size_t done = 0;
+    nlocal = 0;
+    while (done < n && conn->state != STATE_END) {
+        size_t hdr = reply_begin(conn);
+        int32_t err = owners[done] == g_shard_id
+            ? do_get_node(found[nlocal++], conn->wbuf)
+            : do_get_remote(owners[done], keys[done], conn->wbuf);
+        reply_end(conn, hdr, err);
+        done++;
+    }
+    buf_consume(&conn->rbuf, ends[done - 1]);
+    return done;
 }
 
 bool one_request(Conn *conn) {
+    if (buf_len(&conn->wbuf) >= k_wbuf_highwater) {
+        // Let the client catch up on replies before running more
+        return false;
+    }
+    if (get_batch(conn)) {
+        return conn->state == STATE_RES;
+    }
     // Try to parse a request from the buffer
-    if (conn->rbuf_size < 4) {
+    if (buf_len(&conn->rbuf) < 4) {
         // Not enough data in the buffer. Will retry in the next iteration
         return false;
     }
     uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4);
-    if (len > k_max_msg) {
-        printf("too long");
+    memcpy(&len, buf_begin(&conn->rbuf), 4);
+    if (len > g_max_msg) {
+        LOG(LOG_WARN, "request too long: fd %lld, %llu bytes", conn->fd, len);
         conn->state = STATE_END;
         return false;
     }
-    if (4 + len > conn->rbuf_size) {
+    if (4 + len > buf_len(&conn->rbuf)) {
         return false;
     }
-    std::vector<std::string> cmd;
-    if (0!=parse_req(&conn->rbuf[4],len, cmd)){
+    const uint8_t *req = buf_begin(&conn->rbuf) + 4;
+    Cmd cmd; // views into rbuf, valid until buf_consume() below
+    if (0!=parse_req(req, len, cmd)){
         conn->state = STATE_END;
         return false;
     }
-    std::string out;
-    int32_t err = do_request(cmd, out);
-    if (err != RES_OK) {
-        printf("error in request processing");
-        conn->state = STATE_END; // Mark the connection for deletion
-        return false; // Indicate an error
-    }
-    if (4+out.size() > k_max_msg) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+    LOG(LOG_DEBUG, "request: fd %lld, %llu bytes, %llu args", conn->fd, len, cmd.size());
+    bool parked = shard_dispatch(conn, cmd);
+    if (!parked) {
+        size_t hdr = reply_begin(conn);
+        // heavy commands go to the thread pool, with the client parked
+        ShardJob *job = NULL;
+        int32_t err = do_request(cmd, conn->wbuf, g_shards.empty() ? NULL : &job);
+        if (job) {
+            buf_truncate(&conn->wbuf, hdr); // the job brings the reply
+            shard_job_park(conn, job);
+            parked = true;
+        } else {
+            reply_end(conn, hdr, err);
+        }
     }
-    uint32_t wlen = (uint32_t)out.size();
-
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    // Write response code
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    // Write response data (if any)
-    conn->wbuf_size = 4 + wlen; 
-    printf("client says: %.*s\n", len, &conn->rbuf[4]);
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain) {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
-    }
-    conn->rbuf_size = remain;
-    conn->state = STATE_RES;
-    stateres(conn);
-    return (conn->state == STATE_REQ);
+    buf_consume(&conn->rbuf, 4 + len);
+    return !parked && (conn->state == STATE_RES);
 }
 
-
+// One read() into rbuf. Returns true if any bytes arrived.
 bool try_fill_buffer(Conn *conn) {
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    // Room for a whole request once its header is in, else a small chunk
+    size_t want = k_buf_init;
+    size_t have = buf_len(&conn->rbuf);
+    if (have >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, buf_begin(&conn->rbuf), 4);
+        if (4 + (size_t)len > have + want) {
+            want = 4 + (size_t)len - have;
+        }
+    }
+    if (!buf_reserve(&conn->rbuf, want, 4 + g_max_msg)
+        && !buf_reserve(&conn->rbuf, 1, 4 + g_max_msg)) {
+        return false; // full; one_request rejects oversized requests
+    }
     ssize_t rv =0;
     do {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size],cap);
+        rv = read(conn->fd, buf_end(&conn->rbuf), buf_room(&conn->rbuf));
     } while (rv < 0 && errno == EINTR);
     if (rv<0 and errno == EAGAIN) {
         return false; // No data available, return false to indicate no more data
     }
-    if (rv<=0) {
-        perror("read()");
+    if (rv == 0) {
+        LOG(LOG_DEBUG, "EOF: fd %lld", conn->fd);
+        conn->state = STATE_END; // Client closed the connection
+        return false;
+    }
+    if (rv < 0) {
+        LOG(LOG_WARN, "read(): fd %lld, errno %lld", conn->fd, errno);
         conn->state = STATE_END; // Mark the connection for deletion
         return false; // Indicate an error
     }
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
-    while (one_request(conn)) {
-        // Process the request
+    conn->rbuf.tail += (size_t)rv;
+    return true;
+}
+
+// Drain the socket, run every complete request and queue the replies, then
+// send them together. Reading goes on while earlier replies are unsent;
+// requests only stall once wbuf passes the high-water mark.
+static void conn_pump(Conn *conn) {
+    while (conn->state == STATE_REQ || conn->state == STATE_RES) {
+        while (one_request(conn)) {}
+        if (conn->state != STATE_REQ && conn->state != STATE_RES) {
+            break;
+        }
+        bool progress = false;
+        if (buf_len(&conn->wbuf) < k_wbuf_highwater) {
+            progress = try_fill_buffer(conn);
+        }
+        if (!progress) {
+            // socket drained (or we are backed up): flush the coalesced replies
+            progress = try_flush_buffer(conn);
+        }
+        if (!progress) {
+            break;
+        }
+    }
+    if (conn->state == STATE_WAIT && !conn->closing) {
+        // replies queued ahead of the forwarded command can still go out
+        try_flush_buffer(conn);
+    }
+    conn_trim(conn);
+}
+
+// Deliver the reply of a forwarded command and pick up where we left off
+void conn_resume(Conn *conn, int32_t err, Buffer &out) {
+    assert(conn->state == STATE_WAIT);
+    if (conn->closing) {
+        conn->state = STATE_END; // the peer is gone; drop the reply
+        return;
+    }
+    conn->idle_start = get_monotonic_usec();
+    list_insert_before(&g_data.idle_list, &conn->idle_list);
+    conn->state = conn_pending_output(conn) ? STATE_RES : STATE_REQ;
+    size_t hdr = reply_begin(conn);
+    if (!buf_append(&conn->wbuf, buf_begin(&out), buf_len(&out), SIZE_MAX)) {
+        die("out of memory");
+    }
+    reply_end(conn, hdr, err);
+    if (g_data.uring) {
+        // completions drive the socket; just run what is already buffered
+        while (one_request(conn)) {}
+        return;
+    }
+    // the socket may also hold data we stopped reading when we parked
+    conn_pump(conn);
+}
+
+bool conn_pending_output(Conn *conn) {
+    return buf_len(&conn->wbuf) > 0 || buf_len(&conn->sbuf) > 0;
+}
+
+// The socket is drained and the client owes us the next request: empty
+// buffers go back to their first size, so idle connections stay small.
+// Buffers still holding bytes keep their memory.
+void conn_trim(Conn *conn) {
+    buf_trim(&conn->rbuf);
+    buf_trim(&conn->wbuf);
+    buf_trim(&conn->sbuf); // empty means no send in flight
+}
+
+// Keep a buffer's first allocation for the next owner; there is no need
+// to zero it.
+static void buf_recycle(Buffer *buf) {
+    buf->head = buf->tail = 0;
+    buf_trim(buf);
+}
+
+Conn *conn_new(int fd, std::vector<Conn *> &fd2conn) {
+    ConnPool &pool = g_data.conn_pool;
+    Conn *conn = NULL;
+    if (!pool.free_conns.empty()) {
+        conn = pool.free_conns.back();
+        pool.free_conns.pop_back();
+        pool.reuses++;
+    } else {
+        conn = (Conn *)malloc(sizeof(Conn));
+        if (!conn) {
+            perror("malloc()");
+            close(fd);
+            return NULL;
+        }
+        // Initialize the connection structure
+        memset(conn, 0, sizeof(Conn));
+        pool.allocs++;
+    }
+    // buffers come back empty; reset everything else
+    conn->fd = fd;
+    conn->state = STATE_REQ;
+    conn->recv_armed = false;
+    conn->closing = false;
+    conn->idle_start = get_monotonic_usec();
+
+    // Initialize the idle_list before inserting it
+    dList_init(&conn->idle_list);
+    list_insert_before(&g_data.idle_list, &conn->idle_list);
+    conn_put(fd2conn, conn);
+    return conn;
+}
+
+void conn_destroy(Conn *conn) {
+    g_data.fd2conn[conn->fd] = NULL;
+    // close() alone would not end io_uring operations holding the socket
+    (void)shutdown(conn->fd, SHUT_RDWR);
+    (void)close(conn->fd); // also drops it from the epoll set
+    dlist_detach(&conn->idle_list);
+    conn->fd = -1;
+    ConnPool &pool = g_data.conn_pool;
+    if (pool.free_conns.size() >= k_conn_pool_max) {
+        buf_free(&conn->rbuf);
+        buf_free(&conn->wbuf);
+        buf_free(&conn->sbuf);
+        free(conn);
+        pool.drops++;
+        return;
     }
-    return (conn->state==STATE_REQ); // Return true if still in request state
+    buf_recycle(&conn->rbuf);
+    buf_recycle(&conn->wbuf);
+    buf_recycle(&conn->sbuf);
+    pool.free_conns.push_back(conn);
+    pool.releases++;
 }
 
-void statereq(Conn *conn) {
-    while (try_fill_buffer(conn)){}
+// A failed connection normally ends now, but a parked one must outlive
+// the forwarded command; conn_resume() ends it when the reply arrives.
+void conn_fail(Conn *conn) {
+    if (conn->state == STATE_WAIT) {
+        conn->closing = true;
+    } else {
+        conn->state = STATE_END;
+    }
 }
 
 void conn_put(std::vector<Conn *> &fd2conn, Conn *conn) {
@@ -151,26 +408,99 @@ void conn_put(std::vector<Conn *> &fd2conn, Conn *conn) {
 
 
 void connection_io(Conn *conn){
+    if (conn->state == STATE_WAIT) {
+        // parked on a forwarded command; only earlier replies may move
+        if (!conn->closing) {
+            try_flush_buffer(conn);
+        }
+        return;
+    }
     conn->idle_start = get_monotonic_usec();
     dlist_detach(&conn->idle_list);
     list_insert_before(&g_data.idle_list, &conn->idle_list);
-    if (conn->state == STATE_REQ){
-        statereq(conn);
-    }
-    else if (conn->state == STATE_RES){
-        stateres(conn);
-    }
-    else {
-        assert(0);
+    conn_pump(conn);
+}
+
+// Keyed, word-at-a-time string hash in the style of wyhash: 64x64->128
+// bit multiplies fold 16 bytes per step (48 in the bulk loop). The seed
+// is random per process, so clients cannot precompute colliding keys.
+// Hash values are not stable across restarts and must not be persisted.
+
+const uint64_t k_hash_p0 = 0xa0761d6478bd642full;
+const uint64_t k_hash_p1 = 0xe7037ed1a0b428dbull;
+const uint64_t k_hash_p2 = 0x8ebc6af09c88c6e3ull;
+const uint64_t k_hash_p3 = 0x589965cc75374cc3ull;
+
+static uint64_t hash_mum(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// unaligned little-endian loads; the byte order only changes the values
+static uint64_t hash_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+static uint64_t hash_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t hash_seed_init() {
+    uint64_t seed = 0;
+#if defined(__APPLE__)
+    arc4random_buf(&seed, sizeof(seed));
+#else
+    if (getentropy(&seed, sizeof(seed)) != 0) {
+        seed = get_monotonic_usec() ^ ((uint64_t)getpid() << 32);
     }
+#endif
+    return seed ^ hash_mum(seed ^ k_hash_p0, k_hash_p1);
 }
 
+// Set before main(), so every event loop hashes (and shards) the same way
+static const uint64_t g_hash_seed = hash_seed_init();
+
 uint64_t str_hash(const uint8_t* data, size_t len) {
-    uint64_t hash = 14695981039346656037ULL;
-    for (size_t i = 0; i < len; ++i) {
-        hash ^= data[i];
-        hash *= 1099511628211ULL;
+    const uint8_t *p = data;
+    uint64_t seed = g_hash_seed;
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            // two overlapping 4-byte reads from each end cover 4..16 bytes
+            size_t mid = (len >> 3) << 2;
+            a = (hash_r4(p) << 32) | hash_r4(p + mid);
+            b = (hash_r4(p + len - 4) << 32) | hash_r4(p + len - 4 - mid);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = hash_mum(hash_r8(p) ^ k_hash_p1, hash_r8(p + 8) ^ seed);
+                s1 = hash_mum(hash_r8(p + 16) ^ k_hash_p2, hash_r8(p + 24) ^ s1);
+                s2 = hash_mum(hash_r8(p + 32) ^ k_hash_p3, hash_r8(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16) {
+            seed = hash_mum(hash_r8(p) ^ k_hash_p1, hash_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes, overlapping what was already mixed
+        a = hash_r8(p + i - 16);
+        b = hash_r8(p + i - 8);
     }
-    return hash;
+    __uint128_t r = (__uint128_t)(a ^ k_hash_p1) * (b ^ seed);
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mum(a ^ k_hash_p0 ^ len, b ^ k_hash_p1);
 }
 
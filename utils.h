@@ -8,9 +8,13 @@ struct Conn;
 
 void fd_set_nb(int fd);
 bool try_flush_buffer(Conn *conn);
-void stateres(Conn *conn);
-void statereq(Conn *conn);
 bool one_request(Conn *conn);
+bool conn_pending_output(Conn *conn);
+Conn *conn_new(int fd, std::vector<Conn *> &fd2conn);
+void conn_destroy(Conn *conn);
+void conn_fail(Conn *conn);
+void conn_trim(Conn *conn);
+void conn_resume(Conn *conn, int32_t err, Buffer &out);
 bool try_fill_buffer(Conn *conn);
 void connection_io(Conn *conn);
 uint64_t str_hash(const uint8_t* data, size_t len);
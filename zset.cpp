@@ -11,41 +11,224 @@
 #include <arpa/inet.h>   // for inet_ntop (if needed)
 #include <sys/types.h>  // for ssize_t
 #include <vector>
+#include <algorithm>     // for std::lower_bound, std::max, std::sort
+#include <new>           // for placement new
+#include <cmath>         // for std::isnan
+#include <atomic>
+#include <string>
 #include <poll.h>        // for poll
 #include <fcntl.h>       // for fcntl, O_NONBLOCK
 #include <sys/select.h>
 #include "AVL.h"
+#include "btree.h"
 #include "utils.h"
+#include "thread.h"
 
-// Comparison function for AVL tree nodes based on score (and optionally name for tie-breaking)
-bool zless(const AVLNode *a, const AVLNode *b) {
-    const ZNode *za = container_of(a, ZNode, tnode);
-    const ZNode *zb = container_of(b, ZNode, tnode);
-    if (za->score != zb->score) {
-        return za->score < zb->score;
+uint32_t g_zset_index = ZS_AVL;
+uint32_t g_zset_small_max = 128;
+uint32_t g_zset_small_len = 64;
+
+// Order a member against a (score, name) pair: <0, 0 or >0
+static int zcmp(const ZNode *a, double score, const char *name, size_t len) {
+    if (a->score != score) {
+        return a->score < score ? -1 : 1;
     }
     // Tie-breaker: compare names lexicographically
-    size_t min_len = za->len < zb->len ? za->len : zb->len;
-    int cmp = memcmp(za->name, zb->name, min_len);
+    size_t min_len = a->len < len ? a->len : len;
+    int cmp = memcmp(a->name, name, min_len);
     if (cmp != 0) {
-        return cmp < 0;
+        return cmp;
+    }
+    return a->len < len ? -1 : (a->len > len ? 1 : 0);
+}
+
+static ZNode *tnode_znode(AVLNode *tnode) {
+    return links_znode(container_of(tnode, ZLinks, tnode));
+}
+
+static ZNode *hnode_znode(HNode *hnode) {
+    return links_znode(container_of(hnode, ZLinks, hnode));
+}
+
+// Compare a tree node against a (score, name) pair
+static bool zless(AVLNode *a, double score, const char *name, size_t len) {
+    return zcmp(tnode_znode(a), score, name, len) < 0;
+}
+
+// Comparison function for AVL tree nodes based on score (and optionally name for tie-breaking)
+static bool zless(AVLNode *a, AVLNode *b) {
+    const ZNode *zb = tnode_znode(b);
+    return zless(a, zb->score, zb->name, zb->len);
+}
+
+// ---- small encoding ----
+//
+// One buffer: a ZSmall header, then a uint32_t offset per member (padded
+// to 8 bytes), then the members as ZNode records padded to 8 bytes, in
+// (score, name) order. Ranks and score searches are binary searches over
+// the offsets; inserts and deletes memmove the tail.
+
+struct alignas(8) ZSmall { // keeps the records 8-byte aligned
+    uint32_t n = 0;     // members
+    uint32_t bytes = 0; // record bytes in use
+    uint32_t cap = 0;   // allocated bytes, header included
+};
+
+static size_t sm_rec_size(size_t len) {
+    return (sizeof(ZNode) + len + 7) & ~(size_t)7;
+}
+
+static size_t sm_idx_size(uint32_t n) {
+    return (n * sizeof(uint32_t) + 7) & ~(size_t)7;
+}
+
+static ZSmall *sm_hdr(ZSet *zset) {
+    return (ZSmall *)zset->small;
+}
+
+static uint32_t *sm_off(ZSmall *sm) {
+    return (uint32_t *)(sm + 1);
+}
+
+static uint8_t *sm_recs(ZSmall *sm) {
+    return (uint8_t *)(sm + 1) + sm_idx_size(sm->n);
+}
+
+static ZNode *sm_at(ZSmall *sm, uint32_t i) {
+    return (ZNode *)(sm_recs(sm) + sm_off(sm)[i]);
+}
+
+// Position of a record handed out by sm_at
+static uint32_t sm_pos(ZSmall *sm, ZNode *node) {
+    uint32_t off = (uint32_t)((uint8_t *)node - sm_recs(sm));
+    uint32_t *offs = sm_off(sm);
+    uint32_t i = (uint32_t)(std::lower_bound(offs, offs + sm->n, off) - offs);
+    assert(i < sm->n && offs[i] == off);
+    return i;
+}
+
+// Members are ordered by score, so a name lookup is a scan
+static uint32_t sm_find(ZSmall *sm, const char *name, size_t len) {
+    for (uint32_t i = 0; i < sm->n; i++) {
+        ZNode *node = sm_at(sm, i);
+        if (node->len == len && 0 == memcmp(node->name, name, len)) {
+            return i;
+        }
     }
-    return za->len < zb->len;
+    return sm->n;
 }
 
-ZNode *znode_new(const char *name, size_t len, double score) {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-    avl_init(&node->tnode);
-    node->hnode.next = NULL;
-    node->hnode.hcode = str_hash((uint8_t *)name, len);
+// The first position at or after (score, name)
+static uint32_t sm_lower(ZSmall *sm, double score, const char *name, size_t len) {
+    uint32_t lo = 0, hi = sm->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (zcmp(sm_at(sm, mid), score, name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static uint64_t sm_count_below(ZSmall *sm, double score, bool inclusive) {
+    uint32_t lo = 0, hi = sm->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        double cur = sm_at(sm, mid)->score;
+        if (cur < score || (inclusive && cur == score)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void sm_insert(ZSet *zset, const char *name, size_t len, double score) {
+    ZSmall *sm = sm_hdr(zset);
+    uint32_t n = sm ? sm->n : 0;
+    size_t rec = sm_rec_size(len);
+    size_t need = sizeof(ZSmall) + sm_idx_size(n + 1) + (sm ? sm->bytes : 0) + rec;
+    if (!sm || need > sm->cap) {
+        size_t cap = sm ? std::max(need, (size_t)sm->cap * 3 / 2) : need;
+        uint8_t *buf = (uint8_t *)realloc(zset->small, cap);
+        if (!buf) {
+            die("out of memory");
+        }
+        zset->small = buf;
+        if (!sm) {
+            new (buf) ZSmall();
+        }
+        sm = sm_hdr(zset);
+        sm->cap = (uint32_t)cap;
+    }
+    uint32_t pos = sm_lower(sm, score, name, len);
+    uint32_t at = pos < n ? sm_off(sm)[pos] : sm->bytes; // record offset
+    uint8_t *old_recs = sm_recs(sm);
+    uint8_t *new_recs = (uint8_t *)(sm + 1) + sm_idx_size(n + 1);
+    // records after the new one move by the record size, plus the index
+    // growth; the ones before only by the index growth
+    memmove(new_recs + at + rec, old_recs + at, sm->bytes - at);
+    memmove(new_recs, old_recs, at);
+    uint32_t *offs = sm_off(sm);
+    memmove(offs + pos + 1, offs + pos, (n - pos) * sizeof(uint32_t));
+    for (uint32_t i = pos + 1; i <= n; i++) {
+        offs[i] += (uint32_t)rec;
+    }
+    offs[pos] = at;
+    sm->n = n + 1;
+    sm->bytes += (uint32_t)rec;
+    ZNode *node = (ZNode *)(new_recs + at);
+    node->score = score;
+    node->len = len;
+    memcpy(node->name, name, len);
+}
+
+static void sm_erase(ZSet *zset, uint32_t pos) {
+    ZSmall *sm = sm_hdr(zset);
+    uint32_t n = sm->n;
+    uint32_t at = sm_off(sm)[pos];
+    size_t rec = sm_rec_size(sm_at(sm, pos)->len);
+    uint8_t *old_recs = sm_recs(sm);
+    uint8_t *new_recs = (uint8_t *)(sm + 1) + sm_idx_size(n - 1);
+    // the records move down over the end of the index, so update it first
+    uint32_t *offs = sm_off(sm);
+    memmove(offs + pos, offs + pos + 1, (n - pos - 1) * sizeof(uint32_t));
+    for (uint32_t i = pos; i + 1 < n; i++) {
+        offs[i] -= (uint32_t)rec;
+    }
+    memmove(new_recs, old_recs, at);
+    memmove(new_recs + at, old_recs + at + rec, sm->bytes - at - rec);
+    sm->n = n - 1;
+    sm->bytes -= (uint32_t)rec;
+}
+
+// ---- indexed encoding ----
+
+static size_t znode_size(size_t len) {
+    return sizeof(ZLinks) + sizeof(ZNode) + len;
+}
+
+static ZNode *znode_new(ZIndex *big, const char *name, size_t len, double score, uint64_t hcode) {
+    ZLinks *links = (ZLinks *)arena_alloc(&big->arena, znode_size(len));
+    avl_init(&links->tnode);
+    links->hnode.next = NULL;
+    links->hnode.hcode = hcode;
+    ZNode *node = links_znode(links);
     node->score = score;
     node->len = len;
     memcpy(&node->name[0],name,len);
     return node;
 }
 
-bool hcmp(HNode *node, HNode *key) {
-    ZNode *znode = container_of(node, ZNode, hnode);
+static void znode_free(ZIndex *big, ZNode *node) {
+    arena_free(&big->arena, znode_links(node), znode_size(node->len));
+}
+
+static bool hcmp(HNode *node, HNode *key) {
+    ZNode *znode = hnode_znode(node);
     HKey *hkey = container_of(key,HKey,node);
     if (znode->len != hkey->len) {
         return false;
@@ -53,82 +236,301 @@ bool hcmp(HNode *node, HNode *key) {
     return 0 == memcmp(znode->name, hkey->name, znode->len);
 }
 
+static void tree_add(ZSet *zset, ZNode *node) {
+    ZIndex *big = zset->big;
+    if (zset->index == ZS_BTREE) {
+        bt_insert(&big->btree, node);
+        return;
+    }
+    AVLNode *tnode = &znode_links(node)->tnode;
+    AVLNode *cur = NULL;
+    AVLNode **from = &big->tree;
+    while (*from) {
+        cur = *from;
+        from = zless(tnode,cur) ? &cur->left : &cur->right;
+    }
+    *from = tnode;
+    tnode->parent = cur;
+    big->tree = avl_fix(tnode);
+}
 
+static void tree_del(ZSet *zset, ZNode *node) {
+    if (zset->index == ZS_BTREE) {
+        bt_remove(&zset->big->btree, node);
+    } else {
+        zset->big->tree = avl_del(&znode_links(node)->tnode);
+    }
+}
+
+static void zset_update(ZSet *zset, ZNode *node,double score) {
+    if (node->score == score) {
+        return;
+    }
+    tree_del(zset, node);
+    node->score = score;
+    avl_init(&znode_links(node)->tnode);
+    tree_add(zset,node);
+}
+
+struct ZMake {
+    ZIndex *big;
+    double score;
+};
+
+static HNode *znode_make(HNode *key, void *arg) {
+    HKey *hkey = container_of(key, HKey, node);
+    ZMake *make = (ZMake *)arg;
+    return &znode_links(znode_new(make->big, hkey->name, hkey->len, make->score, key->hcode))->hnode;
+}
+
+static bool big_add(ZSet *zset, const char *name, size_t len, double score) {
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    bool inserted = false;
+    ZMake make = {zset->big, score};
+    HNode *hnode = hm_find_or_insert(&zset->big->hmap, &key.node, &hcmp, &znode_make, &make, &inserted);
+    ZNode *node = hnode_znode(hnode);
+    if (inserted) {
+        tree_add(zset, node);
+    } else {
+        zset_update(zset, node, score);
+    }
+    return inserted;
+}
+
+// Move the members of a small set into a new index, for good
+static void zset_convert(ZSet *zset) {
+    zset->big = new ZIndex();
+    ZSmall *sm = sm_hdr(zset);
+    for (uint32_t i = 0; sm && i < sm->n; i++) {
+        ZNode *node = sm_at(sm, i);
+        big_add(zset, node->name, node->len, node->score);
+    }
+    free(zset->small);
+    zset->small = NULL;
+}
+
+// ---- public interface ----
 
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len) {
-    if (!zset-> tree) {
+    if (!zset->big) {
+        ZSmall *sm = sm_hdr(zset);
+        uint32_t i = sm ? sm_find(sm, name, len) : 0;
+        return sm && i < sm->n ? sm_at(sm, i) : NULL;
+    }
+    if (zset_size(zset) == 0) {
         return NULL;
     }
     HKey key;
     key.node.hcode = str_hash((uint8_t *)name, len);
     key.name = name;
     key.len = len;
-    HNode *found = hm_lookup(&zset->hmap,&key.node,&hcmp);
-    return found ? container_of(found,ZNode,hnode) : NULL;
+    HNode *found = hm_lookup(&zset->big->hmap,&key.node,&hcmp);
+    return found ? hnode_znode(found) : NULL;
 }
 
-void tree_add(ZSet *zset, ZNode *node) {
-    AVLNode *cur = NULL;
-    AVLNode **from = &zset->tree;
-    while (*from) {
-        cur = *from;
-        from = zless(&node->tnode,cur) ? &cur->left : &cur->right;
+bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
+    if (!zset->big) {
+        ZSmall *sm = sm_hdr(zset);
+        uint32_t i = sm ? sm_find(sm, name, len) : 0;
+        if (sm && i < sm->n) {
+            if (sm_at(sm, i)->score != score) {
+                sm_erase(zset, i);
+                sm_insert(zset, name, len, score);
+            }
+            return false;
+        }
+        uint32_t n = sm ? sm->n : 0;
+        if (n < g_zset_small_max && len <= g_zset_small_len) {
+            sm_insert(zset, name, len, score);
+            return true;
+        }
+        zset_convert(zset);
     }
-    *from = &node->tnode;
-    node->tnode.parent = cur;
-    zset->tree = avl_fix(&node->tnode);
+    return big_add(zset, name, len, score);
 }
 
-void zset_update(ZSet *zset, ZNode *node,double score) {
-    if (node->score == score) {
+static bool allowed(bool exists, double cur, double score, uint32_t flags) {
+    if (!exists) {
+        return !(flags & ZADD_XX);
+    }
+    if (flags & ZADD_NX) {
+        return false;
+    }
+    if ((flags & ZADD_GT) && !(score > cur)) {
+        return false;
+    }
+    return !(flags & ZADD_LT) || score < cur;
+}
+
+bool zadd_allowed(const ZNode *cur, double score, uint32_t flags) {
+    return allowed(cur != NULL, cur ? cur->score : 0, score, flags);
+}
+
+static uint64_t add_each(ZSet *zset, const ZAddItem *items, size_t n, uint32_t flags, uint64_t *changed) {
+    uint64_t added = 0;
+    for (size_t i = 0; i < n; i++) {
+        const ZAddItem &item = items[i];
+        ZNode *cur = zset_lookup(zset, item.name, item.len);
+        if (!zadd_allowed(cur, item.score, flags) || (cur && cur->score == item.score)) {
+            continue;
+        }
+        added += zset_add(zset, item.name, item.len, item.score);
+        (*changed)++;
+    }
+    return added;
+}
+
+// A member rescored by a bulk add is flagged through its index links,
+// which the rebuild overwrites anyway
+static void links_flag(ZSet *zset, ZNode *node) {
+    if (zset->index == ZS_BTREE) {
+        znode_links(node)->leaf = NULL;
+    } else {
+        znode_links(node)->tnode.count = 0;
+    }
+}
+
+static bool links_flagged(ZSet *zset, ZNode *node) {
+    if (zset->index == ZS_BTREE) {
+        return znode_links(node)->leaf == NULL;
+    }
+    return znode_links(node)->tnode.count == 0;
+}
+
+// Members keyed by score, so sorting and merging mostly compare doubles
+// in place and only read a member's name to break a tie
+typedef std::pair<double, ZNode *> ZKey;
+
+static bool zkey_less(const ZKey &a, const ZKey &b) {
+    if (a.first != b.first) {
+        return a.first < b.first;
+    }
+    return zcmp(a.second, b.first, b.second->name, b.second->len) < 0;
+}
+
+// Replace the index over members already in (score, name) order, in O(n)
+static void index_build(ZSet *zset, const std::vector<ZKey> &keys) {
+    ZIndex *big = zset->big;
+    if (zset->index == ZS_BTREE) {
+        std::vector<ZNode *> nodes(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            nodes[i] = keys[i].second;
+        }
+        bt_clear(&big->btree, NULL);
+        bt_build(&big->btree, nodes.data(), nodes.size());
         return;
     }
-    zset->tree = avl_del(&node->tnode);
-    node->score = score;
-    avl_init(&node->tnode);
-    tree_add(zset,node);
+    std::vector<AVLNode *> tnodes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        tnodes[i] = &znode_links(keys[i].second)->tnode;
+    }
+    big->tree = avl_build(tnodes.data(), tnodes.size());
 }
 
-bool zset_add(ZSet *zset, const char *name, size_t len, double score) {
-    ZNode *node = zset_lookup(zset,name,len);
-    if (node) {
-        zset_update(zset, node, score);
-        return false;
+// Apply the pairs through the hash table alone, then sort the members
+// that are new or moved, merge them with the rest in order and rebuild
+// the index, instead of n separate inserts and rebalances
+static uint64_t add_bulk(ZSet *zset, const ZAddItem *items, size_t n, uint32_t flags, uint64_t *changed) {
+    if (!zset->big) {
+        zset_convert(zset);
     }
-    else {
-        node = znode_new(name,len,score);
-        hm_insert(&zset->hmap, &node->hnode);
-        tree_add(zset,node);
-        return true;
+    ZIndex *big = zset->big;
+    std::vector<ZKey> keys;
+    keys.reserve(zset_size(zset) + n);
+    for (ZNode *node = zset_nth(zset, 0); node; node = znode_next(zset, node)) {
+        keys.push_back({node->score, node});
+    }
+    size_t nold = keys.size();
+    uint64_t added = 0;
+    size_t moved = 0; // old members in keys[nold..]
+    for (size_t i = 0; i < n; i++) {
+        const ZAddItem &item = items[i];
+        HKey key;
+        key.node.hcode = str_hash((uint8_t *)item.name, item.len);
+        key.name = item.name;
+        key.len = item.len;
+        HNode *hnode = hm_lookup(&big->hmap, &key.node, &hcmp);
+        ZNode *cur = hnode ? hnode_znode(hnode) : NULL;
+        if (!zadd_allowed(cur, item.score, flags) || (cur && cur->score == item.score)) {
+            continue;
+        }
+        (*changed)++;
+        if (!cur) {
+            cur = znode_new(big, item.name, item.len, item.score, key.node.hcode);
+            hm_insert(&big->hmap, &znode_links(cur)->hnode);
+            links_flag(zset, cur);
+            keys.push_back({0, cur});
+            added++;
+        } else if (!links_flagged(zset, cur)) {
+            links_flag(zset, cur);
+            keys.push_back({0, cur});
+            moved++;
+        }
+        cur->score = item.score;
+    }
+    if (keys.size() == nold) {
+        return added;
     }
+    for (size_t i = nold; i < keys.size(); i++) {
+        keys[i].first = keys[i].second->score;
+    }
+    auto mid = std::remove_if(keys.begin(), keys.begin() + nold,
+                              [&](const ZKey &k) { return links_flagged(zset, k.second); });
+    mid = std::copy(keys.begin() + nold, keys.end(), mid);
+    keys.resize(mid - keys.begin());
+    auto fresh = keys.begin() + (nold - moved);
+    std::sort(fresh, keys.end(), zkey_less);
+    std::inplace_merge(keys.begin(), fresh, keys.end(), zkey_less);
+    index_build(zset, keys);
+    return added;
+}
+
+uint64_t zset_add_batch(ZSet *zset, const ZAddItem *items, size_t n, uint32_t flags, uint64_t *changed) {
+    *changed = 0;
+    bool bulk = n >= k_zadd_bulk_min && n >= zset_size(zset) / 2
+             && (zset->big || (n > g_zset_small_max && !(flags & ZADD_XX)));
+    return bulk ? add_bulk(zset, items, n, flags, changed) : add_each(zset, items, n, flags, changed);
 }
 
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len) {
+bool zset_remove(ZSet *zset, const char *name, size_t len) {
+    if (!zset->big) {
+        ZSmall *sm = sm_hdr(zset);
+        uint32_t i = sm ? sm_find(sm, name, len) : 0;
+        if (!sm || i == sm->n) {
+            return false;
+        }
+        sm_erase(zset, i);
+        return true;
+    }
     ZNode *node = zset_lookup(zset,name,len);
     if (!node) {
-        return NULL;
+        return false;
     }
-    zset->tree = avl_del(&node->tnode);
-    hm_delete(&zset->hmap, &node->hnode);
-    return node;
-}
-
-void znode_del(ZNode *node){
-    free(node);
+    tree_del(zset, node);
+    HKey key;
+    key.node.hcode = znode_links(node)->hnode.hcode;
+    key.name = name;
+    key.len = len;
+    hm_delete(&zset->big->hmap, &key.node, &hcmp);
+    znode_free(zset->big, node);
+    return true;
 }
 
 ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
+    if (!zset->big) {
+        ZSmall *sm = sm_hdr(zset);
+        uint32_t i = sm ? sm_lower(sm, score, name, len) : 0;
+        return sm && i < sm->n ? sm_at(sm, i) : NULL;
+    }
+    if (zset->index == ZS_BTREE) {
+        return bt_seek(&zset->big->btree, score, name, len);
+    }
     AVLNode *found = NULL;
-
-    // Create a temporary ZNode for comparison
-    ZNode temp;
-    avl_init(&temp.tnode);
-    temp.score = score;
-    temp.len = len;
-    memcpy(temp.name, name, len);
-
-    for (AVLNode *cur = zset->tree; cur;) {
-        if (zless(cur, &temp.tnode)) {
+    for (AVLNode *cur = zset->big->tree; cur;) {
+        if (zless(cur, score, name, len)) {
             cur = cur->right;
         }
         else {
@@ -136,7 +538,7 @@ ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len) {
             cur = cur->left;
         }
     }
-    return found ? container_of(found, ZNode, tnode) : NULL;
+    return found ? tnode_znode(found) : NULL;
 }
 
 AVLNode *avl_offset(AVLNode *node, double offset) {
@@ -168,23 +570,365 @@ AVLNode *avl_offset(AVLNode *node, double offset) {
 }
 
 
-ZNode *znode_offset(ZNode *node, int64_t offset) {
-    AVLNode *tnode = node ? avl_offset(&node->tnode, offset) : NULL;
-    return tnode ? container_of(tnode, ZNode, tnode) : NULL;
+uint64_t zset_size(ZSet *zset) {
+    if (!zset->big) {
+        return zset->small ? sm_hdr(zset)->n : 0;
+    }
+    ZIndex *big = zset->big;
+    return zset->index == ZS_BTREE ? big->btree.size : avl_count(big->tree);
+}
+
+uint64_t znode_rank(ZSet *zset, ZNode *node) {
+    if (!zset->big) {
+        return sm_pos(sm_hdr(zset), node);
+    }
+    return zset->index == ZS_BTREE ? bt_rank(node) : avl_rank(&znode_links(node)->tnode);
+}
+
+ZNode *zset_nth(ZSet *zset, uint64_t rank) {
+    if (!zset->big) {
+        return rank < zset_size(zset) ? sm_at(sm_hdr(zset), (uint32_t)rank) : NULL;
+    }
+    if (zset->index == ZS_BTREE) {
+        return bt_nth(&zset->big->btree, rank);
+    }
+    AVLNode *tnode = avl_nth(zset->big->tree, rank);
+    return tnode ? tnode_znode(tnode) : NULL;
+}
+
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive) {
+    if (!zset->big) {
+        return zset->small ? sm_count_below(sm_hdr(zset), score, inclusive) : 0;
+    }
+    if (zset->index == ZS_BTREE) {
+        return bt_count_below(&zset->big->btree, score, inclusive);
+    }
+    uint64_t count = 0;
+    for (AVLNode *cur = zset->big->tree; cur;) {
+        double cur_score = tnode_znode(cur)->score;
+        if (cur_score < score || (inclusive && cur_score == score)) {
+            count += avl_count(cur->left) + 1;
+            cur = cur->right;
+        } else {
+            cur = cur->left;
+        }
+    }
+    return count;
 }
 
-// Helper to recursively free AVL tree nodes
-static void free_avl_nodes(AVLNode* node) {
-    if (!node) return;
-    free_avl_nodes(node->left);
-    free_avl_nodes(node->right);
-    ZNode* znode = container_of(node, ZNode, tnode);
-    free(znode);
+ZNode *znode_next(ZSet *zset, ZNode *node) {
+    if (!zset->big) {
+        return zset_nth(zset, znode_rank(zset, node) + 1);
+    }
+    if (zset->index == ZS_BTREE) {
+        return bt_next(node);
+    }
+    AVLNode *tnode = avl_next(&znode_links(node)->tnode);
+    return tnode ? tnode_znode(tnode) : NULL;
 }
 
+ZNode *znode_prev(ZSet *zset, ZNode *node) {
+    if (!zset->big) {
+        uint64_t rank = znode_rank(zset, node);
+        return rank ? zset_nth(zset, rank - 1) : NULL;
+    }
+    if (zset->index == ZS_BTREE) {
+        return bt_prev(node);
+    }
+    AVLNode *tnode = avl_prev(&znode_links(node)->tnode);
+    return tnode ? tnode_znode(tnode) : NULL;
+}
+
+ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset) {
+    if (!zset->big || zset->index == ZS_BTREE) {
+        // a relative rank: one climb to find the rank, one descent
+        int64_t rank = node ? (int64_t)znode_rank(zset, node) + offset : -1;
+        return rank >= 0 ? zset_nth(zset, (uint64_t)rank) : NULL;
+    }
+    AVLNode *tnode = node ? avl_offset(&znode_links(node)->tnode, offset) : NULL;
+    return tnode ? tnode_znode(tnode) : NULL;
+}
+
+// The members go with their arena chunks; only the B+-tree nodes, about
+// one per k_bt_order / 2 members, are freed one by one
 ZSet::~ZSet() {
-    free_avl_nodes(tree);
-    tree = nullptr;
-    // Clear hash map (nodes already freed)
+    free(small);
+    if (big) {
+        bt_clear(&big->btree, NULL);
+        hm_clear(&big->hmap);
+        arena_clear(&big->arena);
+        delete big;
+    }
 }
 
+// ---- union and intersection ----
+
+// One member of a copied source; the name lives in ZCombineSrc::names
+struct ZCombineMember {
+    size_t off = 0;
+    uint32_t len = 0;
+    double score = 0;
+    uint64_t hcode = 0;
+};
+
+struct ZCombineSrc {
+    bool missing = false; // the key held no set
+    double weight = 1;
+    std::string names;
+    std::vector<ZCombineMember> members; // in score order
+    std::vector<uint32_t> slots; // open addressing by hcode: index + 1, 0 empty
+};
+
+// Members [lo, hi) by rank of one source
+struct ZCombineTask {
+    ZCombine *zc = NULL;
+    size_t src = 0;
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    std::vector<ZAddItem> out;
+};
+
+struct ZCombine {
+    std::vector<ZCombineSrc> srcs;
+    uint32_t agg = ZAGG_SUM;
+    bool inter = false;
+    std::vector<size_t> walk; // the sources whose members are produced
+    std::vector<ZCombineTask> tasks;
+    ZSet *result = NULL;
+    // while split across a thread pool
+    ThreadPool *tp = NULL;
+    void (*done)(void *) = NULL;
+    void *arg = NULL;
+    std::atomic<size_t> pending{0};
+};
+
+// inf * 0 and inf - inf count as 0
+static double weigh(double score, double weight) {
+    double val = score * weight;
+    return std::isnan(val) ? 0 : val;
+}
+
+static double fold(double acc, double score, uint32_t agg) {
+    if (agg == ZAGG_MIN) {
+        return std::min(acc, score);
+    }
+    if (agg == ZAGG_MAX) {
+        return std::max(acc, score);
+    }
+    double val = acc + score;
+    return std::isnan(val) ? 0 : val;
+}
+
+ZCombine *zcombine_new(ZSet **srcs, const double *weights, size_t n, uint32_t agg, bool inter) {
+    ZCombine *zc = new ZCombine();
+    zc->agg = agg;
+    zc->inter = inter;
+    zc->srcs.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        zc->srcs[i].weight = weights[i];
+        zc->srcs[i].missing = !srcs[i];
+        if (inter && !srcs[i]) {
+            return zc; // nothing is in every set
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        ZCombineSrc &src = zc->srcs[i];
+        if (src.missing) {
+            continue;
+        }
+        // a flat copy; the set itself may change once we are back on the loop
+        src.members.reserve(zset_size(srcs[i]));
+        for (ZNode *node = zset_nth(srcs[i], 0); node; node = znode_next(srcs[i], node)) {
+            ZCombineMember member;
+            member.off = src.names.size();
+            member.len = (uint32_t)node->len;
+            member.score = node->score;
+            src.names.append(node->name, node->len);
+            src.members.push_back(member);
+        }
+        // all of them, or the smallest one
+        if (!inter || zc->walk.empty()) {
+            zc->walk.push_back(i);
+        } else if (src.members.size() < zc->srcs[zc->walk[0]].members.size()) {
+            zc->walk[0] = i;
+        }
+    }
+    for (size_t i : zc->walk) {
+        uint64_t size = zc->srcs[i].members.size();
+        for (uint64_t lo = 0; lo < size; lo += k_combine_chunk) {
+            ZCombineTask task;
+            task.zc = zc;
+            task.src = i;
+            task.lo = lo;
+            task.hi = std::min(size, lo + k_combine_chunk);
+            zc->tasks.push_back(std::move(task));
+        }
+    }
+    return zc;
+}
+
+// First phase, one source: hash its members and, unless only walked,
+// index them for lookups from the other sources
+static void combine_index(ZCombine *zc, size_t i) {
+    ZCombineSrc &src = zc->srcs[i];
+    for (ZCombineMember &member : src.members) {
+        member.hcode = str_hash((const uint8_t *)src.names.data() + member.off, member.len);
+    }
+    if (zc->srcs.size() < 2 || (zc->inter && i == zc->walk[0])) {
+        return;
+    }
+    size_t cap = 4;
+    while (cap < 2 * src.members.size()) {
+        cap *= 2;
+    }
+    src.slots.assign(cap, 0);
+    for (size_t k = 0; k < src.members.size(); k++) {
+        size_t pos = src.members[k].hcode & (cap - 1);
+        while (src.slots[pos]) {
+            pos = (pos + 1) & (cap - 1);
+        }
+        src.slots[pos] = (uint32_t)k + 1;
+    }
+}
+
+static const ZCombineMember *combine_lookup(const ZCombineSrc &src, const char *name, uint32_t len, uint64_t hcode) {
+    size_t mask = src.slots.size() - 1;
+    for (size_t pos = hcode & mask;; pos = (pos + 1) & mask) {
+        uint32_t idx = src.slots[pos];
+        if (!idx) {
+            return NULL;
+        }
+        const ZCombineMember &member = src.members[idx - 1];
+        if (member.hcode == hcode && member.len == len
+                && memcmp(src.names.data() + member.off, name, len) == 0) {
+            return &member;
+        }
+    }
+}
+
+// Second phase. An intersection walks one source and needs a member in all
+// the others. A union walks every source and takes a member at the first
+// one holding it, so each member is produced by exactly one task.
+static void combine_range(ZCombineTask *task) {
+    ZCombine *zc = task->zc;
+    const ZCombineSrc &src = zc->srcs[task->src];
+    for (uint64_t k = task->lo; k < task->hi; k++) {
+        const ZCombineMember &member = src.members[k];
+        const char *name = src.names.data() + member.off;
+        double score = weigh(member.score, src.weight);
+        bool keep = true;
+        for (size_t i = 0; i < zc->srcs.size() && keep; i++) {
+            if (i == task->src || zc->srcs[i].missing) {
+                continue;
+            }
+            const ZCombineMember *other = combine_lookup(zc->srcs[i], name, member.len, member.hcode);
+            if (!other) {
+                keep = !zc->inter;
+            } else if (!zc->inter && i < task->src) {
+                keep = false; // produced by an earlier source
+            } else {
+                score = fold(score, weigh(other->score, zc->srcs[i].weight), zc->agg);
+            }
+        }
+        if (keep) {
+            task->out.push_back(ZAddItem{name, member.len, score});
+        }
+    }
+}
+
+// Last phase: load the result in bulk
+static void combine_build(ZCombine *zc) {
+    std::vector<ZAddItem> items;
+    for (ZCombineTask &task : zc->tasks) {
+        items.insert(items.end(), task.out.begin(), task.out.end());
+        std::vector<ZAddItem>().swap(task.out);
+    }
+    zc->result = new ZSet();
+    uint64_t changed = 0;
+    zset_add_batch(zc->result, items.data(), items.size(), 0, &changed);
+}
+
+void zcombine_run(ZCombine *zc) {
+    if (!zc->walk.empty()) {
+        for (size_t i = 0; i < zc->srcs.size(); i++) {
+            combine_index(zc, i);
+        }
+    }
+    for (ZCombineTask &task : zc->tasks) {
+        combine_range(&task);
+    }
+    combine_build(zc);
+}
+
+// Pool tasks; the last one of each phase starts the next
+static void combine_range_task(void *arg) {
+    ZCombineTask *task = (ZCombineTask *)arg;
+    ZCombine *zc = task->zc;
+    combine_range(task);
+    if (zc->pending.fetch_sub(1) == 1) {
+        combine_build(zc);
+        zc->done(zc->arg);
+    }
+}
+
+static void combine_ranges_start(ZCombine *zc) {
+    if (zc->tasks.empty()) {
+        combine_build(zc);
+        zc->done(zc->arg);
+        return;
+    }
+    // the last task may free zc before this loop ends, so copy what we need
+    ThreadPool *tp = zc->tp;
+    ZCombineTask *tasks = zc->tasks.data();
+    size_t n = zc->tasks.size();
+    zc->pending = n;
+    for (size_t i = 0; i < n; i++) {
+        thread_pool_queue(tp, combine_range_task, &tasks[i]);
+    }
+}
+
+struct ZCombineIndex {
+    ZCombine *zc;
+    size_t src;
+};
+
+static void combine_index_task(void *arg) {
+    ZCombineIndex *index = (ZCombineIndex *)arg;
+    ZCombine *zc = index->zc;
+    combine_index(zc, index->src);
+    delete index;
+    if (zc->pending.fetch_sub(1) == 1) {
+        combine_ranges_start(zc);
+    }
+}
+
+void zcombine_start(ZCombine *zc, ThreadPool *tp, void (*done)(void *), void *arg) {
+    zc->tp = tp;
+    zc->done = done;
+    zc->arg = arg;
+    std::vector<size_t> present;
+    for (size_t i = 0; i < zc->srcs.size() && !zc->walk.empty(); i++) {
+        if (!zc->srcs[i].missing) {
+            present.push_back(i);
+        }
+    }
+    if (present.empty()) {
+        combine_ranges_start(zc);
+        return;
+    }
+    zc->pending = present.size();
+    for (size_t i : present) {
+        thread_pool_queue(tp, combine_index_task, new ZCombineIndex{zc, i});
+    }
+}
+
+ZSet *zcombine_result(ZCombine *zc) {
+    ZSet *result = zc->result;
+    zc->result = NULL;
+    return result;
+}
+
+void zcombine_free(ZCombine *zc) {
+    delete zc->result;
+    delete zc;
+}
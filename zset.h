@@ -16,24 +16,126 @@
 #include <sys/select.h>
 #include "hashtable.h" 
 #include "AVL.h"
+#include "btree.h"
+#include "arena.h"
 
-struct ZSet {
-    AVLNode *tree = NULL;
-    HMap hmap;
-    ~ZSet();
+enum {
+    ZS_AVL = 0,   // AVL tree threaded through the members
+    ZS_BTREE = 1, // B+-tree of (score, member) arrays
 };
 
+// Index for sets created from now on
+extern uint32_t g_zset_index;
+// A set stays in the small encoding while it has at most this many
+// members, none with a longer name; 0 members disables the encoding
+extern uint32_t g_zset_small_max;
+extern uint32_t g_zset_small_len;
+
+// What callers see of a member. In an indexed set it follows its ZLinks
+// in one allocation; in a small set it is a record in the set's buffer,
+// valid until the set is next modified.
 struct ZNode {
-    AVLNode tnode;
-    HNode hnode;
     double score = 0;
     size_t len = 0;
     char name[0];
 };
 
+struct ZLinks {
+    union {
+        AVLNode tnode; // ZS_AVL
+        BTLeaf *leaf;  // ZS_BTREE: the leaf holding this member
+    };
+    HNode hnode;
+};
+
+inline ZLinks *znode_links(ZNode *node) {
+    return (ZLinks *)((char *)node - sizeof(ZLinks));
+}
+
+inline ZNode *links_znode(ZLinks *links) {
+    return (ZNode *)(links + 1);
+}
+
+// Members indexed by name and by (score, name). The members themselves
+// live in `arena`, so dropping the index frees them chunk by chunk.
+struct ZIndex {
+    AVLNode *tree = NULL;
+    BTree btree;
+    HMap hmap;
+    Arena arena;
+};
+
+// Small sets keep their members as ZNode records, sorted by (score, name)
+// in one buffer (see zset.cpp); a set converts to a ZIndex for good once
+// it crosses a threshold.
+struct ZSet {
+    uint32_t index = g_zset_index; // fixed for the set's lifetime
+    uint8_t *small = NULL;
+    ZIndex *big = NULL;
+    ~ZSet();
+};
+
 ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len);
-ZNode *znode_offset(ZNode *node, int64_t offset);
+ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset);
+// In-order neighbours for walking a range, amortized O(1) per step
+ZNode *znode_next(ZSet *zset, ZNode *node);
+ZNode *znode_prev(ZSet *zset, ZNode *node);
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
+
+// ZADD conditions. NX only adds new members and XX only updates existing
+// ones; GT and LT only update a member to a greater or lower score.
+enum {
+    ZADD_NX = 1,
+    ZADD_XX = 2,
+    ZADD_GT = 4,
+    ZADD_LT = 8,
+};
+
+struct ZAddItem {
+    const char *name;
+    size_t len;
+    double score;
+};
+
+// Batches of at least this many pairs, and at least half the set's size,
+// rebuild the index from sorted members instead of inserting one by one
+const size_t k_zadd_bulk_min = 64;
+
+// Whether `flags` let a member at `cur` (NULL if absent) take `score`
+bool zadd_allowed(const ZNode *cur, double score, uint32_t flags);
+// Applies the pairs in order, as that many single adds would. Returns the
+// members added; `*changed` also counts the pairs that changed a score.
+uint64_t zset_add_batch(ZSet *zset, const ZAddItem *items, size_t n, uint32_t flags, uint64_t *changed);
+
+// How ZUNIONSTORE and ZINTERSTORE fold the scores of one member
+enum {
+    ZAGG_SUM = 0,
+    ZAGG_MIN = 1,
+    ZAGG_MAX = 2,
+};
+
+// Members walked per thread-pool task by a ZCombine
+const uint64_t k_combine_chunk = 1 << 14;
+
+struct ThreadPool;
+struct ZCombine;
+// ZUNIONSTORE/ZINTERSTORE: the union, or the intersection if `inter`, of
+// srcs[0..n), where NULL is an empty set. Scores are scaled by their set's
+// weight and folded by `agg`. The members are copied here, so the sources
+// may change or go while the combine runs.
+ZCombine *zcombine_new(ZSet **srcs, const double *weights, size_t n, uint32_t agg, bool inter);
+// Runs it on the calling thread
+void zcombine_run(ZCombine *zc);
+// Splits it across the workers of `tp`; the last one calls done(arg)
+void zcombine_start(ZCombine *zc, ThreadPool *tp, void (*done)(void *), void *arg);
+// The combined set once it has run, now owned by the caller
+ZSet *zcombine_result(ZCombine *zc);
+void zcombine_free(ZCombine *zc);
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-void znode_del(ZNode *node);
\ No newline at end of file
+bool zset_remove(ZSet *zset, const char *name, size_t len);
+// Order statistics, O(log n) once the set is indexed
+uint64_t zset_size(ZSet *zset);
+uint64_t znode_rank(ZSet *zset, ZNode *node);
+ZNode *zset_nth(ZSet *zset, uint64_t rank);
+// Members scoring below `score`, or at most `score` if `inclusive`
+uint64_t zset_count_below(ZSet *zset, double score, bool inclusive);